@@ -0,0 +1,218 @@
+// -*- compile-command: "base=arena; gcc -Wall -Werror -ggdb -DARENA_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c" -*-
+
+#include <stdio.h>
+#include <stdint.h>    // for uintptr_t
+#include <stdlib.h>    // for malloc()
+#include <string.h>    // for memset()
+
+#include "arena.h"
+#include "logging.h"
+
+static inline char *block_data(MTKArenaBlock *block) { return (char*)(block + 1); }
+
+static inline char *align_up(char *ptr)
+{
+   return (char*)(((uintptr_t)ptr + ARENA_ALIGNMENT - 1) & ~(uintptr_t)(ARENA_ALIGNMENT - 1));
+}
+
+void arena_init(MTKArena *arena, void *buffer, size_t buffer_len)
+{
+   memset(arena, 0, sizeof(MTKArena));
+
+   if (buffer)
+   {
+      arena->first = (char*)buffer;
+      arena->first_len = buffer_len;
+   }
+
+   arena->block_size = ARENA_BLOCK_SIZE;
+   arena_reset(arena);
+}
+
+/**
+ * Move to the next block with at least *size* bytes, reusing one
+ * left from before the last reset or allocating a new one.
+ */
+static int arena_next_block(MTKArena *arena, size_t size)
+{
+   MTKArenaBlock *block = arena->current ? arena->current->next : arena->blocks;
+
+   while (block && block->size < size)
+      block = block->next;
+
+   if (!block)
+   {
+      size_t block_size = size > arena->block_size ? size : arena->block_size;
+
+      block = (MTKArenaBlock*)malloc(sizeof(MTKArenaBlock) + block_size);
+      if (!block)
+      {
+         log_error_message(1, "Arena failed to allocate a new block.", NULL);
+         return 0;
+      }
+
+      block->size = block_size;
+
+      if (arena->current)
+      {
+         block->next = arena->current->next;
+         arena->current->next = block;
+      }
+      else
+      {
+         block->next = arena->blocks;
+         arena->blocks = block;
+      }
+   }
+
+   arena->current = block;
+   arena->ptr = block_data(block);
+   arena->end = arena->ptr + block->size;
+
+   return 1;
+}
+
+void *arena_alloc(MTKArena *arena, size_t size)
+{
+   char *aligned;
+
+   if (size == 0)
+      size = 1;
+
+   aligned = arena->ptr ? align_up(arena->ptr) : NULL;
+
+   if (!aligned || aligned > arena->end || size > (size_t)(arena->end - aligned))
+   {
+      if (!arena_next_block(arena, size))
+         return NULL;
+
+      // Block data is always aligned:
+      aligned = arena->ptr;
+   }
+
+   arena->ptr = aligned + size;
+   return aligned;
+}
+
+void *arena_calloc(MTKArena *arena, size_t size)
+{
+   void *memory = arena_alloc(arena, size);
+   if (memory)
+      memset(memory, 0, size);
+
+   return memory;
+}
+
+char *arena_strndup(MTKArena *arena, const char *str, size_t len)
+{
+   char *copy = (char*)arena_alloc(arena, len + 1);
+   if (copy)
+   {
+      memcpy(copy, str, len);
+      copy[len] = '\0';
+   }
+
+   return copy;
+}
+
+void arena_reset(MTKArena *arena)
+{
+   arena->current = NULL;
+   arena->ptr = arena->first;
+   arena->end = arena->first ? arena->first + arena->first_len : NULL;
+}
+
+void arena_release(MTKArena *arena)
+{
+   MTKArenaBlock *block = arena->blocks;
+   MTKArenaBlock *next;
+
+   while (block)
+   {
+      next = block->next;
+      free(block);
+      block = next;
+   }
+
+   arena->blocks = NULL;
+   arena_reset(arena);
+}
+
+size_t arena_capacity(const MTKArena *arena)
+{
+   const MTKArenaBlock *block = arena->blocks;
+   size_t capacity = arena->first_len;
+
+   while (block)
+   {
+      capacity += block->size;
+      block = block->next;
+   }
+
+   return capacity;
+}
+
+
+/************************************
+ * Conditionally-compiled test code.
+ ***********************************/
+
+#ifdef ARENA_MAIN
+
+#include "logging.c"
+
+int main(int argc, const char **argv)
+{
+   char first_block[256];
+   MTKArena arena;
+   int message, index, failed = 0;
+   size_t capacity = 0;
+   char *strings[100];
+   char label[32];
+
+   arena_init(&arena, first_block, sizeof(first_block));
+
+   // Simulate a session, allocating strings for each message, then resetting:
+   for (message = 0; message < 1000; ++message)
+   {
+      for (index = 0; index < 100; ++index)
+      {
+         sprintf(label, "message %d, string %d", message, index);
+         strings[index] = arena_strndup(&arena, label, strlen(label));
+         if (((uintptr_t)strings[index] % ARENA_ALIGNMENT) != 0)
+            ++failed;
+      }
+
+      // One allocation larger than a block:
+      memset(arena_alloc(&arena, ARENA_BLOCK_SIZE * 2), 0, ARENA_BLOCK_SIZE * 2);
+
+      for (index = 0; index < 100; ++index)
+      {
+         sprintf(label, "message %d, string %d", message, index);
+         if (strcmp(label, strings[index]))
+            ++failed;
+      }
+
+      if (message == 0)
+         capacity = arena_capacity(&arena);
+      else if (capacity != arena_capacity(&arena))
+      {
+         printf("Capacity changed from %lu to %lu after message %d.\n",
+                (unsigned long)capacity,
+                (unsigned long)arena_capacity(&arena),
+                message);
+         ++failed;
+      }
+
+      arena_reset(&arena);
+   }
+
+   printf("Arena capacity [32;1m%lu[m bytes after 1000 messages, %s.\n",
+          (unsigned long)arena_capacity(&arena),
+          failed ? "[31;1mFAILED[m" : "[32;1mno errors[m");
+
+   arena_release(&arena);
+   return failed != 0;
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>    // for size_t
+
+/**
+ * Block of memory allocated by an MTKArena when its first block fills.
+ */
+typedef struct _mtk_arena_block
+{
+   struct _mtk_arena_block *next;
+   size_t                  size;      // bytes usable after the header
+} MTKArenaBlock;
+
+/**
+ * @brief Bump allocator for data that lives as long as a connection
+ *        or a message, like reply chains and recipient links.
+ *
+ * Allocations are carved from the current block in order and are
+ * never freed one at a time.  arena_reset() makes all the memory
+ * available again, keeping the blocks already allocated, so after
+ * the first few messages of a session no more calls to malloc() are
+ * needed.  The first block can be a caller's buffer on the stack.
+ */
+typedef struct _mtk_arena
+{
+   char          *first;         // caller's first block, or NULL
+   size_t        first_len;
+   MTKArenaBlock *blocks;        // allocated blocks, in the order they are used
+   MTKArenaBlock *current;       // block being carved, NULL while in the first block
+   char          *ptr;           // next free byte
+   char          *end;           // end of the current block
+   size_t        block_size;     // minimum size of an allocated block
+} MTKArena;
+
+// Default size of blocks allocated by an arena
+#define ARENA_BLOCK_SIZE (16 * 1024)
+
+// Alignment of every allocation
+#define ARENA_ALIGNMENT (2 * sizeof(void*))
+
+/**
+ * @brief Prepare an arena, whose first block is *buffer* if not NULL.
+ */
+void arena_init(MTKArena *arena, void *buffer, size_t buffer_len);
+
+/**
+ * @brief Return *size* bytes of uninitialized memory, or NULL if a new
+ *        block was needed and could not be allocated.
+ */
+void *arena_alloc(MTKArena *arena, size_t size);
+
+/** Like arena_alloc(), but the memory is set to zero. */
+void *arena_calloc(MTKArena *arena, size_t size);
+
+/** Copy *len* bytes of *str* to the arena, adding a '\0'. */
+char *arena_strndup(MTKArena *arena, const char *str, size_t len);
+
+/**
+ * @brief Make all memory available again, invalidating everything
+ *        allocated.  Allocated blocks are kept for reuse.
+ */
+void arena_reset(MTKArena *arena);
+
+/** Free the allocated blocks.  The arena can be used again after arena_init(). */
+void arena_release(MTKArena *arena);
+
+/** Total bytes held by the arena, including the caller's first block. */
+size_t arena_capacity(const MTKArena *arena);
+
+#endif
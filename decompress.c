@@ -0,0 +1,399 @@
+// -*- compile-command: "base=decompress; gcc -Wall -Werror -ggdb -DDECOMPRESS_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c linedrop.c linescan.c logging.c -lz" -*-
+
+#include <stdlib.h>    // for malloc()
+#include <string.h>    // for memcpy()
+#include "decompress.h"
+#include "logging.h"
+
+/**
+ * Read more compressed data once the input buffer is used up.
+ */
+static void decompress_fill(DecompressSource *dcs)
+{
+   int bytes_read;
+
+   if (dcs->in_pos == dcs->in_len && !dcs->in_done)
+   {
+      bytes_read = (*dcs->read)(dcs->source, dcs->in_buffer, dcs->in_size);
+      if (bytes_read > 0)
+      {
+         dcs->in_pos = 0;
+         dcs->in_len = bytes_read;
+      }
+      else
+         dcs->in_done = 1;
+   }
+}
+
+/**
+ * Read until the input buffer holds at least *want* bytes, or the
+ * source ends, to have enough of a header to recognize.
+ */
+static void decompress_fill_header(DecompressSource *dcs, size_t want)
+{
+   int bytes_read;
+
+   while (dcs->in_len < want && !dcs->in_done)
+   {
+      bytes_read = (*dcs->read)(dcs->source, dcs->in_buffer + dcs->in_len, dcs->in_size - dcs->in_len);
+      if (bytes_read > 0)
+         dcs->in_len += bytes_read;
+      else
+         dcs->in_done = 1;
+   }
+}
+
+static int input_remains(const DecompressSource *dcs)
+{
+   return dcs->in_pos < dcs->in_len || !dcs->in_done;
+}
+
+static int read_plain(DecompressSource *dcs, char *buffer, int buff_len)
+{
+   int available = dcs->in_len - dcs->in_pos;
+   if (buff_len > available)
+      buff_len = available;
+
+   memcpy(buffer, dcs->in_buffer + dcs->in_pos, buff_len);
+   dcs->in_pos += buff_len;
+
+   return buff_len;
+}
+
+static int read_gzip(DecompressSource *dcs, char *buffer, int buff_len)
+{
+   int result;
+
+   dcs->zs.next_in = (Bytef*)dcs->in_buffer + dcs->in_pos;
+   dcs->zs.avail_in = dcs->in_len - dcs->in_pos;
+   dcs->zs.next_out = (Bytef*)buffer;
+   dcs->zs.avail_out = buff_len;
+
+   result = inflate(&dcs->zs, Z_NO_FLUSH);
+
+   dcs->in_pos = dcs->in_len - dcs->zs.avail_in;
+
+   if (result == Z_STREAM_END)
+   {
+      // Another gzip member may follow:
+      decompress_fill(dcs);
+      if (input_remains(dcs))
+         inflateReset(&dcs->zs);
+      else
+         dcs->finished = 1;
+   }
+   else if (result != Z_OK && result != Z_BUF_ERROR)
+   {
+      log_error_message(1, "Failed to inflate compressed data: ",
+                        dcs->zs.msg ? dcs->zs.msg : "unknown error", NULL);
+      return -1;
+   }
+
+   return buff_len - dcs->zs.avail_out;
+}
+
+#ifdef MAILTK_ZSTD
+static int read_zstd(DecompressSource *dcs, char *buffer, int buff_len)
+{
+   ZSTD_inBuffer  in = { dcs->in_buffer, dcs->in_len, dcs->in_pos };
+   ZSTD_outBuffer out = { buffer, buff_len, 0 };
+
+   size_t result = ZSTD_decompressStream(dcs->zds, &out, &in);
+   dcs->in_pos = in.pos;
+
+   if (ZSTD_isError(result))
+   {
+      log_error_message(1, "Failed to decompress zstd data: ", ZSTD_getErrorName(result), NULL);
+      return -1;
+   }
+   else if (result == 0)
+   {
+      // End of a frame, which another frame may follow:
+      decompress_fill(dcs);
+      if (!input_remains(dcs))
+         dcs->finished = 1;
+   }
+
+   return out.pos;
+}
+#endif
+
+/**
+ * A zlib (RFC 1950) header: deflate with at most a 32K window, no
+ * preset dictionary, and a check value that makes the pair a multiple
+ * of 31.
+ */
+static int is_zlib_header(const unsigned char *in)
+{
+   return (in[0] & 0x0f) == 8
+      && (in[0] >> 4) <= 7
+      && (in[1] & 0x20) == 0
+      && (in[0] * 256 + in[1]) % 31 == 0;
+}
+
+/**
+ * Detect the format from the first bytes and prepare the decompressor.
+ */
+static int decompress_detect(DecompressSource *dcs, int flags)
+{
+   const unsigned char *in = (const unsigned char*)dcs->in_buffer;
+
+   // Enough for the longest magic number, zstd's:
+   decompress_fill_header(dcs, 4);
+
+   if (dcs->in_len >= 2
+       && ((in[0] == 0x1f && in[1] == 0x8b) || ((flags & DECOMPRESS_ZLIB) && is_zlib_header(in))))
+   {
+      // 15 + 32: largest window, and detect gzip or zlib headers
+      if (inflateInit2(&dcs->zs, 15 + 32) != Z_OK)
+         return 0;
+      dcs->format = DCF_GZIP;
+   }
+   else if (dcs->in_len >= 4 && in[0] == 0x28 && in[1] == 0xb5 && in[2] == 0x2f && in[3] == 0xfd)
+   {
+#ifdef MAILTK_ZSTD
+      if (!(dcs->zds = ZSTD_createDStream()))
+         return 0;
+      ZSTD_initDStream(dcs->zds);
+      dcs->format = DCF_ZSTD;
+#else
+      log_error_message(1, "Found zstd data, but mailtk was built without MAILTK_ZSTD.", NULL);
+      return 0;
+#endif
+   }
+   else
+      dcs->format = DCF_PLAIN;
+
+   return 1;
+}
+
+/**
+ * Allocate the input buffer and detect the format of *source*, which
+ * may be zlib data only if *flags* has DECOMPRESS_ZLIB.
+ *
+ * @return 1 for success, 0 for failure, including compressed data
+ *         that this build cannot decompress.
+ */
+int decompress_start(DecompressSource *dcs, void *source, ring_source_read reader, size_t in_size, int flags)
+{
+   memset(dcs, 0, sizeof(DecompressSource));
+   dcs->source = source;
+   dcs->read = reader;
+   dcs->in_size = in_size < 4 ? DECOMPRESS_DEFAULT_BUFFER : in_size;
+
+   if (!(dcs->in_buffer = (char*)malloc(dcs->in_size)))
+      return 0;
+
+   if (decompress_detect(dcs, flags))
+      return 1;
+
+   free(dcs->in_buffer);
+   dcs->in_buffer = NULL;
+   return 0;
+}
+
+void decompress_stop(DecompressSource *dcs)
+{
+   if (dcs->format == DCF_GZIP)
+      inflateEnd(&dcs->zs);
+#ifdef MAILTK_ZSTD
+   else if (dcs->format == DCF_ZSTD)
+      ZSTD_freeDStream(dcs->zds);
+#endif
+
+   free(dcs->in_buffer);
+   memset(dcs, 0, sizeof(DecompressSource));
+}
+
+int decompress_source_read(void *source, char *buffer, int buff_len)
+{
+   DecompressSource *dcs = (DecompressSource*)source;
+   int produced = 0;
+
+   // Keep going until some output is ready, since a block of
+   // input may hold nothing but headers:
+   while (produced == 0 && !dcs->finished)
+   {
+      decompress_fill(dcs);
+      if (!input_remains(dcs))
+      {
+         // Truncated input: the decompressor wants more than there is.
+         if (dcs->format != DCF_PLAIN)
+            log_error_message(1, "Compressed data ended unexpectedly.", NULL);
+         break;
+      }
+
+      switch(dcs->format)
+      {
+         case DCF_PLAIN:
+            produced = read_plain(dcs, buffer, buff_len);
+            break;
+         case DCF_GZIP:
+            produced = read_gzip(dcs, buffer, buff_len);
+            break;
+#ifdef MAILTK_ZSTD
+         case DCF_ZSTD:
+            produced = read_zstd(dcs, buffer, buff_len);
+            break;
+#endif
+         default:
+            return -1;
+      }
+
+      if (produced < 0)
+         return -1;
+   }
+
+   return produced;
+}
+
+int ring_init_decompress_dropper(RingLineDropper *rld,
+                                 DecompressSource *dcs,
+                                 void *source,
+                                 ring_source_read reader,
+                                 size_t capacity,
+                                 int flags)
+{
+   if (!decompress_start(dcs, source, reader, 0, flags))
+      return 0;
+
+   if (ring_init_dropper(rld, dcs, decompress_source_read, capacity))
+      return 1;
+
+   decompress_stop(dcs);
+   return 0;
+}
+
+
+/************************************
+ * Conditionally-compiled test code.
+ ***********************************/
+
+#ifdef DECOMPRESS_MAIN
+
+#include <stdio.h>
+
+typedef struct _memory_source
+{
+   const char *data;
+   int        len;
+   int        pos;
+} MemorySource;
+
+/** Hand out the data a few bytes at a time, to split the headers across reads. */
+int memory_source_read(void *source, char *buffer, int buff_len)
+{
+   MemorySource *ms = (MemorySource*)source;
+   int bite = ms->len - ms->pos;
+
+   if (bite > 7)
+      bite = 7;
+   if (bite > buff_len)
+      bite = buff_len;
+
+   memcpy(buffer, ms->data + ms->pos, bite);
+   ms->pos += bite;
+
+   return bite;
+}
+
+/** Read *ms* through a DecompressSource, and check that *text* comes out in *format*. */
+int test_read_back(const char *label, MemorySource *ms, int flags, const char *text, DecompressFormat format)
+{
+   char output[1024];
+   DecompressSource dcs;
+   int bytes_read, total = 0, ok;
+
+   if (!decompress_start(&dcs, ms, memory_source_read, 0, flags))
+      return 0;
+
+   while ((bytes_read = decompress_source_read(&dcs, output + total, sizeof(output) - total)) > 0)
+      total += bytes_read;
+
+   ok = dcs.format == format && total == (int)strlen(text) && memcmp(output, text, total) == 0;
+   decompress_stop(&dcs);
+
+   printf("%-6s %s\n", label, ok ? "read back" : "[31;1mNOT READ BACK[m");
+   return ok;
+}
+
+/**
+ * Compress *text* with *window_bits* (15 for zlib, 15 + 16 for gzip),
+ * and check that it reads back unchanged.
+ */
+int test_format(const char *label, const char *text, int window_bits, int flags)
+{
+   char compressed[1024];
+   z_stream zs;
+   MemorySource ms;
+
+   memset(&zs, 0, sizeof(zs));
+   deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
+   zs.next_in = (Bytef*)text;
+   zs.avail_in = strlen(text);
+   zs.next_out = (Bytef*)compressed;
+   zs.avail_out = sizeof(compressed);
+   deflate(&zs, Z_FINISH);
+
+   ms.data = compressed;
+   ms.len = sizeof(compressed) - zs.avail_out;
+   ms.pos = 0;
+   deflateEnd(&zs);
+
+   return test_read_back(label, &ms, flags, text, DCF_GZIP);
+}
+
+/** Check that plain *text*, which may look like a zlib header, is passed through. */
+int test_plain(const char *label, const char *text)
+{
+   MemorySource ms = { text, strlen(text), 0 };
+   return test_read_back(label, &ms, 0, text, DCF_PLAIN);
+}
+
+int main(int argc, const char **argv)
+{
+   const char *path = argc > 1 ? argv[1] : "decompress.c";
+   const char *text = "From: sender@example.com\nTo: recipient@example.com\n\nHello, hello, hello.\n";
+
+   if (!test_format("zlib:", text, 15, DECOMPRESS_ZLIB)
+       || !test_format("gzip:", text, 15 + 16, 0)
+       || !test_plain("x^:", "x^2 + y^2\n")
+       || !test_plain("HK:", "HK office\n")
+       || !test_plain("x:", "x"))
+      return 1;
+
+   RingLineDropper  rld;
+   DecompressSource dcs;
+   LineDrop         ld;
+
+   const char *line;
+   int line_len;
+
+   FILE *stream = fopen(path, "r");
+   if (!stream)
+   {
+      printf("There was an error attempting to open [33;1m%s[m.\n", path);
+      return 1;
+   }
+
+   if (ring_init_decompress_dropper(&rld, &dcs, stream, ring_stream_read, RING_DEFAULT_CAPACITY, 0))
+   {
+      init_ring_line_drop(&ld, &rld);
+      ld.break_check = NULL;
+
+      do
+      {
+         if (DropGetLine(&ld, &line, &line_len))
+            printf("%.*s\n", line_len, line);
+      }
+      while (DropAdvance(&ld));
+
+      ring_release_dropper(&rld);
+      decompress_stop(&dcs);
+   }
+
+   fclose(stream);
+   return 0;
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <zlib.h>
+#ifdef MAILTK_ZSTD
+#include <zstd.h>
+#endif
+
+#include "linedrop.h"
+
+typedef enum _decompress_format
+{
+   DCF_PLAIN = 0,
+   DCF_GZIP,
+   DCF_ZSTD
+} DecompressFormat;
+
+/**
+ * A RingLineDropper source that decompresses another source.
+ *
+ * The format is detected from the first bytes: gzip data is inflated,
+ * zstd data is decompressed if the library was built with MAILTK_ZSTD,
+ * and anything else is passed through unchanged.  Concatenated gzip
+ * members and zstd frames are read in turn.
+ *
+ * zlib data is detected only with DECOMPRESS_ZLIB, because its two
+ * byte header is matched by plain text like "x^" or "HK".
+ */
+typedef struct _decompress_source
+{
+   void             *source;
+   ring_source_read read;
+   DecompressFormat format;
+
+   char   *in_buffer;
+   size_t in_size;
+   size_t in_pos;
+   size_t in_len;
+   int    in_done;
+   int    finished;
+
+   z_stream zs;
+#ifdef MAILTK_ZSTD
+   ZSTD_DStream *zds;
+#endif
+} DecompressSource;
+
+// Default size of the compressed input buffer
+#define DECOMPRESS_DEFAULT_BUFFER (64 * 1024)
+
+// Flags for decompress_start()
+#define DECOMPRESS_ZLIB 1   // also detect zlib (RFC 1950) streams
+
+int decompress_start(DecompressSource *dcs, void *source, ring_source_read reader, size_t in_size, int flags);
+void decompress_stop(DecompressSource *dcs);
+
+int decompress_source_read(void *dcs, char *buffer, int buff_len);
+
+/**
+ * @brief Start decompressing *source* and prepare *rld* to read its lines.
+ *
+ * Call ring_release_dropper(), then decompress_stop() when done.
+ */
+int ring_init_decompress_dropper(RingLineDropper *rld,
+                                 DecompressSource *dcs,
+                                 void *source,
+                                 ring_source_read reader,
+                                 size_t capacity,
+                                 int flags);
+
+#endif
@@ -0,0 +1,449 @@
+// -*- compile-command: "base=evloop; gcc -Wall -Werror -ggdb -DEVLOOP_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c -lssl -lcrypto" -*-
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "evloop.h"
+#include "logging.h"
+
+int evloop_init(EVLoop *loop)
+{
+   memset(loop, 0, sizeof(EVLoop));
+   loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+   if (loop->epoll_fd < 0)
+   {
+      log_error_message(1, "Failed to create an epoll instance: ", strerror(errno), NULL);
+      return 0;
+   }
+
+   return 1;
+}
+
+void evloop_close(EVLoop *loop)
+{
+   if (loop->epoll_fd >= 0)
+      close(loop->epoll_fd);
+
+   loop->epoll_fd = -1;
+}
+
+/** The epoll events a session should be waiting for. */
+static unsigned session_events(const EVSession *session)
+{
+   int want = evsession_pending(session) ? session->flush_want : session->want;
+   unsigned events = 0;
+
+   if (want & EV_READ)
+      events |= EPOLLIN;
+   if (want & EV_WRITE)
+      events |= EPOLLOUT;
+
+   return events;
+}
+
+static void update_registration(EVLoop *loop, EVSession *session)
+{
+   struct epoll_event event;
+   unsigned events = session_events(session);
+
+   if (events != session->registered)
+   {
+      event.events = events;
+      event.data.ptr = session;
+      if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, session->fd, &event) == 0)
+         session->registered = events;
+      else
+         session->failed = 1;
+   }
+}
+
+int evloop_add(EVLoop *loop,
+               EVSession *session,
+               const STalker *talker,
+               int fd,
+               ev_handler handler,
+               void *data,
+               char *out,
+               int out_capacity,
+               int want)
+{
+   struct epoll_event event;
+
+   memset(session, 0, sizeof(EVSession));
+   session->talker = talker;
+   session->fd = fd;
+   session->handler = handler;
+   session->data = data;
+   session->want = want;
+   session->out = out;
+   session->out_capacity = out_capacity;
+
+   event.events = session->registered = session_events(session);
+   event.data.ptr = session;
+
+   if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event))
+   {
+      log_error_message(1, "Failed to add a session to the event loop: ", strerror(errno), NULL);
+      return 0;
+   }
+
+   ++loop->session_count;
+   return 1;
+}
+
+void evloop_remove(EVLoop *loop, EVSession *session)
+{
+   // The socket may already be closed, which removes it from epoll anyway:
+   epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, session->fd, NULL);
+   session->registered = 0;
+   --loop->session_count;
+}
+
+int evsession_queue(EVSession *session, const char *data, int data_len)
+{
+   if (session->out_capacity - session->out_end < data_len && session->out_start > 0)
+   {
+      memmove(session->out, session->out + session->out_start, evsession_pending(session));
+      session->out_end -= session->out_start;
+      session->out_start = 0;
+   }
+
+   if (session->out_capacity - session->out_end < data_len)
+      return 0;
+
+   memcpy(session->out + session->out_end, data, data_len);
+   session->out_end += data_len;
+   return 1;
+}
+
+int evsession_queue_line(EVSession *session, ...)
+{
+   const char *bite;
+   int success = 1;
+   va_list args;
+   va_start(args, session);
+
+   while (success && (bite = va_arg(args, const char*)))
+      success = evsession_queue(session, bite, strlen(bite));
+
+   va_end(args);
+
+   return success && evsession_queue(session, "\r\n", 2);
+}
+
+/**
+ * Send as much of the output queue as the socket accepts.
+ *
+ * @return 1 if the queue was emptied, 0 if it must wait, -1 for failure.
+ */
+static int evsession_flush(EVSession *session)
+{
+   int bytes_written;
+
+   while (evsession_pending(session))
+   {
+      bytes_written = (*session->talker->writer)(session->talker,
+                                                 session->out + session->out_start,
+                                                 evsession_pending(session));
+      if (bytes_written > 0)
+         session->out_start += bytes_written;
+      else if (bytes_written == STK_WANT_READ || bytes_written == STK_WANT_WRITE)
+      {
+         session->flush_want = ev_want(bytes_written);
+         return 0;
+      }
+      else
+      {
+         session->failed = 1;
+         return -1;
+      }
+   }
+
+   session->out_start = session->out_end = 0;
+   return 1;
+}
+
+/**
+ * Call the session's handler, send what it queued, and wait for
+ * what it asks for.  A session whose output failed gets one more
+ * handler call, to see session->failed, and is then removed.
+ */
+static void run_handler(EVLoop *loop, EVSession *session)
+{
+   int result = (*session->handler)(loop, session);
+
+   if (result != EV_DONE)
+   {
+      session->want = result;
+
+      if (evsession_pending(session) && evsession_flush(session) < 0)
+         result = (*session->handler)(loop, session);
+   }
+
+   if (result == EV_DONE || session->failed)
+      evloop_remove(loop, session);
+   else
+      update_registration(loop, session);
+}
+
+int evloop_run(EVLoop *loop, int timeout_ms)
+{
+   struct epoll_event events[EVLOOP_BATCH];
+   EVSession *session;
+   int index, count, ready;
+
+   loop->stop = 0;
+
+   while (loop->session_count > 0 && !loop->stop)
+   {
+      count = epoll_wait(loop->epoll_fd, events, EVLOOP_BATCH, timeout_ms);
+      if (count < 0)
+      {
+         if (errno == EINTR)
+            continue;
+
+         log_error_message(1, "epoll_wait failed: ", strerror(errno), NULL);
+         return -1;
+      }
+      else if (count == 0)
+         break;
+
+      for (index = 0; index < count; ++index)
+      {
+         session = (EVSession*)events[index].data.ptr;
+
+         // Finish sending queued output before calling the handler
+         // again, except to report a failure:
+         if (evsession_pending(session))
+            ready = evsession_flush(session) != 0;
+         else
+            ready = ((events[index].events & EPOLLIN) && (session->want & EV_READ))
+               || ((events[index].events & EPOLLOUT) && (session->want & EV_WRITE))
+               || (events[index].events & (EPOLLERR | EPOLLHUP));
+
+         if (ready)
+            run_handler(loop, session);
+         else
+            update_registration(loop, session);
+      }
+   }
+
+   return loop->session_count;
+}
+
+
+/************************************
+ * Conditionally-compiled test code.
+ ***********************************/
+
+#ifdef EVLOOP_MAIN
+
+#include <stdlib.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include "smtp_reply.h"
+#include "socktalk.c"
+#include "smtp_reply.c"
+#include "arena.c"
+#include "logging.c"
+
+#define SESSIONS 2000
+
+/**
+ * Fake SMTP server: answers EHLO with a multi-line reply, QUIT with
+ * 221, and every other line with 250, then waits for the client to
+ * close the connection.
+ */
+typedef struct _fake_server
+{
+   int     fd;
+   STalker talker;
+   char    in[512];
+   int     in_used;
+   char    out[512];
+} FakeServer;
+
+int fake_server_handler(EVLoop *loop, EVSession *session)
+{
+   FakeServer *fs = (FakeServer*)session->data;
+   const char *line, *end;
+   int bytes_read;
+
+   while ((bytes_read = (*fs->talker.reader)(&fs->talker,
+                                             fs->in + fs->in_used,
+                                             sizeof(fs->in) - fs->in_used)) > 0)
+   {
+      fs->in_used += bytes_read;
+
+      line = fs->in;
+      while ((end = memchr(line, '\n', fs->in + fs->in_used - line)))
+      {
+         if (strncmp(line, "EHLO", 4) == 0)
+            evsession_queue_line(session, "250-fake.example.com\r\n250 PIPELINING", NULL);
+         else if (strncmp(line, "QUIT", 4) == 0)
+            evsession_queue_line(session, "221 2.0.0 Bye", NULL);
+         else
+            evsession_queue_line(session, "250 2.1.0 OK", NULL);
+
+         line = end + 1;
+      }
+
+      memmove(fs->in, line, fs->in + fs->in_used - line);
+      fs->in_used -= line - fs->in;
+   }
+
+   if (bytes_read == STK_WANT_READ || bytes_read == STK_WANT_WRITE)
+      return ev_want(bytes_read);
+
+   close(fs->fd);
+   return EV_DONE;
+}
+
+/**
+ * Client: read the greeting, send EHLO, pipeline MAIL FROM and two
+ * RCPT TO commands, then QUIT.
+ */
+typedef enum _client_state { CS_GREETING, CS_EHLO, CS_ENVELOPE, CS_QUIT } ClientState;
+
+typedef struct _fake_client
+{
+   int         fd;
+   STalker     talker;
+   STReplies   replies;
+   char        reply_buffer[512];
+   char        out[512];
+   ClientState state;
+   int         replies_due;
+   int         ok;
+} FakeClient;
+
+int fake_client_handler(EVLoop *loop, EVSession *session)
+{
+   FakeClient *fc = (FakeClient*)session->data;
+   char buffer[512];
+   SMTPReply reply;
+   int result;
+
+   if (session->failed)
+      goto close_session;
+
+   while (1)
+   {
+      result = smtp_recv_reply(&fc->talker, &reply, buffer, sizeof(buffer));
+      if (result == STK_WANT_READ || result == STK_WANT_WRITE)
+         return ev_want(result);
+      else if (result == 0 || !smtp_reply_positive(&reply))
+         goto close_session;
+
+      if (--fc->replies_due > 0)
+         continue;
+
+      switch(fc->state)
+      {
+         case CS_GREETING:
+            evsession_queue_line(session, "EHLO client.example.com", NULL);
+            fc->state = CS_EHLO;
+            fc->replies_due = 1;
+            break;
+         case CS_EHLO:
+            evsession_queue_line(session, "MAIL FROM: <sender@example.com>", NULL);
+            evsession_queue_line(session, "RCPT TO: <first@example.com>", NULL);
+            evsession_queue_line(session, "RCPT TO: <second@example.com>", NULL);
+            fc->state = CS_ENVELOPE;
+            fc->replies_due = 3;
+            break;
+         case CS_ENVELOPE:
+            evsession_queue_line(session, "QUIT", NULL);
+            fc->state = CS_QUIT;
+            fc->replies_due = 1;
+            break;
+         case CS_QUIT:
+            fc->ok = reply.code == 221;
+            goto close_session;
+      }
+   }
+
+  close_session:
+   close(fc->fd);
+   return EV_DONE;
+}
+
+int main(int argc, const char **argv)
+{
+   int sessions = argc > 1 ? atoi(argv[1]) : SESSIONS;
+   int index, pair[2], succeeded = 0;
+   struct rlimit limit;
+   struct timespec start, end;
+   EVLoop loop;
+
+   // Two descriptors per session, plus a few:
+   getrlimit(RLIMIT_NOFILE, &limit);
+   if (limit.rlim_cur < (rlim_t)sessions * 2 + 16)
+   {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+      if (limit.rlim_cur < (rlim_t)sessions * 2 + 16)
+         sessions = (limit.rlim_cur - 16) / 2;
+   }
+
+   FakeServer *servers = (FakeServer*)calloc(sessions, sizeof(FakeServer));
+   FakeClient *clients = (FakeClient*)calloc(sessions, sizeof(FakeClient));
+   EVSession *ev_sessions = (EVSession*)calloc(sessions * 2, sizeof(EVSession));
+
+   if (!servers || !clients || !ev_sessions || !evloop_init(&loop))
+      return 1;
+
+   for (index = 0; index < sessions; ++index)
+   {
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+      {
+         perror("socketpair");
+         return 1;
+      }
+
+      FakeServer *fs = &servers[index];
+      fs->fd = pair[0];
+      init_nb_sock_talker(&fs->talker, &fs->fd);
+      evloop_add(&loop, &ev_sessions[index * 2], &fs->talker, fs->fd,
+                 fake_server_handler, fs, fs->out, sizeof(fs->out), EV_READ);
+      evsession_queue_line(&ev_sessions[index * 2], "220 fake.example.com ESMTP", NULL);
+      ev_sessions[index * 2].flush_want = EV_WRITE;
+      update_registration(&loop, &ev_sessions[index * 2]);
+
+      FakeClient *fc = &clients[index];
+      fc->fd = pair[1];
+      fc->replies_due = 1;
+      init_nb_sock_talker(&fc->talker, &fc->fd);
+      stk_attach_replies(&fc->talker, &fc->replies, fc->reply_buffer, sizeof(fc->reply_buffer));
+      evloop_add(&loop, &ev_sessions[index * 2 + 1], &fc->talker, fc->fd,
+                 fake_client_handler, fc, fc->out, sizeof(fc->out), EV_READ);
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   int remaining = evloop_run(&loop, 5000);
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   for (index = 0; index < sessions; ++index)
+      succeeded += clients[index].ok;
+
+   printf("%d of %d sessions completed on one thread in %.1f ms, %d left in the loop.\n",
+          succeeded,
+          sessions,
+          (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6,
+          remaining);
+
+   evloop_close(&loop);
+   free(ev_sessions);
+   free(clients);
+   free(servers);
+
+   return succeeded != sessions;
+}
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include "socktalk.h"
+
+struct _ev_loop;
+struct _ev_session;
+
+// What a session waits for, and what its handler returns
+#define EV_READ  1
+#define EV_WRITE 2
+#define EV_DONE  0          // handler return: the session is finished
+
+/**
+ * @brief Advance a session as far as it can go without blocking.
+ *
+ * Called when the socket is ready for what the session last waited
+ * for, and after queued output has been sent.  The handler reads
+ * with a non-blocking talker (see STK_WANT_READ), queues commands
+ * with evsession_queue(), and returns EV_READ or EV_WRITE to wait
+ * again, or EV_DONE to leave the loop.
+ */
+typedef int (*ev_handler)(struct _ev_loop *loop, struct _ev_session *session);
+
+/**
+ * @brief One connection driven by an EVLoop.
+ *
+ * The output queue holds commands until the socket accepts them, so
+ * a handler never waits for a write to complete.
+ */
+typedef struct _ev_session
+{
+   const STalker *talker;     // a non-blocking talker
+   int           fd;
+   ev_handler    handler;
+   void          *data;
+
+   int           want;        // EV_READ and/or EV_WRITE, from the last handler call
+   int           flush_want;  // what a partial flush is waiting for
+   int           failed;      // set if the output queue could not be sent
+   unsigned      registered;  // epoll events currently requested
+
+   char          *out;
+   int           out_capacity;
+   int           out_start;
+   int           out_end;
+} EVSession;
+
+/**
+ * @brief An epoll loop that drives many sessions on one thread.
+ */
+typedef struct _ev_loop
+{
+   int epoll_fd;
+   int session_count;
+   int stop;
+} EVLoop;
+
+// Events collected with each epoll_wait() call
+#define EVLOOP_BATCH 256
+
+int evloop_init(EVLoop *loop);
+void evloop_close(EVLoop *loop);
+
+/**
+ * @brief Prepare a session and start watching its socket.
+ *
+ * *out* is the session's output queue.  *want* is what the session
+ * waits for first: EV_READ for a server greeting, EV_WRITE to have
+ * the handler called as soon as the socket can be written.
+ *
+ * @return 1 for success, 0 if the socket could not be watched.
+ */
+int evloop_add(EVLoop *loop,
+               EVSession *session,
+               const STalker *talker,
+               int fd,
+               ev_handler handler,
+               void *data,
+               char *out,
+               int out_capacity,
+               int want);
+
+/** Stop watching a session's socket.  The caller closes the socket. */
+void evloop_remove(EVLoop *loop, EVSession *session);
+
+/**
+ * @brief Call the handlers as their sockets become ready, until no
+ *        sessions remain, evloop_stop() is called, or *timeout_ms*
+ *        passes without any event (-1 to wait indefinitely).
+ *
+ * @return The number of sessions remaining, or -1 for an epoll error.
+ */
+int evloop_run(EVLoop *loop, int timeout_ms);
+
+static inline void evloop_stop(EVLoop *loop) { loop->stop = 1; }
+
+/** Translate STK_WANT_READ or STK_WANT_WRITE to EV_READ or EV_WRITE. */
+static inline int ev_want(int result) { return result == STK_WANT_WRITE ? EV_WRITE : EV_READ; }
+
+/** Add bytes to the session's output queue.  Returns 0 if there's no room. */
+int evsession_queue(EVSession *session, const char *data, int data_len);
+
+/** Queue a NULL-terminated list of strings, followed by "\r\n". */
+int evsession_queue_line(EVSession *session, ...);
+
+/** Bytes queued but not yet sent. */
+static inline int evsession_pending(const EVSession *session)
+{
+   return session->out_end - session->out_start;
+}
+
+#endif
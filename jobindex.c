@@ -0,0 +1,415 @@
+// -*- compile-command: "base=jobindex; gcc -Wall -Werror -ggdb -DJOBINDEX_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c linedrop.c linescan.c logging.c" -*-
+
+#include <stdio.h>
+#include <stdlib.h>    // for realloc()
+#include <string.h>    // for memcmp()
+#include <strings.h>   // for strncasecmp()
+#include <alloca.h>
+#include <fcntl.h>     // for open()
+#include <unistd.h>    // for close()
+#include <sys/stat.h>
+
+#include "jobindex.h"
+#include "logging.h"
+
+#define JOBINDEX_MAGIC "MTKJIDX1"
+
+/**
+ * Saved at the start of an index file, followed by the entries.
+ * Values are in the byte order of the machine that saved them.
+ */
+typedef struct _job_index_file_header
+{
+   char     magic[8];
+   uint32_t entry_size;
+   uint32_t count;
+   uint64_t source_size;
+   int64_t  source_mtime;
+} JobIndexFileHeader;
+
+typedef enum _job_index_state
+{
+   JIS_BETWEEN = 0,
+   JIS_RECIPS,
+   JIS_HEADERS,
+   JIS_BODY
+} JobIndexState;
+
+static int64_t stat_mtime_ns(const struct stat *st)
+{
+   return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static JobIndexEntry *jobindex_add(JobIndex *ji)
+{
+   if (ji->count == ji->capacity)
+   {
+      int new_capacity = ji->capacity ? ji->capacity * 2 : 256;
+      JobIndexEntry *entries = (JobIndexEntry*)realloc(ji->entries,
+                                                       new_capacity * sizeof(JobIndexEntry));
+      if (!entries)
+         return NULL;
+
+      ji->entries = entries;
+      ji->capacity = new_capacity;
+   }
+
+   return &ji->entries[ji->count++];
+}
+
+void jobindex_free(JobIndex *ji)
+{
+   free(ji->entries);
+   memset(ji, 0, sizeof(JobIndex));
+}
+
+/**
+ * Scan an open job file once, recording the parts of each message.
+ * A final message without an RS line is taken to end with the file,
+ * but one without a body is left out.
+ *
+ * @return 1 for success, 0 on failure.
+ */
+int jobindex_build(JobIndex *ji, int fd)
+{
+   MmapLineDropper mld;
+   LineDrop        ld;
+   LineSpan        spans[LINEDROP_BATCH_SIZE];
+   const LineSpan  *span, *spans_end;
+
+   JobIndexState state = JIS_BETWEEN;
+   JobIndexEntry entry;
+   JobIndexEntry *new_entry;
+
+   const char *base, *end, *next;
+   uint64_t   line_offset, next_offset;
+   struct stat st;
+
+   memset(ji, 0, sizeof(JobIndex));
+   memset(&entry, 0, sizeof(entry));
+
+   if (fstat(fd, &st) || !mmap_init_dropper(&mld, fd))
+      return 0;
+
+   ji->source_size = st.st_size;
+   ji->source_mtime = stat_mtime_ns(&st);
+
+   if (!mld.map)
+      return 1;
+
+   base = mld.map;
+   init_mmap_line_drop(&ld, &mld);
+   ld.break_check = NULL;
+
+   do
+   {
+      spans_end = spans + DropGetLines(&ld, spans, LINEDROP_BATCH_SIZE);
+
+      for (span = spans; span < spans_end; ++span)
+      {
+         line_offset = span->line - base;
+
+         // Offset of the line after this one, past its line ending:
+         next = end = span->line + span->line_len;
+         if (next < mld.data_end && *next == '\r')
+            ++next;
+         if (next < mld.data_end && *next == '\n')
+            ++next;
+         next_offset = next - base;
+
+         switch(state)
+         {
+            case JIS_BETWEEN:
+               if (span->line_len == 0)
+                  break;
+
+               memset(&entry, 0, sizeof(entry));
+               entry.offset = line_offset;
+               state = JIS_RECIPS;
+               break;
+
+            case JIS_RECIPS:
+               if (span->line_len == 0)
+               {
+                  entry.recips_length = line_offset - entry.offset;
+                  entry.headers_start = next_offset - entry.offset;
+                  state = JIS_HEADERS;
+               }
+               break;
+
+            case JIS_HEADERS:
+               if (span->line_len == 0)
+               {
+                  entry.headers_length = line_offset - entry.offset - entry.headers_start;
+                  entry.body_start = next_offset - entry.offset;
+                  state = JIS_BODY;
+               }
+               break;
+
+            case JIS_BODY:
+               if (break_on_rs(span->line, span->line_len))
+               {
+                  entry.body_length = line_offset - entry.offset - entry.body_start;
+                  entry.length = next_offset - entry.offset;
+
+                  if (!(new_entry = jobindex_add(ji)))
+                     goto failed;
+
+                  *new_entry = entry;
+                  state = JIS_BETWEEN;
+               }
+               break;
+         }
+      }
+   } while (DropAdvance(&ld));
+
+   if (state == JIS_BODY)
+   {
+      entry.length = (mld.data_end - base) - entry.offset;
+      entry.body_length = entry.length - entry.body_start;
+
+      if (!(new_entry = jobindex_add(ji)))
+         goto failed;
+
+      *new_entry = entry;
+   }
+   else if (state != JIS_BETWEEN)
+      log_error_message(1, "Job file ends in an incomplete message.", NULL);
+
+   mmap_release_dropper(&mld);
+   return 1;
+
+  failed:
+   mmap_release_dropper(&mld);
+   jobindex_free(ji);
+   return 0;
+}
+
+static char *make_index_path(const char *job_path, char *buffer)
+{
+   strcpy(buffer, job_path);
+   strcat(buffer, JOBINDEX_SUFFIX);
+   return buffer;
+}
+
+int jobindex_save(const JobIndex *ji, const char *job_path)
+{
+   char *index_path = make_index_path(job_path, (char*)alloca(strlen(job_path) + sizeof(JOBINDEX_SUFFIX)));
+   JobIndexFileHeader header;
+   int success;
+
+   FILE *out = fopen(index_path, "w");
+   if (!out)
+   {
+      log_error_message(1, "Failed to create index file \"", index_path, "\"", NULL);
+      return 0;
+   }
+
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, JOBINDEX_MAGIC, sizeof(header.magic));
+   header.entry_size = sizeof(JobIndexEntry);
+   header.count = ji->count;
+   header.source_size = ji->source_size;
+   header.source_mtime = ji->source_mtime;
+
+   success = fwrite(&header, sizeof(header), 1, out) == 1
+      && fwrite(ji->entries, sizeof(JobIndexEntry), ji->count, out) == (size_t)ji->count;
+
+   return (fclose(out) == 0) && success;
+}
+
+/**
+ * Read the saved index for a job file.
+ *
+ * @return 1 for success, 0 if the index is missing, unreadable,
+ *         or does not match the job file's size and time.
+ */
+int jobindex_load(JobIndex *ji, const char *job_path)
+{
+   char *index_path = make_index_path(job_path, (char*)alloca(strlen(job_path) + sizeof(JOBINDEX_SUFFIX)));
+   JobIndexFileHeader header;
+   struct stat st;
+   FILE *in;
+
+   memset(ji, 0, sizeof(JobIndex));
+
+   if (stat(job_path, &st))
+      return 0;
+
+   if (!(in = fopen(index_path, "r")))
+      return 0;
+
+   if (fread(&header, sizeof(header), 1, in) == 1
+       && memcmp(header.magic, JOBINDEX_MAGIC, sizeof(header.magic)) == 0
+       && header.entry_size == sizeof(JobIndexEntry)
+       && header.source_size == (uint64_t)st.st_size
+       && header.source_mtime == stat_mtime_ns(&st))
+   {
+      ji->entries = (JobIndexEntry*)malloc(header.count * sizeof(JobIndexEntry) + 1);
+      if (ji->entries
+          && fread(ji->entries, sizeof(JobIndexEntry), header.count, in) == header.count)
+      {
+         ji->count = ji->capacity = header.count;
+         ji->source_size = header.source_size;
+         ji->source_mtime = header.source_mtime;
+         fclose(in);
+         return 1;
+      }
+
+      jobindex_free(ji);
+   }
+
+   fclose(in);
+   return 0;
+}
+
+int jobindex_open(JobIndex *ji, const char *job_path)
+{
+   int fd, success;
+
+   if (jobindex_load(ji, job_path))
+      return 1;
+
+   if ((fd = open(job_path, O_RDONLY)) < 0)
+      return 0;
+
+   success = jobindex_build(ji, fd);
+   close(fd);
+
+   if (success)
+      jobindex_save(ji, job_path);
+
+   return success;
+}
+
+int jobindex_init_dropper(MmapLineDropper *mld, int fd, const JobIndexEntry *entry)
+{
+   return mmap_init_range_dropper(mld, fd, entry->offset, entry->length);
+}
+
+void jobindex_partition(const JobIndex *ji, int parts, int part, int *first, int *count)
+{
+   uint64_t total = 0, sum = 0;
+   uint64_t start_target, end_target;
+   int index, start = ji->count, end = ji->count;
+
+   for (index = 0; index < ji->count; ++index)
+      total += ji->entries[index].length;
+
+   start_target = total * part / parts;
+   end_target = total * (part + 1) / parts;
+
+   // A message belongs to the run in which it starts:
+   for (index = 0; index < ji->count; ++index)
+   {
+      if (start == ji->count && sum >= start_target)
+         start = index;
+      if (sum >= end_target && part + 1 < parts)
+      {
+         end = index;
+         break;
+      }
+      sum += ji->entries[index].length;
+   }
+
+   if (start > end)
+      start = end;
+
+   *first = start;
+   *count = end - start;
+}
+
+
+/************************************
+ * Conditionally-compiled test code.
+ ***********************************/
+
+#ifdef JOBINDEX_MAIN
+
+void show_message(int fd, const JobIndexEntry *entry)
+{
+   MmapLineDropper mld;
+   LineDrop ld;
+   const char *line;
+   int line_len;
+
+   // Show the first recipient and the subject as a quick check:
+   if (jobindex_init_dropper(&mld, fd, entry))
+   {
+      init_mmap_line_drop(&ld, &mld);
+
+      DropGetLine(&ld, &line, &line_len);
+      printf("   first recipient: [32;1m%.*s[m\n", line_len, line);
+
+      mmap_release_dropper(&mld);
+   }
+
+   // The headers can be read on their own, using the part offsets:
+   if (mmap_init_range_dropper(&mld, fd, entry->offset + entry->headers_start, entry->headers_length))
+   {
+      init_mmap_line_drop(&ld, &mld);
+      ld.break_check = NULL;
+
+      do
+      {
+         if (DropGetLine(&ld, &line, &line_len)
+             && line_len >= 8
+             && strncasecmp(line, "Subject:", 8) == 0)
+         {
+            for (line += 8, line_len -= 8; line_len > 0 && (*line == ' ' || *line == '\t'); ++line, --line_len)
+               ;
+            printf("   subject:         [32;1m%.*s[m\n", line_len, line);
+            break;
+         }
+      }
+      while (DropAdvance(&ld));
+
+      mmap_release_dropper(&mld);
+   }
+}
+
+int main(int argc, const char **argv)
+{
+   const char *path = argc > 1 ? argv[1] : "jobfile.txt";
+   const JobIndexEntry *entry;
+   JobIndex ji;
+   int index, first, count, part;
+
+   if (!jobindex_open(&ji, path))
+   {
+      printf("Failed to index [33;1m%s[m.\n", path);
+      return 1;
+   }
+
+   int fd = open(path, O_RDONLY);
+
+   printf("%s holds %d messages.\n", path, ji.count);
+   for (index = 0; index < ji.count; ++index)
+   {
+      entry = &ji.entries[index];
+      printf("%4d: offset %lu, length %lu, recipients %u, headers %u, body %lu\n",
+             index,
+             (unsigned long)entry->offset,
+             (unsigned long)entry->length,
+             entry->recips_length,
+             entry->headers_length,
+             (unsigned long)entry->body_length);
+
+      if (fd >= 0)
+         show_message(fd, entry);
+   }
+
+   for (part = 0; part < 3; ++part)
+   {
+      jobindex_partition(&ji, 3, part, &first, &count);
+      printf("Sender %d of 3 would send messages %d to %d.\n", part, first, first + count - 1);
+   }
+
+   if (fd >= 0)
+      close(fd);
+
+   jobindex_free(&ji);
+   return 0;
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef JOBINDEX_H
+#define JOBINDEX_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "linedrop.h"
+
+/**
+ * Job files hold a series of messages, each made of a block of
+ * recipient lines, an empty line, a block of header lines, an empty
+ * line, the body lines, and finally a line holding only an RS
+ * character (0x1E).  A JobIndex records where each part of each
+ * message lies so that any message can be read without reading
+ * the messages before it.
+ */
+
+/**
+ * Location of one message.  Part offsets are relative to *offset*,
+ * and part lengths do not include the empty line or RS line that
+ * ends each part.
+ */
+typedef struct _job_index_entry
+{
+   uint64_t offset;           // file offset of the first recipient line
+   uint64_t length;           // message length, through the RS line
+   uint32_t recips_length;
+   uint32_t headers_start;
+   uint32_t headers_length;
+   uint32_t body_start;
+   uint64_t body_length;
+} JobIndexEntry;
+
+typedef struct _job_index
+{
+   JobIndexEntry *entries;
+   int           count;
+   int           capacity;
+   uint64_t      source_size;
+   int64_t       source_mtime;
+} JobIndex;
+
+// Suffix added to the job file path for the saved index
+#define JOBINDEX_SUFFIX ".idx"
+
+int jobindex_build(JobIndex *ji, int fd);
+int jobindex_save(const JobIndex *ji, const char *job_path);
+int jobindex_load(JobIndex *ji, const char *job_path);
+void jobindex_free(JobIndex *ji);
+
+/**
+ * @brief Load the saved index for a job file, or build and save it
+ *        if it is missing or older than the job file.
+ */
+int jobindex_open(JobIndex *ji, const char *job_path);
+
+/**
+ * @brief Prepare a dropper to read one message, starting with its recipients.
+ */
+int jobindex_init_dropper(MmapLineDropper *mld, int fd, const JobIndexEntry *entry);
+
+/**
+ * @brief Divide the messages into *parts* runs of about equal size, and
+ *        set the first index and count of the messages in run *part*.
+ */
+void jobindex_partition(const JobIndex *ji, int parts, int part, int *first, int *count);
+
+#endif
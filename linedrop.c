@@ -1,25 +1,52 @@
-// -*- compile-command: "base=linedrop; gcc -Wall -Werror -ggdb -DLINEDROP_MAIN -DDEBUG -o $base ${base}.c" -*-
+// -*- compile-command: "base=linedrop; gcc -Wall -Werror -ggdb -DLINEDROP_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c linescan.c" -*-
 
 #include <stdio.h>     // for fread()
+#include <stdlib.h>    // for malloc()
 #include <string.h>    // for memmove()
+#include <unistd.h>    // for sysconf(), read()
+#include <fcntl.h>     // for posix_fadvise(), readahead() with _GNU_SOURCE
+#include <errno.h>
+#include <sys/mman.h>  // for mmap(), madvise()
+#include <sys/stat.h>  // for fstat()
 #include "linedrop.h"
+#include "linescan.h"
 
 const char *string_find_line_end(const char *line, const char *end_of_data)
 {
-   while (line < end_of_data && *line != '\n')
-      ++line;
+   const char *newline = scan_find_newline(line, end_of_data);
 
-   if (*line == '\n')
+   if (newline)
    {
-      if (*(line-1) == '\r')
-         --line;
+      if (newline > line && *(newline-1) == '\r')
+         --newline;
 
-      return line;
+      return newline;
    }
    else
       return NULL;
 }
 
+/**
+ * Return the end of the line that starts at *line*, like string_find_line_end().
+ *
+ * Rather than scanning once per line, this function scans the rest
+ * of the data once for up to LINE_END_CACHE_SIZE newlines and hands
+ * out the cached positions until they run out.  The cache must be
+ * emptied (see line_end_cache_clear()) whenever the data moves.
+ */
+const char *line_end_cache_next(LineEndCache *lec, const char *line, const char *end_of_data)
+{
+   if (!line_end_cache_ready(lec))
+   {
+      lec->next = 0;
+      lec->count = scan_newlines(line, end_of_data, lec->ends, LINE_END_CACHE_SIZE);
+      if (lec->count == 0)
+         return NULL;
+   }
+
+   return line_end_cache_take(lec, line);
+}
+
 /***********
  * LineDrop 
  **********/
@@ -34,6 +61,26 @@ int LineDrop_break_on_empty_line(const LineDrop *ld)
       return 0;
 }
 
+int LineDrop_break_on_rs(const LineDrop *ld)
+{
+   const char *line;
+   int line_len;
+   if (DropGetLine(ld, &line, &line_len))
+      return break_on_rs(line, line_len);
+   else
+      return 0;
+}
+
+int DropGetLines(LineDrop *ld, LineSpan *spans, int max_spans)
+{
+   if (max_spans < 1)
+      return 0;
+   else if (ld->get_lines)
+      return (*ld->get_lines)(ld, spans, max_spans);
+   else
+      return ld->get_line(ld->data, &spans->line, &spans->line_len);
+}
+
 void DropInitialize(LineDrop            *new_line_drop,
                     void                *data,
                     dropper_advance     advance_func,
@@ -71,8 +118,7 @@ void stream_init_dropper(StreamLineDropper *sld, FILE *stream, char *buffer, int
    sld->cur_line = buffer;
    sld->cur_line_end  = NULL;
 
-   if (stream_top_up_buffer(sld))
-      sld->cur_line_end = string_find_line_end(sld->buffer, sld->buffer_end);
+   stream_top_up_buffer(sld);
 }
 
 int stream_top_up_buffer(StreamLineDropper *sld)
@@ -87,6 +133,9 @@ int stream_top_up_buffer(StreamLineDropper *sld)
       memmove(sld->buffer, sld->cur_line, bytes_remaining);
       sld->cur_line = sld->buffer;
 
+      // Cached line ends no longer point to the right characters:
+      line_end_cache_clear(&sld->eols);
+
       temp_end = sld->buffer + bytes_remaining;
       bytes_to_read = sld->buffer_end - temp_end;
 
@@ -94,7 +143,7 @@ int stream_top_up_buffer(StreamLineDropper *sld)
       if (bytes_read)
       {
          sld->data_end = temp_end + bytes_read;
-         temp_end = string_find_line_end(sld->buffer, sld->data_end);
+         temp_end = line_end_cache_next(&sld->eols, sld->buffer, sld->data_end);
       }
 
       if (temp_end)
@@ -121,18 +170,24 @@ int stream_advance(StreamLineDropper *sld)
 {
    // Find the beginning of the next line by skipping past end-of-line characters
    const char *ptr = sld->cur_line_end;
-   if (*ptr == '\r')
+   if (ptr < sld->data_end && *ptr == '\r')
       ++ptr;
-   if (*ptr == '\n')
+   if (ptr < sld->data_end && *ptr == '\n')
       ++ptr;
 
    if (ptr < sld->data_end)
    {
       sld->cur_line = ptr;
-      sld->cur_line_end = string_find_line_end(ptr, sld->data_end);
+      sld->cur_line_end = line_end_cache_next(&sld->eols, ptr, sld->data_end);
 
       if (sld->cur_line_end)
          return 1;
+      else if (!sld->stream)
+      {
+         // An unterminated last line ends with the data:
+         sld->cur_line_end = sld->data_end;
+         return 1;
+      }
       else
          return stream_top_up_buffer(sld);
    }
@@ -142,14 +197,7 @@ int stream_advance(StreamLineDropper *sld)
 
 int stream_get_line(const StreamLineDropper *sld, const char **line, int *line_len)
 {
-   if (sld->cur_line && sld->cur_line_end)
-   {
-      *line = sld->cur_line;
-      *line_len = sld->cur_line_end - sld->cur_line;
-      return 1;
-   }
-
-   return 0;
+   return stream_fast_get_line(sld, line, line_len);
 }
 
 int stream_spent(const StreamLineDropper *sld)
@@ -166,6 +214,8 @@ void init_stream_line_drop(LineDrop *ld, StreamLineDropper *sld)
                   ld_stream_advance,
                   ld_stream_get_line,
                   ld_stream_spent, NULL);
+
+   ld->get_lines = ld_stream_get_lines;
 }
 
 int ld_stream_get_line(void *sld, const char **line, int *line_len)
@@ -183,6 +233,53 @@ int ld_stream_spent(const void *sld)
    return stream_spent((const StreamLineDropper*)sld);
 }
 
+/**
+ * Collect lines that are complete in the buffer.  The batch ends
+ * before any line that would need stream_top_up_buffer(), because
+ * refilling the buffer moves the lines already collected.
+ */
+int ld_stream_get_lines(LineDrop *ld, LineSpan *spans, int max_spans)
+{
+   StreamLineDropper *sld = (StreamLineDropper*)ld->data;
+   const char *prev_line, *prev_line_end;
+   const char *ptr;
+   int count = 0;
+
+   if (!stream_get_line(sld, &spans->line, &spans->line_len))
+      return 0;
+
+   while (++count < max_spans)
+   {
+      ptr = sld->cur_line_end;
+      if (ptr < sld->data_end && *ptr == '\r')
+         ++ptr;
+      if (ptr < sld->data_end && *ptr == '\n')
+         ++ptr;
+
+      if (ptr >= sld->data_end)
+         break;
+
+      prev_line = sld->cur_line;
+      prev_line_end = sld->cur_line_end;
+
+      sld->cur_line = ptr;
+      sld->cur_line_end = line_end_cache_next(&sld->eols, ptr, sld->data_end);
+
+      if (!sld->cur_line_end || (ld->break_check && (*ld->break_check)(ld)))
+      {
+         // Step back to the last line returned:
+         sld->cur_line = prev_line;
+         sld->cur_line_end = prev_line_end;
+         line_end_cache_clear(&sld->eols);
+         break;
+      }
+
+      stream_get_line(sld, &spans[count].line, &spans[count].line_len);
+   }
+
+   return count;
+}
+
 
 /***************************
  * String List Line Dropper
@@ -196,22 +293,12 @@ void list_init_dropper(ListLineDropper *lld, const char **source)
 
 int list_get_line(ListLineDropper *lld, const char **line, int *line_len)
 {
-   if (*lld->current)
-   {
-      *line = *lld->current;
-      *line_len = strlen(*line);
-      return 1;
-   }
-   else
-      return 0;
+   return list_fast_get_line(lld, line, line_len);
 }
 
 int list_advance(ListLineDropper *lld)
 {
-   if (*lld->current && *++lld->current)
-      return 1;
-   else
-      return 0;
+   return list_fast_advance(lld);
 }
 
 int list_spent(const ListLineDropper *lld)
@@ -242,6 +329,8 @@ void init_list_line_drop(LineDrop *ld, ListLineDropper *lld)
                   ld_list_get_line,
                   ld_list_spent,
                   NULL);
+
+   ld->get_lines = ld_list_get_lines;
 }
 
 int ld_list_get_line(void *sld, const char **line, int *line_len)
@@ -259,6 +348,578 @@ int ld_list_spent(const void *sld)
    return list_spent((ListLineDropper*)sld);
 }
 
+int ld_list_get_lines(LineDrop *ld, LineSpan *spans, int max_spans)
+{
+   ListLineDropper *lld = (ListLineDropper*)ld->data;
+   int count = 0;
+
+   if (!list_get_line(lld, &spans->line, &spans->line_len))
+      return 0;
+
+   while (++count < max_spans && lld->current[1])
+   {
+      ++lld->current;
+      if (ld->break_check && (*ld->break_check)(ld))
+      {
+         --lld->current;
+         break;
+      }
+
+      list_get_line(lld, &spans[count].line, &spans[count].line_len);
+   }
+
+   return count;
+}
+
+/*****************************
+ * Memory-mapped Line Dropper
+ ****************************/
+
+/**
+ * Release pages that lie entirely behind the current line.
+ *
+ * Pages are only released after a full MMAP_RELEASE_WINDOW has
+ * been passed to keep the number of madvise() calls small.
+ */
+static void mmap_release_behind(MmapLineDropper *mld)
+{
+   static long page_size = 0;
+   if (!page_size)
+      page_size = sysconf(_SC_PAGESIZE);
+
+   const char *release_end = mld->map + ((mld->cur_line - mld->map) & ~(page_size - 1));
+
+   if (release_end - mld->released_to >= MMAP_RELEASE_WINDOW)
+   {
+      madvise((void*)mld->released_to, release_end - mld->released_to, MADV_DONTNEED);
+      mld->released_to = release_end;
+   }
+}
+
+static const char *mmap_find_line_end(MmapLineDropper *mld, const char *line)
+{
+   const char *end = line_end_cache_next(&mld->eols, line, mld->data_end);
+
+   // An unterminated last line ends with the file:
+   return end ? end : mld->data_end;
+}
+
+static const char *mmap_next_line_start(const MmapLineDropper *mld)
+{
+   const char *ptr = mld->cur_line_end;
+   if (ptr < mld->data_end && *ptr == '\r')
+      ++ptr;
+   if (ptr < mld->data_end && *ptr == '\n')
+      ++ptr;
+
+   return ptr;
+}
+
+/**
+ * Map the contents of an open file for reading as lines.
+ *
+ * The file descriptor may be closed after this function returns,
+ * but mmap_release_dropper() must be called when done with the lines.
+ *
+ * @return 1 for success, 0 if the file could not be mapped.
+ */
+int mmap_init_dropper(MmapLineDropper *mld, int fd)
+{
+   struct stat st;
+
+   memset(mld, 0, sizeof(MmapLineDropper));
+
+   if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+      return 0;
+
+   return mmap_init_range_dropper(mld, fd, 0, st.st_size);
+}
+
+/**
+ * Like mmap_init_dropper(), but read only *length* bytes starting
+ * at *offset*.  This allows separate droppers, perhaps on separate
+ * threads, to read separate messages from one job file.
+ */
+int mmap_init_range_dropper(MmapLineDropper *mld, int fd, off_t offset, size_t length)
+{
+   long page_size = sysconf(_SC_PAGESIZE);
+   off_t map_offset = offset & ~((off_t)page_size - 1);
+
+   memset(mld, 0, sizeof(MmapLineDropper));
+
+   // Leave members NULL for an empty range, which cannot be mapped:
+   if (length == 0)
+      return 1;
+
+   size_t map_len = length + (offset - map_offset);
+   void *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, map_offset);
+   if (map == MAP_FAILED)
+      return 0;
+
+   madvise(map, map_len, MADV_SEQUENTIAL);
+
+   mld->map = (char*)map;
+   mld->map_len = map_len;
+   mld->data_end = mld->map + mld->map_len;
+   mld->released_to = mld->map;
+   mld->cur_line = mld->map + (offset - map_offset);
+   mld->cur_line_end = mmap_find_line_end(mld, mld->cur_line);
+
+   return 1;
+}
+
+void mmap_release_dropper(MmapLineDropper *mld)
+{
+   if (mld->map)
+      munmap(mld->map, mld->map_len);
+
+   memset(mld, 0, sizeof(MmapLineDropper));
+}
+
+int mmap_get_line(const MmapLineDropper *mld, const char **line, int *line_len)
+{
+   return mmap_fast_get_line(mld, line, line_len);
+}
+
+int mmap_advance(MmapLineDropper *mld)
+{
+   const char *ptr = mmap_next_line_start(mld);
+
+   if (ptr < mld->data_end)
+   {
+      mld->cur_line = ptr;
+      mld->cur_line_end = mmap_find_line_end(mld, ptr);
+      mmap_release_behind(mld);
+      return 1;
+   }
+   else
+      return 0;
+}
+
+int mmap_spent(const MmapLineDropper *mld)
+{
+   return mmap_next_line_start(mld) >= mld->data_end;
+}
+
+/** LineDrop functions for MmapLineDropper */
+
+void init_mmap_line_drop(LineDrop *ld, MmapLineDropper *mld)
+{
+   DropInitialize(ld,
+                  mld,
+                  ld_mmap_advance,
+                  ld_mmap_get_line,
+                  ld_mmap_spent,
+                  NULL);
+
+   ld->get_lines = ld_mmap_get_lines;
+}
+
+int ld_mmap_get_line(void *mld, const char **line, int *line_len)
+{
+   return mmap_get_line((MmapLineDropper*)mld, line, line_len);
+}
+
+int ld_mmap_advance(void *mld)
+{
+   return mmap_advance((MmapLineDropper*)mld);
+}
+
+int ld_mmap_spent(const void *mld)
+{
+   return mmap_spent((const MmapLineDropper*)mld);
+}
+
+/**
+ * Pages are not released during a batch, so every span stays
+ * resident until the next mmap_advance().
+ */
+int ld_mmap_get_lines(LineDrop *ld, LineSpan *spans, int max_spans)
+{
+   MmapLineDropper *mld = (MmapLineDropper*)ld->data;
+   const char *prev_line, *prev_line_end;
+   const char *ptr;
+   int count = 0;
+
+   if (!mmap_get_line(mld, &spans->line, &spans->line_len))
+      return 0;
+
+   while (++count < max_spans)
+   {
+      ptr = mmap_next_line_start(mld);
+      if (ptr >= mld->data_end)
+         break;
+
+      prev_line = mld->cur_line;
+      prev_line_end = mld->cur_line_end;
+
+      mld->cur_line = ptr;
+      mld->cur_line_end = mmap_find_line_end(mld, ptr);
+
+      if (ld->break_check && (*ld->break_check)(ld))
+      {
+         mld->cur_line = prev_line;
+         mld->cur_line_end = prev_line_end;
+         line_end_cache_clear(&mld->eols);
+         break;
+      }
+
+      mmap_get_line(mld, &spans[count].line, &spans[count].line_len);
+   }
+
+   return count;
+}
+
+/*********************
+ * Ring Line Dropper
+ ********************/
+
+static void ring_update_peak(RingLineDropper *rld)
+{
+   size_t in_use = rld->capacity + rld->spill_capacity;
+   if (in_use > rld->peak_memory)
+      rld->peak_memory = in_use;
+}
+
+static char *ring_alloc(size_t capacity)
+{
+   void *ring = NULL;
+   if (posix_memalign(&ring, RING_ALIGNMENT, capacity))
+      return NULL;
+
+   return (char*)ring;
+}
+
+/**
+ * Double the ring when a line fills it.  The live data is copied
+ * to the front of the new ring, and the offsets are rebased to match.
+ */
+static int ring_grow(RingLineDropper *rld)
+{
+   size_t new_capacity = rld->capacity * 2;
+   size_t used = rld->data_end - rld->cur_line;
+   size_t index = rld->cur_line & (rld->capacity - 1);
+   size_t first_len = rld->capacity - index;
+
+   char *new_ring = ring_alloc(new_capacity);
+   if (!new_ring)
+      return 0;
+
+   if (first_len > used)
+      first_len = used;
+
+   memcpy(new_ring, rld->ring + index, first_len);
+   memcpy(new_ring + first_len, rld->ring, used - first_len);
+
+   free(rld->ring);
+   rld->ring = new_ring;
+   rld->capacity = new_capacity;
+
+   rld->scanned_to -= rld->cur_line;
+   rld->data_end -= rld->cur_line;
+   rld->cur_line = 0;
+
+   ring_update_peak(rld);
+   return 1;
+}
+
+/**
+ * Read as much as will fit into the contiguous free space after the
+ * data, growing the ring first if it is full.
+ */
+static int ring_fill(RingLineDropper *rld)
+{
+   size_t used = rld->data_end - rld->cur_line;
+   size_t index, len;
+   int bytes_read;
+
+   if (used == rld->capacity && !ring_grow(rld))
+      return 0;
+
+   index = rld->data_end & (rld->capacity - 1);
+   len = rld->capacity - used;
+   if (len > rld->capacity - index)
+      len = rld->capacity - index;
+   if (len > 0x40000000)
+      len = 0x40000000;
+
+   bytes_read = (*rld->read)(rld->source, rld->ring + index, len);
+   if (bytes_read > 0)
+      rld->data_end += bytes_read;
+   else
+      rld->source_done = 1;
+
+   return 1;
+}
+
+/**
+ * Make the current line available as one piece, copying it to the
+ * spill buffer if it wraps around the end of the ring.
+ */
+static int ring_set_line(RingLineDropper *rld, size_t line_end, size_t next_line)
+{
+   size_t len = line_end - rld->cur_line;
+   size_t index = rld->cur_line & (rld->capacity - 1);
+   size_t first_len = rld->capacity - index;
+
+   if (len <= first_len)
+      rld->line = rld->ring + index;
+   else
+   {
+      if (len > rld->spill_capacity)
+      {
+         size_t new_capacity = rld->spill_capacity ? rld->spill_capacity : RING_MIN_CAPACITY;
+         while (new_capacity < len)
+            new_capacity *= 2;
+
+         char *new_spill = (char*)realloc(rld->spill, new_capacity);
+         if (!new_spill)
+            return 0;
+
+         rld->spill = new_spill;
+         rld->spill_capacity = new_capacity;
+         ring_update_peak(rld);
+      }
+
+      memcpy(rld->spill, rld->ring + index, first_len);
+      memcpy(rld->spill + first_len, rld->ring, len - first_len);
+      rld->line = rld->spill;
+   }
+
+   rld->line_len = len;
+   rld->next_line = next_line;
+   rld->has_line = 1;
+   return 1;
+}
+
+/**
+ * Find the end of the line starting at rld->cur_line, reading more
+ * data as needed.  Each byte is searched only once, even when the
+ * search must wait for more data.
+ *
+ * @return 1 if a line was found, 0 if no data remains.
+ */
+static int ring_find_line(RingLineDropper *rld)
+{
+   const char *piece, *newline;
+   size_t index, piece_len, line_end;
+
+   for (;;)
+   {
+      while (rld->scanned_to < rld->data_end)
+      {
+         index = rld->scanned_to & (rld->capacity - 1);
+         piece = rld->ring + index;
+         piece_len = rld->data_end - rld->scanned_to;
+         if (piece_len > rld->capacity - index)
+            piece_len = rld->capacity - index;
+
+         if ((newline = scan_find_newline(piece, piece + piece_len)))
+         {
+            line_end = rld->scanned_to + (newline - piece);
+            rld->scanned_to = line_end + 1;
+
+            if (line_end > rld->cur_line
+                && rld->ring[(line_end - 1) & (rld->capacity - 1)] == '\r')
+               return ring_set_line(rld, line_end - 1, line_end + 1);
+            else
+               return ring_set_line(rld, line_end, line_end + 1);
+         }
+
+         rld->scanned_to += piece_len;
+      }
+
+      if (rld->source_done)
+      {
+         // An unterminated last line ends with the data:
+         if (rld->cur_line < rld->data_end)
+            return ring_set_line(rld, rld->data_end, rld->data_end);
+         else
+            return 0;
+      }
+
+      if (!ring_fill(rld))
+         return 0;
+   }
+}
+
+/**
+ * Prepare a RingLineDropper to read lines from any source.
+ *
+ * *capacity* is rounded up to a power of two.  Call ring_release_dropper()
+ * to free the buffers when done.
+ *
+ * @return 1 for success, 0 if the ring could not be allocated.
+ */
+int ring_init_dropper(RingLineDropper *rld, void *source, ring_source_read reader, size_t capacity)
+{
+   memset(rld, 0, sizeof(RingLineDropper));
+
+   rld->source = source;
+   rld->read = reader;
+
+   rld->capacity = RING_MIN_CAPACITY;
+   while (rld->capacity < capacity)
+      rld->capacity *= 2;
+
+   rld->ring = ring_alloc(rld->capacity);
+   if (!rld->ring)
+      return 0;
+
+   ring_update_peak(rld);
+   ring_find_line(rld);
+
+   return 1;
+}
+
+int ring_stream_read(void *stream, char *buffer, int buff_len)
+{
+   size_t bytes_read = fread(buffer, 1, buff_len, (FILE*)stream);
+   if (bytes_read == 0 && ferror((FILE*)stream))
+      return -1;
+
+   return bytes_read;
+}
+
+int ring_init_stream_dropper(RingLineDropper *rld, FILE *stream, size_t capacity)
+{
+   return ring_init_dropper(rld, stream, ring_stream_read, capacity);
+}
+
+/**
+ * Read from the descriptor, asking the kernel to start reading the
+ * next window of a regular file before it is needed.
+ */
+int fd_source_read(void *source, char *buffer, int buff_len)
+{
+   FdSource *fds = (FdSource*)source;
+   ssize_t bytes_read;
+
+   do
+      bytes_read = read(fds->fd, buffer, buff_len);
+   while (bytes_read < 0 && errno == EINTR);
+
+   if (bytes_read > 0 && fds->is_file)
+   {
+      fds->offset += bytes_read;
+
+      if (fds->use_readahead && fds->offset + fds->window > fds->hinted_to)
+      {
+#ifdef __linux__
+         readahead(fds->fd, fds->hinted_to, fds->window);
+#else
+         posix_fadvise(fds->fd, fds->hinted_to, fds->window, POSIX_FADV_WILLNEED);
+#endif
+         fds->hinted_to += fds->window;
+      }
+   }
+
+   return bytes_read;
+}
+
+/**
+ * Prepare a RingLineDropper to read from an open file descriptor.
+ *
+ * The FdSource must remain in scope while the dropper is used, and the
+ * caller remains responsible for closing the descriptor.  Include
+ * FD_SOURCE_READAHEAD in *flags* to request readahead of the next
+ * *capacity* bytes of a regular file as each read completes.
+ */
+int ring_init_fd_dropper(RingLineDropper *rld, FdSource *fds, int fd, size_t capacity, int flags)
+{
+   struct stat st;
+
+   memset(fds, 0, sizeof(FdSource));
+   fds->fd = fd;
+   fds->use_readahead = (flags & FD_SOURCE_READAHEAD) != 0;
+
+   if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+   {
+      fds->is_file = 1;
+      fds->offset = fds->hinted_to = lseek(fd, 0, SEEK_CUR);
+      fds->window = capacity < RING_DEFAULT_CAPACITY ? RING_DEFAULT_CAPACITY : capacity;
+
+      posix_fadvise(fd, fds->offset, 0, POSIX_FADV_SEQUENTIAL);
+      if (fds->use_readahead)
+      {
+         posix_fadvise(fd, fds->offset, fds->window, POSIX_FADV_WILLNEED);
+         fds->hinted_to += fds->window;
+      }
+   }
+
+   return ring_init_dropper(rld, fds, fd_source_read, capacity);
+}
+
+void ring_release_dropper(RingLineDropper *rld)
+{
+   free(rld->ring);
+   free(rld->spill);
+   rld->ring = rld->spill = NULL;
+   rld->has_line = 0;
+}
+
+int ring_get_line(const RingLineDropper *rld, const char **line, int *line_len)
+{
+   return ring_fast_get_line(rld, line, line_len);
+}
+
+int ring_advance(RingLineDropper *rld)
+{
+   size_t old_line = rld->cur_line;
+
+   if (!rld->has_line)
+      return 0;
+
+   rld->cur_line = rld->next_line;
+   if (ring_find_line(rld))
+      return 1;
+
+   // Leave the last line current, as the other droppers do:
+   rld->cur_line = old_line;
+   return 0;
+}
+
+int ring_spent(const RingLineDropper *rld)
+{
+   return rld->source_done && rld->next_line >= rld->data_end;
+}
+
+size_t ring_peak_memory(const RingLineDropper *rld)
+{
+   return rld->peak_memory;
+}
+
+/** LineDrop functions for RingLineDropper */
+
+/**
+ * A wrapped line shares the spill buffer with the line before it,
+ * so RingLineDropper does not provide a native get_lines function.
+ */
+void init_ring_line_drop(LineDrop *ld, RingLineDropper *rld)
+{
+   DropInitialize(ld,
+                  rld,
+                  ld_ring_advance,
+                  ld_ring_get_line,
+                  ld_ring_spent,
+                  NULL);
+}
+
+int ld_ring_get_line(void *rld, const char **line, int *line_len)
+{
+   return ring_get_line((RingLineDropper*)rld, line, line_len);
+}
+
+int ld_ring_advance(void *rld)
+{
+   return ring_advance((RingLineDropper*)rld);
+}
+
+int ld_ring_spent(const void *rld)
+{
+   return ring_spent((const RingLineDropper*)rld);
+}
+
 /************************************
  * Conditionally-compiled test code.
  ***********************************/
@@ -266,6 +927,7 @@ int ld_list_spent(const void *sld)
 #ifdef LINEDROP_MAIN
 
 #include <stdio.h>
+#include <fcntl.h>     // for open()
 
 void test_with_stream(void)
 {
@@ -358,12 +1020,293 @@ void test_with_string_list(void)
 
  }
 
+void test_with_mmap(void)
+{
+   const char *line;
+   int line_len;
+   int current_line = 0;
+
+   MmapLineDropper mld;
+   LineDrop        ld;
+
+   int fd = open("linedrop.c", O_RDONLY);
+   if (fd >= 0)
+   {
+      if (mmap_init_dropper(&mld, fd))
+      {
+         init_mmap_line_drop(&ld, &mld);
+         ld.break_check = NULL;
+
+         do
+         {
+            if (DropGetLine(&ld, &line, &line_len))
+               printf("%3d [34;1m%.*s[m\n", ++current_line, line_len, line);
+         }
+         while (DropAdvance(&ld));
+
+         mmap_release_dropper(&mld);
+      }
+
+      close(fd);
+   }
+}
+
+void test_with_ring(void)
+{
+   const char *line;
+   int line_len;
+   int current_line = 0;
+
+   RingLineDropper rld;
+   LineDrop        ld;
+
+   FILE *stream = fopen("linedrop.c", "r");
+   if (stream)
+   {
+      // Use a tiny ring to exercise wrapping and growing:
+      if (ring_init_stream_dropper(&rld, stream, RING_MIN_CAPACITY))
+      {
+         init_ring_line_drop(&ld, &rld);
+         ld.break_check = NULL;
+
+         do
+         {
+            if (DropGetLine(&ld, &line, &line_len))
+               printf("%3d [35;1m%.*s[m\n", ++current_line, line_len, line);
+         }
+         while (DropAdvance(&ld));
+
+         printf("Peak memory use was %lu bytes.\n", (unsigned long)ring_peak_memory(&rld));
+         ring_release_dropper(&rld);
+      }
+
+      fclose(stream);
+   }
+}
+
+LINEDROP_DEFINE(all_stream, stream, StreamLineDropper, break_never)
+LINEDROP_DEFINE(all_mmap, mmap, MmapLineDropper, break_never)
+LINEDROP_DEFINE(all_ring, ring, RingLineDropper, break_never)
+
+/**
+ * Compare *line* with the next line of the text at **expected**, and
+ * move **expected** past that line.
+ */
+int expect_line(const char **expected, const char *line, int line_len)
+{
+   const char *end = strchr(*expected, '\n');
+   int expected_len;
+   int matched;
+
+   if (!end)
+      end = *expected + strlen(*expected);
+
+   expected_len = end - *expected;
+   if (expected_len > 0 && (*expected)[expected_len-1] == '\r')
+      --expected_len;
+
+   matched = line_len == expected_len && memcmp(line, *expected, line_len) == 0;
+   *expected = *end ? end + 1 : end;
+   return matched;
+}
+
+void report_fast_path(const char *label, int passed)
+{
+   printf("%-24s %s\n", label, passed ? "[32;1mpassed[m" : "[31;1mFAILED[m");
+}
+
+/**
+ * Read lines of many lengths, some ending in CRLF and the last one
+ * unterminated, through the LINEDROP_DEFINE() functions of each
+ * dropper, and check that they match the text.
+ */
+int test_fast_paths(void)
+{
+   static char text[200000];
+   static char buffer[4096];
+   StreamLineDropper sld;
+   MmapLineDropper   mld;
+   RingLineDropper   rld;
+   const char *line, *expected;
+   int line_len, index, passed;
+   int all_passed = 1;
+   size_t len = 0;
+
+   for (index = 0; index < 1200; ++index)
+   {
+      memset(text + len, 'a' + index % 26, (index * 37) % 301);
+      len += (index * 37) % 301;
+      if (index < 1199)
+         len += sprintf(text + len, index % 3 ? "\n" : "\r\n");
+   }
+   text[len] = '\0';
+
+   FILE *stream = tmpfile();
+   if (!stream || fwrite(text, 1, len, stream) != len || fflush(stream))
+   {
+      printf("Failed to write the test file.\n");
+      return 0;
+   }
+
+   rewind(stream);
+   stream_init_dropper(&sld, stream, buffer, sizeof(buffer));
+   expected = text;
+   passed = 1;
+   do
+      passed = all_stream_get_line(&sld, &line, &line_len) && expect_line(&expected, line, line_len) && passed;
+   while (all_stream_advance(&sld));
+   report_fast_path("stream_fast_advance()", passed = passed && *expected == '\0');
+   all_passed &= passed;
+
+   if (mmap_init_dropper(&mld, fileno(stream)))
+   {
+      expected = text;
+      passed = 1;
+      do
+         passed = all_mmap_get_line(&mld, &line, &line_len) && expect_line(&expected, line, line_len) && passed;
+      while (all_mmap_advance(&mld));
+      report_fast_path("mmap_fast_advance()", passed = passed && *expected == '\0');
+      all_passed &= passed;
+      mmap_release_dropper(&mld);
+   }
+   else
+      all_passed = 0;
+
+   // A tiny ring, so lines wrap around it and make it grow:
+   rewind(stream);
+   if (ring_init_stream_dropper(&rld, stream, RING_MIN_CAPACITY))
+   {
+      expected = text;
+      passed = 1;
+      do
+         passed = all_ring_get_line(&rld, &line, &line_len) && expect_line(&expected, line, line_len) && passed;
+      while (all_ring_advance(&rld));
+      report_fast_path("ring_fast_advance()", passed = passed && *expected == '\0');
+      all_passed &= passed;
+      ring_release_dropper(&rld);
+   }
+   else
+      all_passed = 0;
+
+   fclose(stream);
+   return all_passed;
+}
+
+/**
+ * Compare the LineDrop loop with a LINEDROP_DEFINE() loop over a
+ * large message body held in memory.
+ */
+LINEDROP_DEFINE(bench_body, stream, StreamLineDropper, break_on_rs)
+
+#include <stdlib.h>
+#include <time.h>
+
+// About 32MB of 78-byte lines, so the body ends on a line boundary:
+#define BENCH_BODY_LINES (430 * 1000)
+#define BENCH_BODY_SIZE  (BENCH_BODY_LINES * 78)
+
+double bench_seconds(const struct timespec *start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/** Check that a benchmark loop stopped at the RS line, having read the whole body. */
+int report_break(const char *label, int at_rs, long total)
+{
+   if (at_rs && total == (long)BENCH_BODY_LINES * 76)
+      return 1;
+
+   printf("[31;1m%s did not stop at the RS line.[m\n", label);
+   return 0;
+}
+
+int bench_specialized(void)
+{
+   static char buffer[64 * 1024];
+   StreamLineDropper sld;
+   LineDrop          ld;
+   struct timespec   start;
+
+   const char *line;
+   int line_len, index;
+   long total;
+   int stopped;
+
+   // A body of 76-character base64-like lines, ended by an RS line and
+   // followed by a line that the loops must not reach:
+   static const char trailer[] = "\x1E\nNot part of the body.\n";
+   char *body = (char*)malloc(BENCH_BODY_SIZE + sizeof(trailer));
+   if (!body)
+   {
+      printf("Failed to allocate the benchmark body.\n");
+      return 0;
+   }
+
+   for (index = 0; index < BENCH_BODY_SIZE; ++index)
+      body[index] = (index % 78 == 77) ? '\n' : (index % 78 == 76 ? '\r' : 'A' + index % 26);
+   memcpy(body + BENCH_BODY_SIZE, trailer, sizeof(trailer));
+
+   FILE *stream = fmemopen(body, BENCH_BODY_SIZE + sizeof(trailer) - 1, "r");
+   if (!stream)
+   {
+      perror("fmemopen");
+      free(body);
+      return 0;
+   }
+
+   stream_init_dropper(&sld, stream, buffer, sizeof(buffer));
+   init_stream_line_drop(&ld, &sld);
+   ld.break_check = LineDrop_break_on_rs;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   total = 0;
+   do
+   {
+      DropGetLine(&ld, &line, &line_len);
+      total += line_len;
+   }
+   while (DropAdvance(&ld));
+   printf("LineDrop loop:    %ld characters in %.3f seconds\n", total, bench_seconds(&start));
+   stopped = report_break("LineDrop loop", DropGetLine(&ld, &line, &line_len) && break_on_rs(line, line_len), total);
+
+   rewind(stream);
+   stream_init_dropper(&sld, stream, buffer, sizeof(buffer));
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   total = 0;
+   do
+   {
+      bench_body_get_line(&sld, &line, &line_len);
+      total += line_len;
+   }
+   while (bench_body_advance(&sld));
+   printf("Specialized loop: %ld characters in %.3f seconds\n", total, bench_seconds(&start));
+   stopped = report_break("Specialized loop", bench_body_get_line(&sld, &line, &line_len) && break_on_rs(line, line_len), total)
+      && stopped;
+
+   fclose(stream);
+   free(body);
+   return stopped;
+}
+
 int main(int argc, const char **argv)
 {
+   if (argc > 1 && strcmp(argv[1], "bench") == 0)
+   {
+      return bench_specialized() ? 0 : 1;
+   }
+
    /* test_with_stream(); */
+   /* test_with_mmap(); */
+   /* test_with_ring(); */
 
    test_with_string_list();
 
+   if (!test_fast_paths())
+      return 1;
+
    return 0;
 }
 
@@ -3,6 +3,8 @@
 
 #include <stdio.h>
 #include <string.h> // for memset
+#include <sys/types.h> // for off_t
+#include "linescan.h"  // for scan_find_newline(), used by ring_fast_advance()
 
 struct _line_drop;
 
@@ -14,6 +16,21 @@ typedef int (*dropper_spent)(const void *obj);
 // That is, return non-zero to continue looping, 0 to terminate.
 typedef int (*dropper_break_check)(const struct _line_drop *ld);
 
+/**
+ * A line returned by DropGetLines(), pointing into the dropper's data.
+ */
+typedef struct _line_span
+{
+   const char *line;
+   int        line_len;
+} LineSpan;
+
+// Suggested LineSpan array size for callers of DropGetLines()
+#define LINEDROP_BATCH_SIZE 64
+
+// Optional: return several lines at once (see DropGetLines()).
+typedef int (*dropper_get_lines)(struct _line_drop *ld, LineSpan *spans, int max_spans);
+
 typedef struct _line_drop
 {
    void                *data;
@@ -21,10 +38,13 @@ typedef struct _line_drop
    dropper_get_line    get_line;
    dropper_spent       is_spent;
    dropper_break_check break_check;
+   dropper_get_lines   get_lines;
 } LineDrop;
 
 // Built-in implementation of dropper_break_check for an empty line:
 int LineDrop_break_on_empty_line(const LineDrop *ld);
+// Built-in implementation of dropper_break_check for a record separator (RS, 0x1E) line:
+int LineDrop_break_on_rs(const LineDrop *ld);
 
 void DropInitialize(LineDrop *new_line_drop,
                     void *data,
@@ -45,14 +65,110 @@ static inline int DropGetLine(const void *obj, const char **line, int *line_len)
    return ld->get_line(ld->data, line, line_len);
 }
 
+/**
+ * @brief Fill *spans* with the current line and as many of the following
+ *        lines as the dropper can provide at once, up to *max_spans*.
+ *
+ * The dropper is left on the last line returned, and a batch never
+ * includes a line that would make DropAdvance() return 0.  That means
+ * DropGetLines() can replace DropGetLine() in the usual loop:
+ * ~~~
+ * do
+ * {
+ *    count = DropGetLines(ld, spans, LINEDROP_BATCH_SIZE);
+ *    ...use spans[0] to spans[count-1]...
+ * } while (DropAdvance(ld));
+ * ~~~
+ * The spans are only valid until the next DropAdvance().  Droppers
+ * without a native get_lines function return one line per call.
+ *
+ * @return The number of spans filled.
+ */
+int DropGetLines(LineDrop *ld, LineSpan *spans, int max_spans);
+
+
+/*************************************
+ * Compile-time specialized droppers
+ ************************************/
+
+/**
+ * Line tests for LINEDROP_DEFINE(), matching the built-in break checks.
+ * Return non-zero to stop at the line.
+ */
+static inline int break_on_empty_line(const char *line, int line_len) { return line_len == 0; }
+static inline int break_on_rs(const char *line, int line_len)
+{
+   return line_len == 1 && *line == '\x1E';
+}
+static inline int break_never(const char *line, int line_len) { return 0; }
+
+/**
+ * @brief Define advance and get-line functions for one dropper type and
+ *        one line test, without function pointers.
+ *
+ * LINEDROP_DEFINE(body, stream, StreamLineDropper, break_on_rs) defines
+ * body_advance() and body_get_line(), which behave like DropAdvance()
+ * and DropGetLine() for a LineDrop made from a StreamLineDropper with a
+ * break check that stops at an RS line.  They use the dropper's inline
+ * fast paths (stream_fast_advance() and stream_fast_get_line(), here),
+ * which call into the library only to read more data, so the per-line
+ * path is compiled into the caller.  The break test gets the line from
+ * the advance rather than with another get_line call.
+ *
+ * PREFIX names the dropper's functions (stream, list, mmap or ring),
+ * and TEST is a function or macro taking (const char *line, int line_len).
+ * Use the LineDrop interface where the dropper type is not known.
+ */
+#define LINEDROP_DEFINE(NAME, PREFIX, TYPE, TEST)                          \
+   static inline int NAME##_get_line(TYPE *obj, const char **line, int *line_len) \
+   {                                                                       \
+      return PREFIX##_fast_get_line(obj, line, line_len);                  \
+   }                                                                       \
+   static inline int NAME##_advance(TYPE *obj)                             \
+   {                                                                       \
+      const char *line;                                                    \
+      int        line_len;                                                 \
+      return PREFIX##_fast_advance(obj)                                    \
+         && !(PREFIX##_fast_get_line(obj, &line, &line_len) && TEST(line, line_len)); \
+   }
+
 
 const char *string_find_line_end(const char *line, const char *end_of_data);
 
+// Number of line ends found with each scan of a dropper's data
+#define LINE_END_CACHE_SIZE 64
+
+/**
+ * Newline positions found ahead of a dropper's current line, used in order.
+ */
+typedef struct _line_end_cache
+{
+   const char *ends[LINE_END_CACHE_SIZE];
+   int        count;
+   int        next;
+} LineEndCache;
+
+const char *line_end_cache_next(LineEndCache *lec, const char *line, const char *end_of_data);
+static inline void line_end_cache_clear(LineEndCache *lec) { lec->count = lec->next = 0; }
+static inline int line_end_cache_ready(const LineEndCache *lec) { return lec->next < lec->count; }
+
+/** Use the next cached line end, which must be ready, for the line at *line*. */
+static inline const char *line_end_cache_take(LineEndCache *lec, const char *line)
+{
+   const char *newline = lec->ends[lec->next++];
+   if (newline > line && *(newline-1) == '\r')
+      --newline;
+
+   return newline;
+}
+
 /**********************
  * Stream Line Dropper
  *********************/
 
 // "Class" StreamLineDropper
+// Lines longer than the caller's buffer are cut short.  Use
+// RingLineDropper when a source may contain such lines.
 typedef struct _stream_dropper
 {
    FILE *stream;
@@ -61,6 +177,7 @@ typedef struct _stream_dropper
    const char *data_end;
    const char *cur_line;
    const char *cur_line_end;
+   LineEndCache eols;
 } StreamLineDropper;
 
 void stream_init_dropper(StreamLineDropper *sld, FILE *stream, char *buffer, int buffer_len);
@@ -70,11 +187,43 @@ int stream_get_line(const StreamLineDropper *sld, const char **line, int *line_l
 int stream_advance(StreamLineDropper *sld);
 int stream_spent(const StreamLineDropper *sld);
 
+static inline int stream_fast_get_line(const StreamLineDropper *sld, const char **line, int *line_len)
+{
+   if (sld->cur_line && sld->cur_line_end)
+   {
+      *line = sld->cur_line;
+      *line_len = sld->cur_line_end - sld->cur_line;
+      return 1;
+   }
+
+   return 0;
+}
+
+/** stream_advance(), inline while the line end cache holds the next line. */
+static inline int stream_fast_advance(StreamLineDropper *sld)
+{
+   const char *ptr = sld->cur_line_end;
+   if (ptr < sld->data_end && *ptr == '\r')
+      ++ptr;
+   if (ptr < sld->data_end && *ptr == '\n')
+      ++ptr;
+
+   if (ptr < sld->data_end && line_end_cache_ready(&sld->eols))
+   {
+      sld->cur_line = ptr;
+      sld->cur_line_end = line_end_cache_take(&sld->eols, ptr);
+      return 1;
+   }
+
+   return stream_advance(sld);
+}
+
 // Implement LineDrop
 void init_stream_line_drop(LineDrop *ld, StreamLineDropper *sld);
 int ld_stream_get_line(void *sld, const char **line, int *line_len);
 int ld_stream_advance(void *sld);
 int ld_stream_spent(const void *sld);
+int ld_stream_get_lines(LineDrop *ld, LineSpan *spans, int max_spans);
 
 
 /***************************
@@ -93,12 +242,246 @@ int list_get_line(ListLineDropper *lld, const char **line, int *line_len);
 int list_advance(ListLineDropper *lld);
 int list_spent(const ListLineDropper *lld);
 
+static inline int list_fast_get_line(ListLineDropper *lld, const char **line, int *line_len)
+{
+   if (*lld->current)
+   {
+      *line = *lld->current;
+      *line_len = strlen(*line);
+      return 1;
+   }
+   else
+      return 0;
+}
+
+static inline int list_fast_advance(ListLineDropper *lld)
+{
+   return *lld->current && *++lld->current;
+}
+
 // Implement LineDrop
 void init_list_line_drop(LineDrop *ld, ListLineDropper *lld);
 int ld_list_get_line(void *sld, const char **line, int *line_len);
 int ld_list_advance(void *sld);
 int ld_list_spent(const void *sld);
+int ld_list_get_lines(LineDrop *ld, LineSpan *spans, int max_spans);
+
+
+/*************************
+ * Memory-mapped Line Dropper
+ ************************/
+
+// Pages behind the current line are released in blocks of this size
+#define MMAP_RELEASE_WINDOW (1024 * 1024)
+
+/**
+ * Reads lines from a file mapped into memory.  Lines are returned
+ * as pointers into the mapping, so nothing is copied.  Pages that
+ * have been read are released back to the kernel as the current
+ * line advances, so a large file never occupies much memory.
+ */
+typedef struct _mmap_dropper
+{
+   char         *map;
+   size_t       map_len;
+   const char   *data_end;
+   const char   *cur_line;
+   const char   *cur_line_end;
+   const char   *released_to;
+   LineEndCache eols;
+} MmapLineDropper;
+
+int mmap_init_dropper(MmapLineDropper *mld, int fd);
+int mmap_init_range_dropper(MmapLineDropper *mld, int fd, off_t offset, size_t length);
+void mmap_release_dropper(MmapLineDropper *mld);
+
+int mmap_get_line(const MmapLineDropper *mld, const char **line, int *line_len);
+int mmap_advance(MmapLineDropper *mld);
+int mmap_spent(const MmapLineDropper *mld);
 
+static inline int mmap_fast_get_line(const MmapLineDropper *mld, const char **line, int *line_len)
+{
+   if (mld->cur_line && mld->cur_line_end)
+   {
+      *line = mld->cur_line;
+      *line_len = mld->cur_line_end - mld->cur_line;
+      return 1;
+   }
+
+   return 0;
+}
+
+/**
+ * mmap_advance(), inline while the line end cache holds the next line
+ * and no pages are due to be released.
+ */
+static inline int mmap_fast_advance(MmapLineDropper *mld)
+{
+   const char *ptr = mld->cur_line_end;
+   if (ptr < mld->data_end && *ptr == '\r')
+      ++ptr;
+   if (ptr < mld->data_end && *ptr == '\n')
+      ++ptr;
+
+   if (ptr < mld->data_end
+       && line_end_cache_ready(&mld->eols)
+       && ptr - mld->released_to < MMAP_RELEASE_WINDOW)
+   {
+      mld->cur_line = ptr;
+      mld->cur_line_end = line_end_cache_take(&mld->eols, ptr);
+      return 1;
+   }
+
+   return mmap_advance(mld);
+}
+
+// Implement LineDrop
+void init_mmap_line_drop(LineDrop *ld, MmapLineDropper *mld);
+int ld_mmap_get_line(void *mld, const char **line, int *line_len);
+int ld_mmap_advance(void *mld);
+int ld_mmap_spent(const void *mld);
+int ld_mmap_get_lines(LineDrop *ld, LineSpan *spans, int max_spans);
+
+/*********************
+ * Ring Line Dropper
+ ********************/
+
+/**
+ * Source function for RingLineDropper.  Read up to *buff_len* bytes
+ * into *buffer*, returning the number of bytes read, 0 at the end of
+ * the data, or -1 for an error (which also ends the data).
+ */
+typedef int (*ring_source_read)(void *source, char *buffer, int buff_len);
+
+// Default and minimum RingLineDropper buffer sizes
+#define RING_DEFAULT_CAPACITY (64 * 1024)
+#define RING_MIN_CAPACITY     256
+
+// Alignment of the ring.  Reads start wherever the data ends, so only
+// a read that wraps around to the start of the ring is page-aligned.
+#define RING_ALIGNMENT 4096
+
+/**
+ * Reads lines through a circular buffer that it allocates and owns.
+ *
+ * New data is read into the free part of the ring, so unread data is
+ * never moved.  A line that wraps around the end of the ring is
+ * copied to a spill buffer so it can be returned in one piece, and
+ * a line longer than the ring causes the ring to double in size
+ * rather than being truncated.
+ *
+ * Offsets are counted from the start of the data, and are converted
+ * to ring positions by masking with capacity-1.
+ */
+typedef struct _ring_dropper
+{
+   void             *source;
+   ring_source_read read;
+   int              source_done;
+
+   char   *ring;
+   size_t capacity;        // always a power of two
+   size_t cur_line;        // offset of the current line
+   size_t next_line;       // offset of the line after the current line
+   size_t scanned_to;      // offset to resume searching for a newline
+   size_t data_end;        // offset after the last byte read
+
+   const char *line;       // current line, in the ring or the spill buffer
+   int        line_len;
+   int        has_line;
+
+   char   *spill;
+   size_t spill_capacity;
+   size_t peak_memory;
+} RingLineDropper;
+
+int ring_init_dropper(RingLineDropper *rld, void *source, ring_source_read reader, size_t capacity);
+int ring_init_stream_dropper(RingLineDropper *rld, FILE *stream, size_t capacity);
+void ring_release_dropper(RingLineDropper *rld);
+
+int ring_stream_read(void *stream, char *buffer, int buff_len);
+
+int ring_get_line(const RingLineDropper *rld, const char **line, int *line_len);
+int ring_advance(RingLineDropper *rld);
+int ring_spent(const RingLineDropper *rld);
+
+static inline int ring_fast_get_line(const RingLineDropper *rld, const char **line, int *line_len)
+{
+   if (rld->has_line)
+   {
+      *line = rld->line;
+      *line_len = rld->line_len;
+      return 1;
+   }
+
+   return 0;
+}
+
+/**
+ * ring_advance(), inline when the next line ends in the data already
+ * read and does not wrap around the end of the ring.
+ */
+static inline int ring_fast_advance(RingLineDropper *rld)
+{
+   size_t mask = rld->capacity - 1;
+   size_t start = rld->next_line & mask;
+   size_t index = rld->scanned_to & mask;
+   size_t piece_len = rld->data_end - rld->scanned_to;
+   const char *newline;
+   size_t line_end;
+
+   if (piece_len > rld->capacity - index)
+      piece_len = rld->capacity - index;
+
+   if (rld->has_line
+       && rld->scanned_to < rld->data_end
+       && start <= index
+       && (newline = scan_find_newline(rld->ring + index, rld->ring + index + piece_len)))
+   {
+      line_end = rld->scanned_to + (newline - (rld->ring + index));
+
+      rld->cur_line = rld->next_line;
+      rld->scanned_to = rld->next_line = line_end + 1;
+      rld->line = rld->ring + start;
+      rld->line_len = line_end - rld->cur_line;
+      if (rld->line_len > 0 && *(newline-1) == '\r')
+         --rld->line_len;
+
+      return 1;
+   }
+
+   return ring_advance(rld);
+}
+
+/** Largest number of bytes held at one time by the ring and spill buffers. */
+size_t ring_peak_memory(const RingLineDropper *rld);
+
+/**
+ * RingLineDropper source that reads a file descriptor directly,
+ * without stdio.  Regular files get sequential-access and readahead
+ * hints; pipes and sockets are simply read until end-of-file.
+ */
+typedef struct _fd_source
+{
+   int    fd;
+   int    is_file;
+   int    use_readahead;
+   off_t  offset;       // file position of the next read
+   off_t  hinted_to;    // file position up to which readahead was requested
+   size_t window;       // how far ahead of the reads to request readahead
+} FdSource;
+
+// Flags for ring_init_fd_dropper()
+#define FD_SOURCE_READAHEAD 1
+
+int fd_source_read(void *fds, char *buffer, int buff_len);
+int ring_init_fd_dropper(RingLineDropper *rld, FdSource *fds, int fd, size_t capacity, int flags);
+
+// Implement LineDrop
+void init_ring_line_drop(LineDrop *ld, RingLineDropper *rld);
+int ld_ring_get_line(void *rld, const char **line, int *line_len);
+int ld_ring_advance(void *rld);
+int ld_ring_spent(const void *rld);
 
 
 #endif
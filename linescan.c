@@ -0,0 +1,333 @@
+// -*- compile-command: "base=linescan; gcc -Wall -Werror -O2 -ggdb -DLINESCAN_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c" -*-
+
+#include <stddef.h>    // for NULL
+#include "linescan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LINESCAN_X86 1
+#include <immintrin.h>
+#endif
+
+typedef const char *(*scan_find_func)(const char *start, const char *end);
+typedef int (*scan_all_func)(const char *start, const char *end, const char **found, int max_found);
+
+typedef struct _scan_kernel
+{
+   const char     *name;
+   scan_find_func find;
+   scan_all_func  find_all;
+} ScanKernel;
+
+/*****************
+ * Scalar kernel
+ ****************/
+
+static const char *scalar_find_newline(const char *start, const char *end)
+{
+   while (start < end)
+   {
+      if (*start == '\n')
+         return start;
+      ++start;
+   }
+
+   return NULL;
+}
+
+static int scalar_find_newlines(const char *start, const char *end, const char **found, int max_found)
+{
+   int count = 0;
+   while (count < max_found && start < end)
+   {
+      if (*start == '\n')
+         found[count++] = start;
+      ++start;
+   }
+
+   return count;
+}
+
+static const ScanKernel scalar_kernel = { "scalar", scalar_find_newline, scalar_find_newlines };
+
+#ifdef LINESCAN_X86
+
+/**
+ * Save the position of each bit set in *mask*, least significant first,
+ * as pointers relative to *block*.  Stops when *found* is full.
+ */
+static inline int save_mask_positions(unsigned mask, const char *block,
+                                      const char **found, int count, int max_found)
+{
+   while (mask && count < max_found)
+   {
+      found[count++] = block + __builtin_ctz(mask);
+      mask &= mask - 1;
+   }
+
+   return count;
+}
+
+/***************
+ * SSE2 kernel
+ **************/
+
+__attribute__((target("sse2")))
+static const char *sse2_find_newline(const char *start, const char *end)
+{
+   const __m128i newlines = _mm_set1_epi8('\n');
+   unsigned mask;
+
+   while (end - start >= 16)
+   {
+      mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)start), newlines));
+      if (mask)
+         return start + __builtin_ctz(mask);
+      start += 16;
+   }
+
+   return scalar_find_newline(start, end);
+}
+
+__attribute__((target("sse2")))
+static int sse2_find_newlines(const char *start, const char *end, const char **found, int max_found)
+{
+   const __m128i newlines = _mm_set1_epi8('\n');
+   unsigned mask;
+   int count = 0;
+
+   while (count < max_found && end - start >= 16)
+   {
+      mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)start), newlines));
+      count = save_mask_positions(mask, start, found, count, max_found);
+      start += 16;
+   }
+
+   if (count < max_found)
+      count += scalar_find_newlines(start, end, found + count, max_found - count);
+
+   return count;
+}
+
+static const ScanKernel sse2_kernel = { "sse2", sse2_find_newline, sse2_find_newlines };
+
+/***************
+ * AVX2 kernel
+ **************/
+
+__attribute__((target("avx2")))
+static const char *avx2_find_newline(const char *start, const char *end)
+{
+   const __m256i newlines = _mm256_set1_epi8('\n');
+   unsigned mask;
+
+   while (end - start >= 32)
+   {
+      mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)start), newlines));
+      if (mask)
+         return start + __builtin_ctz(mask);
+      start += 32;
+   }
+
+   return sse2_find_newline(start, end);
+}
+
+__attribute__((target("avx2")))
+static int avx2_find_newlines(const char *start, const char *end, const char **found, int max_found)
+{
+   const __m256i newlines = _mm256_set1_epi8('\n');
+   unsigned mask;
+   int count = 0;
+
+   while (count < max_found && end - start >= 32)
+   {
+      mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)start), newlines));
+      count = save_mask_positions(mask, start, found, count, max_found);
+      start += 32;
+   }
+
+   if (count < max_found)
+      count += sse2_find_newlines(start, end, found + count, max_found - count);
+
+   return count;
+}
+
+static const ScanKernel avx2_kernel = { "avx2", avx2_find_newline, avx2_find_newlines };
+
+#endif  // LINESCAN_X86
+
+/**************
+ * Dispatching
+ *************/
+
+static const ScanKernel *selected_kernel = NULL;
+
+static const ScanKernel *get_kernel(void)
+{
+   if (!selected_kernel)
+   {
+#ifdef LINESCAN_X86
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2"))
+         selected_kernel = &avx2_kernel;
+      else if (__builtin_cpu_supports("sse2"))
+         selected_kernel = &sse2_kernel;
+      else
+#endif
+         selected_kernel = &scalar_kernel;
+   }
+
+   return selected_kernel;
+}
+
+const char *scan_find_newline(const char *start, const char *end)
+{
+   return (*get_kernel()->find)(start, end);
+}
+
+int scan_newlines(const char *start, const char *end, const char **found, int max_found)
+{
+   return (*get_kernel()->find_all)(start, end, found, max_found);
+}
+
+const char *scan_kernel_name(void)
+{
+   return get_kernel()->name;
+}
+
+
+/************************************
+ * Conditionally-compiled test code.
+ ***********************************/
+
+#ifdef LINESCAN_MAIN
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_SIZE (64 * 1024 * 1024)
+#define BENCH_PASSES 5
+
+/** The loop string_find_line_end() used before the kernels were added. */
+const char *bytewise_find_line_end(const char *line, const char *end_of_data)
+{
+   while (line < end_of_data && *line != '\n')
+      ++line;
+
+   return line < end_of_data ? line : NULL;
+}
+
+double elapsed_seconds(const struct timespec *start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Fill buffer with lines of 0 to 150 characters, like a
+ * job file with headers, short body lines and long base64 lines.
+ */
+void fill_bench_buffer(char *buffer, int len)
+{
+   char *ptr = buffer;
+   char *end = buffer + len;
+   int line_len;
+
+   srand(1);
+   while (ptr < end)
+   {
+      line_len = rand() % 150;
+      while (line_len-- > 0 && ptr < end)
+         *ptr++ = 'A' + (rand() % 26);
+      if (ptr < end)
+         *ptr++ = '\n';
+   }
+}
+
+void report(const char *label, const struct timespec *start, long lines)
+{
+   double secs = elapsed_seconds(start);
+   printf("%-10s %8ld lines/pass  %8.1f MB/s\n",
+          label,
+          lines,
+          (double)BENCH_SIZE * BENCH_PASSES / secs / (1024 * 1024));
+}
+
+int verify_kernels(const char *buffer, const char *end)
+{
+   const char *found[64];
+   const char *line = buffer;
+   const char *expected;
+   int i, count;
+
+   while (line < end)
+   {
+      count = scan_newlines(line, end, found, 64);
+      for (i = 0; i < count; ++i)
+      {
+         expected = bytewise_find_line_end(line, end);
+         if (expected != found[i] || scan_find_newline(line, end) != expected)
+            return 0;
+         line = expected + 1;
+      }
+
+      if (count < 64)
+         return bytewise_find_line_end(line, end) == NULL;
+   }
+
+   return 1;
+}
+
+int main(int argc, const char **argv)
+{
+   const char *found[64];
+   const char *line, *nl, *end;
+   struct timespec start;
+   long lines = 0;
+   int pass, count;
+
+   char *buffer = (char*)malloc(BENCH_SIZE);
+   if (!buffer)
+      return 1;
+
+   fill_bench_buffer(buffer, BENCH_SIZE);
+   end = buffer + BENCH_SIZE;
+
+   printf("Selected kernel: [32;1m%s[m\n", scan_kernel_name());
+   printf("Kernels %s the byte loop.\n",
+          verify_kernels(buffer, end) ? "agree with" : "[31;1mDISAGREE[m with");
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (pass = 0; pass < BENCH_PASSES; ++pass)
+      for (lines = 0, line = buffer; (nl = bytewise_find_line_end(line, end)); line = nl + 1)
+         ++lines;
+   report("bytewise", &start, lines);
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (pass = 0; pass < BENCH_PASSES; ++pass)
+      for (lines = 0, line = buffer; (nl = scan_find_newline(line, end)); line = nl + 1)
+         ++lines;
+   report("find", &start, lines);
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (pass = 0; pass < BENCH_PASSES; ++pass)
+   {
+      lines = 0;
+      line = buffer;
+      do
+      {
+         count = scan_newlines(line, end, found, 64);
+         lines += count;
+         if (count)
+            line = found[count-1] + 1;
+      }
+      while (count == 64);
+   }
+   report("batched", &start, lines);
+
+   free(buffer);
+   return 0;
+}
+
+#endif
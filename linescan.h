@@ -0,0 +1,32 @@
+#ifndef LINESCAN_H
+#define LINESCAN_H
+
+/**
+ * Line-boundary scanning kernels used by the LineDrop implementations.
+ *
+ * The kernels look for '\n' characters.  A '\r' preceding a '\n' is
+ * left for the caller to trim, as string_find_line_end() does.
+ *
+ * The first call to either function selects the fastest kernel the
+ * CPU supports (AVX2, SSE2, or a plain byte loop).
+ */
+
+/**
+ * @brief Return a pointer to the first '\n' in [start, end), or NULL if none.
+ */
+const char *scan_find_newline(const char *start, const char *end);
+
+/**
+ * @brief Save pointers to up to *max_found* '\n' characters in [start, end).
+ *
+ * @return The number of pointers saved to *found*.  A return value less
+ *         than *max_found* means no other '\n' remains in the range.
+ */
+int scan_newlines(const char *start, const char *end, const char **found, int max_found);
+
+/**
+ * @brief Name of the selected kernel ("avx2", "sse2" or "scalar"), for logging.
+ */
+const char *scan_kernel_name(void);
+
+#endif
@@ -1,12 +1,23 @@
 #ifndef MAILTK_H
 #define MAILTK_H
 
+#include "arena.h"
 #include "linedrop.h"
+#include "jobindex.h"
 #include "logging.h"
+#include "prefetch.h"
+#include "decompress.h"
 #include "smtp_caps.h"
 #include "smtp_iact.h"
+#include "smtp_data.h"
+#include "smtp_reply.h"
+#include "smtp_pool.h"
 #include "socktalk.h"
+#include "evloop.h"
+#include "uring.h"
+#include "trace.h"
 #include "socket.h"
+#include "resolve.h"
 
 
 
@@ -0,0 +1,213 @@
+// -*- compile-command: "base=prefetch; gcc -Wall -Werror -ggdb -DPREFETCH_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c linedrop.c linescan.c -lpthread" -*-
+
+#include <stdlib.h>    // for malloc()
+#include <string.h>    // for memcpy()
+#include <errno.h>
+#include "prefetch.h"
+
+static void prefetch_wait(sem_t *sem)
+{
+   while (sem_wait(sem) && errno == EINTR)
+      ;
+}
+
+static void *prefetch_thread(void *data)
+{
+   PrefetchSource *pfs = (PrefetchSource*)data;
+   int bytes_read;
+
+   for (;;)
+   {
+      prefetch_wait(&pfs->empty_slots);
+      if (__atomic_load_n(&pfs->stopping, __ATOMIC_ACQUIRE))
+         break;
+
+      bytes_read = (*pfs->read)(pfs->source, pfs->buffers[pfs->fill_index], pfs->buffer_size);
+      pfs->lengths[pfs->fill_index] = bytes_read;
+
+      sem_post(&pfs->full_slots);
+
+      if (bytes_read <= 0)
+         break;
+
+      pfs->fill_index ^= 1;
+   }
+
+   return NULL;
+}
+
+/**
+ * Allocate the buffers and start the helper thread reading *source*.
+ *
+ * @return 1 for success, 0 on failure.
+ */
+int prefetch_start(PrefetchSource *pfs, void *source, ring_source_read reader, size_t buffer_size)
+{
+   memset(pfs, 0, sizeof(PrefetchSource));
+   pfs->source = source;
+   pfs->read = reader;
+   pfs->buffer_size = buffer_size ? buffer_size : PREFETCH_DEFAULT_BUFFER;
+
+   pfs->buffers[0] = (char*)malloc(pfs->buffer_size);
+   pfs->buffers[1] = (char*)malloc(pfs->buffer_size);
+
+   if (pfs->buffers[0] && pfs->buffers[1])
+   {
+      sem_init(&pfs->empty_slots, 0, 2);
+      sem_init(&pfs->full_slots, 0, 0);
+
+      if (pthread_create(&pfs->thread, NULL, prefetch_thread, pfs) == 0)
+         return 1;
+
+      sem_destroy(&pfs->empty_slots);
+      sem_destroy(&pfs->full_slots);
+   }
+
+   free(pfs->buffers[0]);
+   free(pfs->buffers[1]);
+   memset(pfs, 0, sizeof(PrefetchSource));
+   return 0;
+}
+
+/**
+ * Stop the helper thread and free the buffers.  If the thread is in
+ * the middle of a read from the wrapped source, this function waits
+ * for the read to finish.
+ */
+void prefetch_stop(PrefetchSource *pfs)
+{
+   if (!pfs->buffers[0])
+      return;
+
+   __atomic_store_n(&pfs->stopping, 1, __ATOMIC_RELEASE);
+
+   // Wake the thread if it is waiting for an empty buffer:
+   sem_post(&pfs->empty_slots);
+   pthread_join(pfs->thread, NULL);
+
+   sem_destroy(&pfs->empty_slots);
+   sem_destroy(&pfs->full_slots);
+
+   free(pfs->buffers[0]);
+   free(pfs->buffers[1]);
+   pfs->buffers[0] = pfs->buffers[1] = NULL;
+}
+
+int prefetch_source_read(void *source, char *buffer, int buff_len)
+{
+   PrefetchSource *pfs = (PrefetchSource*)source;
+   int available, length;
+
+   if (pfs->done)
+      return 0;
+
+   if (!pfs->draining)
+   {
+      prefetch_wait(&pfs->full_slots);
+      pfs->draining = 1;
+      pfs->drain_pos = 0;
+   }
+
+   length = pfs->lengths[pfs->drain_index];
+   if (length <= 0)
+   {
+      pfs->done = 1;
+      return length;
+   }
+
+   available = length - pfs->drain_pos;
+   if (buff_len > available)
+      buff_len = available;
+
+   memcpy(buffer, pfs->buffers[pfs->drain_index] + pfs->drain_pos, buff_len);
+   pfs->drain_pos += buff_len;
+
+   // Hand a drained buffer back to the helper thread:
+   if (pfs->drain_pos == length)
+   {
+      pfs->draining = 0;
+      pfs->drain_index ^= 1;
+      sem_post(&pfs->empty_slots);
+   }
+
+   return buff_len;
+}
+
+int ring_init_prefetch_dropper(RingLineDropper *rld,
+                               PrefetchSource *pfs,
+                               void *source,
+                               ring_source_read reader,
+                               size_t capacity)
+{
+   if (!prefetch_start(pfs, source, reader, capacity))
+      return 0;
+
+   if (ring_init_dropper(rld, pfs, prefetch_source_read, capacity))
+      return 1;
+
+   prefetch_stop(pfs);
+   return 0;
+}
+
+
+/************************************
+ * Conditionally-compiled test code.
+ ***********************************/
+
+#ifdef PREFETCH_MAIN
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+int main(int argc, const char **argv)
+{
+   const char *path = argc > 1 ? argv[1] : "prefetch.c";
+
+   RingLineDropper rld;
+   FdSource        fds;
+   PrefetchSource  pfs;
+   LineDrop        ld;
+
+   const char *line;
+   int        line_len;
+   long       lines = 0, bytes = 0;
+
+   int fd = open(path, O_RDONLY);
+   if (fd < 0)
+   {
+      printf("There was an error attempting to open [33;1m%s[m.\n", path);
+      return 1;
+   }
+
+   // fds is only used to open the fd for reading, the
+   // prefetcher then calls fd_source_read() from its thread.
+   memset(&fds, 0, sizeof(fds));
+   fds.fd = fd;
+
+   if (ring_init_prefetch_dropper(&rld, &pfs, &fds, fd_source_read, RING_DEFAULT_CAPACITY))
+   {
+      init_ring_line_drop(&ld, &rld);
+      ld.break_check = NULL;
+
+      do
+      {
+         if (DropGetLine(&ld, &line, &line_len))
+         {
+            ++lines;
+            bytes += line_len;
+         }
+      }
+      while (DropAdvance(&ld));
+
+      ring_release_dropper(&rld);
+      prefetch_stop(&pfs);
+
+      printf("Read [32;1m%ld[m lines with [32;1m%ld[m characters from %s.\n", lines, bytes, path);
+   }
+
+   close(fd);
+   return 0;
+}
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include "linedrop.h"
+
+/**
+ * A RingLineDropper source that reads ahead on a helper thread.
+ *
+ * The helper thread fills one buffer from the wrapped source while the
+ * dropper drains the other, so slow storage is read while the caller
+ * is busy with the lines it already has.  Buffers change hands through
+ * a pair of semaphores, with no mutex: the helper thread only touches
+ * a buffer between taking an empty slot and posting a full one, and
+ * the dropper only between taking a full slot and posting an empty one.
+ */
+typedef struct _prefetch_source
+{
+   void             *source;
+   ring_source_read read;
+
+   pthread_t thread;
+   sem_t     empty_slots;
+   sem_t     full_slots;
+   int       stopping;
+
+   char   *buffers[2];
+   int    lengths[2];      // bytes read into each buffer, or source result if <= 0
+   size_t buffer_size;
+
+   int fill_index;         // used only by the helper thread
+   int drain_index;        // used only by the dropper
+   int drain_pos;
+   int draining;
+   int done;
+} PrefetchSource;
+
+// Default size of each of the two buffers
+#define PREFETCH_DEFAULT_BUFFER (256 * 1024)
+
+int prefetch_start(PrefetchSource *pfs, void *source, ring_source_read reader, size_t buffer_size);
+void prefetch_stop(PrefetchSource *pfs);
+
+int prefetch_source_read(void *pfs, char *buffer, int buff_len);
+
+/**
+ * @brief Start prefetching from *source* and prepare *rld* to read from it.
+ *
+ * Call ring_release_dropper(), then prefetch_stop() when done.
+ */
+int ring_init_prefetch_dropper(RingLineDropper *rld,
+                               PrefetchSource *pfs,
+                               void *source,
+                               ring_source_read reader,
+                               size_t capacity);
+
+#endif
@@ -0,0 +1,594 @@
+// -*- compile-command: "base=resolve; gcc -Wall -Werror -ggdb -DRESOLVE_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c -lpthread" -*-
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>     // for strcasecmp()
+#include <time.h>
+
+#include "resolve.h"
+
+static unsigned long long resolve_now_ms(void)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+static int system_lookup(void *data,
+                         const char *host,
+                         const char *service,
+                         const struct addrinfo *hints,
+                         struct addrinfo **result)
+{
+   return getaddrinfo(host, service, hints, result);
+}
+
+/** FNV-1a over the lower-cased host name, then the port. */
+static unsigned bucket_of(const char *host, int port)
+{
+   unsigned hash = 2166136261u;
+   const char *ptr;
+
+   for (ptr = host; *ptr; ++ptr)
+      hash = (hash ^ (unsigned char)(*ptr | 0x20)) * 16777619u;
+
+   hash = (hash ^ (unsigned)port) * 16777619u;
+
+   return hash % RESOLVER_BUCKETS;
+}
+
+/** Must hold res->lock.  @return The entry, or NULL if out of memory. */
+static ResolveEntry *find_entry(Resolver *res, const char *host, int port)
+{
+   unsigned bucket = bucket_of(host, port);
+   ResolveEntry *entry;
+
+   for (entry = res->buckets[bucket]; entry; entry = entry->next)
+      if (entry->port == port && strcasecmp(entry->host, host) == 0)
+         return entry;
+
+   if ((entry = (ResolveEntry*)calloc(1, sizeof(ResolveEntry))))
+   {
+      if (!(entry->host = strdup(host)))
+      {
+         free(entry);
+         return NULL;
+      }
+
+      entry->port = port;
+      entry->next = res->buckets[bucket];
+      res->buckets[bucket] = entry;
+   }
+
+   return entry;
+}
+
+static int entry_is_fresh(const ResolveEntry *entry, unsigned long long now)
+{
+   return entry->expires_ms && now < entry->expires_ms;
+}
+
+/** Must hold res->lock. */
+static void drop_result(ResolveResult *result)
+{
+   if (result && --result->refs == 0)
+   {
+      freeaddrinfo(result->ai);
+      free(result);
+   }
+}
+
+/**
+ * @brief Look up *entry*, which the caller has marked as resolving,
+ *        releasing res->lock during the lookup.
+ *
+ * Must hold res->lock, which is held again on return.
+ */
+static void resolve_entry(Resolver *res, ResolveEntry *entry)
+{
+   struct addrinfo hints;
+   struct addrinfo *ai_chain = NULL;
+   ResolveResult *result = NULL;
+   char service[12];
+   int error;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_protocol = IPPROTO_TCP;
+
+   snprintf(service, sizeof(service), "%d", entry->port);
+
+   ++res->lookups;
+
+   // The entry's host and port never change, so they can be read unlocked.
+   pthread_mutex_unlock(&res->lock);
+
+   if ((error = (*res->lookup)(res->lookup_data, entry->host, service, &hints, &ai_chain)) == 0)
+   {
+      if ((result = (ResolveResult*)malloc(sizeof(ResolveResult))))
+      {
+         result->ai = ai_chain;
+         result->refs = 1;
+      }
+      else
+      {
+         freeaddrinfo(ai_chain);
+         error = EAI_MEMORY;
+      }
+   }
+
+   pthread_mutex_lock(&res->lock);
+
+   drop_result(entry->result);
+   entry->result = result;
+   entry->error = error;
+
+   // Don't remember running out of memory.
+   if (error == EAI_MEMORY || error == EAI_SYSTEM)
+      entry->expires_ms = 0;
+   else
+      entry->expires_ms = resolve_now_ms() + (error ? res->negative_ttl_ms : res->ttl_ms);
+
+   entry->resolving = 0;
+   pthread_cond_broadcast(&res->done);
+}
+
+static void *resolver_thread(void *data)
+{
+   Resolver *res = (Resolver*)data;
+   ResolveEntry *entry;
+
+   pthread_mutex_lock(&res->lock);
+
+   while (!res->stopping)
+   {
+      if ((entry = res->queue_head))
+      {
+         if (!(res->queue_head = entry->next_queued))
+            res->queue_tail = NULL;
+         entry->next_queued = NULL;
+
+         resolve_entry(res, entry);
+      }
+      else
+         pthread_cond_wait(&res->work, &res->lock);
+   }
+
+   pthread_mutex_unlock(&res->lock);
+
+   return NULL;
+}
+
+int resolver_init(Resolver *res, int threads, int ttl_ms, int negative_ttl_ms)
+{
+   memset(res, 0, sizeof(Resolver));
+
+   pthread_mutex_init(&res->lock, NULL);
+   pthread_cond_init(&res->work, NULL);
+   pthread_cond_init(&res->done, NULL);
+
+   res->ttl_ms = ttl_ms;
+   res->negative_ttl_ms = negative_ttl_ms;
+   res->lookup = system_lookup;
+
+   if (threads > RESOLVER_MAX_THREADS)
+      threads = RESOLVER_MAX_THREADS;
+
+   for (res->thread_count = 0; res->thread_count < threads; ++res->thread_count)
+   {
+      if (pthread_create(&res->threads[res->thread_count], NULL, resolver_thread, res))
+      {
+         resolver_close(res);
+         return 0;
+      }
+   }
+
+   return 1;
+}
+
+void resolver_close(Resolver *res)
+{
+   ResolveEntry *entry, *next;
+   int index;
+
+   pthread_mutex_lock(&res->lock);
+   res->stopping = 1;
+   pthread_cond_broadcast(&res->work);
+   pthread_mutex_unlock(&res->lock);
+
+   for (index = 0; index < res->thread_count; ++index)
+      pthread_join(res->threads[index], NULL);
+   res->thread_count = 0;
+
+   for (index = 0; index < RESOLVER_BUCKETS; ++index)
+   {
+      for (entry = res->buckets[index]; entry; entry = next)
+      {
+         next = entry->next;
+         drop_result(entry->result);
+         free(entry->host);
+         free(entry);
+      }
+      res->buckets[index] = NULL;
+   }
+
+   res->queue_head = res->queue_tail = NULL;
+
+   pthread_cond_destroy(&res->done);
+   pthread_cond_destroy(&res->work);
+   pthread_mutex_destroy(&res->lock);
+}
+
+void resolver_set_lookup(Resolver *res, resolve_func lookup, void *data)
+{
+   res->lookup = lookup ? lookup : system_lookup;
+   res->lookup_data = data;
+}
+
+int resolver_lookup(Resolver *res, const char *host, int port, ResolveResult **result)
+{
+   ResolveEntry *entry;
+   int error;
+
+   *result = NULL;
+
+   pthread_mutex_lock(&res->lock);
+
+   if (!(entry = find_entry(res, host, port)))
+   {
+      pthread_mutex_unlock(&res->lock);
+      return EAI_MEMORY;
+   }
+
+   if (entry->resolving)
+   {
+      ++res->waits;
+      while (entry->resolving)
+         pthread_cond_wait(&res->done, &res->lock);
+   }
+   else if (entry_is_fresh(entry, resolve_now_ms()))
+   {
+      if (entry->error)
+         ++res->negative_hits;
+      else
+         ++res->hits;
+   }
+   else
+   {
+      entry->resolving = 1;
+      resolve_entry(res, entry);
+   }
+
+   if ((error = entry->error) == 0)
+   {
+      *result = entry->result;
+      ++entry->result->refs;
+   }
+
+   pthread_mutex_unlock(&res->lock);
+
+   return error;
+}
+
+void resolver_release(Resolver *res, ResolveResult *result)
+{
+   if (result)
+   {
+      pthread_mutex_lock(&res->lock);
+      drop_result(result);
+      pthread_mutex_unlock(&res->lock);
+   }
+}
+
+int resolver_prefetch(Resolver *res, const char **hosts, const int *ports, int count)
+{
+   ResolveEntry *entry;
+   unsigned long long now = resolve_now_ms();
+   int queued = 0;
+   int index;
+
+   pthread_mutex_lock(&res->lock);
+
+   for (index = 0; index < count; ++index)
+   {
+      if (!(entry = find_entry(res, hosts[index], ports[index]))
+          || entry->resolving
+          || entry_is_fresh(entry, now))
+         continue;
+
+      entry->resolving = 1;
+      ++queued;
+
+      if (res->thread_count == 0)
+         resolve_entry(res, entry);
+      else
+      {
+         if (res->queue_tail)
+            res->queue_tail->next_queued = entry;
+         else
+            res->queue_head = entry;
+         res->queue_tail = entry;
+      }
+   }
+
+   if (queued && res->thread_count)
+      pthread_cond_broadcast(&res->work);
+
+   pthread_mutex_unlock(&res->lock);
+
+   return queued;
+}
+
+void resolver_dump(const Resolver *res, FILE *target)
+{
+   if (!target)
+      target = stderr;
+
+   fprintf(target,
+           "resolver: %lu lookups, %lu hits, %lu negative hits, %lu waits\n",
+           res->lookups,
+           res->hits,
+           res->negative_hits,
+           res->waits);
+}
+
+
+/************************************
+ * Conditionally-compiled test code.
+ ***********************************/
+
+#ifdef RESOLVE_MAIN
+
+#include <unistd.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+// Each stand-in lookup takes this long, like a query to a nearby DNS server.
+#define LOOKUP_DELAY_MS 20
+
+/**
+ * A stand-in for DNS: the hosts file of the test, read on every
+ * lookup, with a delay.
+ */
+typedef struct _hosts_file
+{
+   const char      *path;
+   pthread_mutex_t lock;
+   int             lookups;
+} HostsFile;
+
+static int hosts_file_lookup(void *data,
+                             const char *host,
+                             const char *service,
+                             const struct addrinfo *hints,
+                             struct addrinfo **result)
+{
+   HostsFile *hosts = (HostsFile*)data;
+   struct addrinfo numeric_hints = *hints;
+   char line[256];
+   char *address, *name, *saveptr;
+   int error = EAI_NONAME;
+   FILE *file;
+
+   pthread_mutex_lock(&hosts->lock);
+   ++hosts->lookups;
+   pthread_mutex_unlock(&hosts->lock);
+
+   usleep(LOOKUP_DELAY_MS * 1000);
+
+   if (!(file = fopen(hosts->path, "r")))
+      return EAI_SYSTEM;
+
+   numeric_hints.ai_flags |= AI_NUMERICHOST;
+
+   while (error == EAI_NONAME && fgets(line, sizeof(line), file))
+   {
+      if (line[0] == '#' || !(address = strtok_r(line, " \t\n", &saveptr)))
+         continue;
+
+      while ((name = strtok_r(NULL, " \t\n", &saveptr)))
+      {
+         if (strcasecmp(name, host) == 0)
+         {
+            error = getaddrinfo(address, service, &numeric_hints, result);
+            break;
+         }
+      }
+   }
+
+   fclose(file);
+
+   return error;
+}
+
+static const char *first_address(const ResolveResult *result, char *buffer, socklen_t len)
+{
+   const struct sockaddr *addr = result->ai->ai_addr;
+
+   if (addr->sa_family == AF_INET6)
+      return inet_ntop(AF_INET6, &((const struct sockaddr_in6*)addr)->sin6_addr, buffer, len);
+   else
+      return inet_ntop(AF_INET, &((const struct sockaddr_in*)addr)->sin_addr, buffer, len);
+}
+
+static int first_port(const ResolveResult *result)
+{
+   const struct sockaddr *addr = result->ai->ai_addr;
+
+   if (addr->sa_family == AF_INET6)
+      return ntohs(((const struct sockaddr_in6*)addr)->sin6_port);
+   else
+      return ntohs(((const struct sockaddr_in*)addr)->sin_port);
+}
+
+static unsigned long long elapsed_ms(unsigned long long start)
+{
+   return resolve_now_ms() - start;
+}
+
+static void test_cache(HostsFile *hosts)
+{
+   Resolver res;
+   ResolveResult *result, *second;
+   char buffer[INET6_ADDRSTRLEN];
+   unsigned long long start;
+   int error;
+
+   printf("\n[32;1mCaching lookups.[m\n");
+
+   assert(resolver_init(&res, 0, 100, 50));
+   resolver_set_lookup(&res, hosts_file_lookup, hosts);
+   hosts->lookups = 0;
+
+   start = resolve_now_ms();
+   error = resolver_lookup(&res, "relay1.test", 25, &result);
+   printf("relay1.test:25 is %s, port %d, in %llu ms.\n",
+          error ? gai_strerror(error) : first_address(result, buffer, sizeof(buffer)),
+          result ? first_port(result) : 0,
+          elapsed_ms(start));
+   assert(error == 0 && strcmp(buffer, "127.0.0.1") == 0 && first_port(result) == 25);
+
+   start = resolve_now_ms();
+   error = resolver_lookup(&res, "RELAY1.test", 25, &second);
+   printf("Again, differently capitalized, in %llu ms.\n", elapsed_ms(start));
+   assert(error == 0 && second == result && hosts->lookups == 1);
+   resolver_release(&res, second);
+
+   // Another port is another entry.
+   error = resolver_lookup(&res, "relay1.test", 587, &second);
+   assert(error == 0 && second != result && first_port(second) == 587 && hosts->lookups == 2);
+   resolver_release(&res, second);
+
+   // An alias, and an IPv6 address
+   error = resolver_lookup(&res, "relay2-alias.test", 25, &second);
+   assert(error == 0 && strcmp(first_address(second, buffer, sizeof(buffer)), "127.0.0.2") == 0);
+   resolver_release(&res, second);
+
+   error = resolver_lookup(&res, "relay6.test", 25, &second);
+   assert(error == 0 && strcmp(first_address(second, buffer, sizeof(buffer)), "::1") == 0);
+   resolver_release(&res, second);
+
+   // Negative caching
+   hosts->lookups = 0;
+   error = resolver_lookup(&res, "nowhere.test", 25, &second);
+   printf("nowhere.test: %s.\n", gai_strerror(error));
+   assert(error == EAI_NONAME && second == NULL);
+   assert(resolver_lookup(&res, "nowhere.test", 25, &second) == EAI_NONAME);
+   assert(hosts->lookups == 1 && res.negative_hits == 1);
+
+   usleep(60 * 1000);
+   assert(resolver_lookup(&res, "nowhere.test", 25, &second) == EAI_NONAME);
+   printf("After its negative TTL, nowhere.test was looked up again.\n");
+   assert(hosts->lookups == 2);
+
+   // The first result outlives its refresh after the TTL.
+   usleep(50 * 1000);
+   error = resolver_lookup(&res, "relay1.test", 25, &second);
+   printf("After its TTL, relay1.test was looked up again.\n");
+   assert(error == 0 && second != result && hosts->lookups == 3);
+   assert(strcmp(first_address(result, buffer, sizeof(buffer)), "127.0.0.1") == 0);
+   resolver_release(&res, second);
+   resolver_release(&res, result);
+
+   resolver_dump(&res, stdout);
+   resolver_close(&res);
+}
+
+static void test_prefetch(HostsFile *hosts)
+{
+   const char *job_hosts[] = { "relay1.test", "relay2.test", "relay3.test", "relay4.test",
+                               "relay5.test", "relay6.test", "relay7.test", "relay8.test",
+                               "relay1.test", "nowhere.test" };
+   int job_ports[] = { 25, 25, 25, 25, 25, 25, 25, 25, 25, 25 };
+   int count = sizeof(job_ports) / sizeof(job_ports[0]);
+
+   Resolver res;
+   ResolveResult *result;
+   unsigned long long start;
+   unsigned long long serial_ms, prefetch_ms;
+   int index, queued, error;
+
+   printf("\n[32;1mPrefetching the destinations of a job.[m\n");
+
+   // One lookup at a time, as open_socket_talker() would do them:
+   assert(resolver_init(&res, 0, RESOLVER_TTL_MS, RESOLVER_NEGATIVE_MS));
+   resolver_set_lookup(&res, hosts_file_lookup, hosts);
+
+   start = resolve_now_ms();
+   for (index = 0; index < count; ++index)
+   {
+      resolver_lookup(&res, job_hosts[index], job_ports[index], &result);
+      resolver_release(&res, result);
+   }
+   serial_ms = elapsed_ms(start);
+   resolver_close(&res);
+
+   // Warmed by four resolver threads first:
+   assert(resolver_init(&res, 4, RESOLVER_TTL_MS, RESOLVER_NEGATIVE_MS));
+   resolver_set_lookup(&res, hosts_file_lookup, hosts);
+   hosts->lookups = 0;
+
+   start = resolve_now_ms();
+   queued = resolver_prefetch(&res, job_hosts, job_ports, count);
+   for (index = 0; index < count; ++index)
+   {
+      error = resolver_lookup(&res, job_hosts[index], job_ports[index], &result);
+      assert(error == (strcmp(job_hosts[index], "nowhere.test") ? 0 : EAI_NONAME));
+      resolver_release(&res, result);
+   }
+   prefetch_ms = elapsed_ms(start);
+
+   printf("%d lookups queued for %d destinations.\n", queued, count);
+   printf("Serial lookups: %llu ms; with prefetch: %llu ms.\n", serial_ms, prefetch_ms);
+   resolver_dump(&res, stdout);
+
+   assert(queued == 9 && hosts->lookups == 9 && res.lookups == 9);
+   assert(prefetch_ms < serial_ms / 2);
+
+   // Warm entries are not queued again.
+   assert(resolver_prefetch(&res, job_hosts, job_ports, count) == 0);
+
+   resolver_close(&res);
+}
+
+int main(int argc, const char **argv)
+{
+   char path[] = "/tmp/resolve_hosts_XXXXXX";
+   HostsFile hosts;
+   FILE *file;
+   int fd;
+
+   if ((fd = mkstemp(path)) < 0 || !(file = fdopen(fd, "w")))
+   {
+      perror("mkstemp");
+      return 1;
+   }
+
+   fputs("# A stand-in for DNS\n"
+         "127.0.0.1   relay1.test\n"
+         "127.0.0.2   relay2.test relay2-alias.test\n"
+         "127.0.0.3   relay3.test\n"
+         "127.0.0.4   relay4.test\n"
+         "127.0.0.5   relay5.test\n"
+         "::1         relay6.test\n"
+         "127.0.0.7   relay7.test\n"
+         "127.0.0.8   relay8.test\n",
+         file);
+   fclose(file);
+
+   hosts.path = path;
+   hosts.lookups = 0;
+   pthread_mutex_init(&hosts.lock, NULL);
+
+   test_cache(&hosts);
+   test_prefetch(&hosts);
+
+   pthread_mutex_destroy(&hosts.lock);
+   unlink(path);
+
+   return 0;
+}
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+#include <stdio.h>         // for FILE
+#include <pthread.h>
+#include <netdb.h>
+
+/**
+ * A cache of host lookups, so the same few relay hosts are not looked
+ * up again for every connection.
+ *
+ * Entries are keyed by host and port, and last ttl_ms.  A failed
+ * lookup is remembered too, for negative_ttl_ms, so a bad destination
+ * does not cost a lookup for each of its messages.  getaddrinfo()
+ * reports no TTL, so the TTLs are the resolver's own.
+ *
+ * Lookups can run on resolver threads: resolver_prefetch() queues the
+ * destinations of a job, to be resolved in parallel while the job
+ * starts, and resolver_lookup() waits for a queued lookup rather than
+ * repeating it.
+ */
+
+#define RESOLVER_BUCKETS      256
+#define RESOLVER_MAX_THREADS  16
+#define RESOLVER_TTL_MS       (5 * 60 * 1000)
+#define RESOLVER_NEGATIVE_MS  (30 * 1000)
+
+/**
+ * @brief Look up *host* for *service*, like getaddrinfo(), which is
+ *        the default.  The result is freed with freeaddrinfo().
+ */
+typedef int (*resolve_func)(void *data,
+                            const char *host,
+                            const char *service,
+                            const struct addrinfo *hints,
+                            struct addrinfo **result);
+
+/**
+ * @brief The addresses of one lookup, shared by the cache and the
+ *        callers using them.
+ */
+typedef struct _resolve_result
+{
+   struct addrinfo *ai;
+   int             refs;
+} ResolveResult;
+
+typedef struct _resolve_entry
+{
+   char                  *host;
+   int                   port;
+   ResolveResult         *result;       // NULL until a lookup succeeds
+   int                   error;         // getaddrinfo() error of the last lookup, or 0
+   unsigned long long    expires_ms;    // 0 until the first lookup finishes
+   int                   resolving;     // queued for, or being looked up by, some thread
+   struct _resolve_entry *next;         // in the same bucket
+   struct _resolve_entry *next_queued;
+} ResolveEntry;
+
+typedef struct _resolver
+{
+   pthread_mutex_t lock;
+   pthread_cond_t  work;                // a lookup was queued, or the threads should stop
+   pthread_cond_t  done;                // a lookup finished
+
+   ResolveEntry    *buckets[RESOLVER_BUCKETS];
+   ResolveEntry    *queue_head;
+   ResolveEntry    *queue_tail;
+
+   pthread_t       threads[RESOLVER_MAX_THREADS];
+   int             thread_count;
+   int             stopping;
+
+   int             ttl_ms;
+   int             negative_ttl_ms;
+   resolve_func    lookup;
+   void            *lookup_data;
+
+   unsigned long   hits;
+   unsigned long   negative_hits;
+   unsigned long   lookups;             // calls to the lookup function
+   unsigned long   waits;               // lookups that waited for another thread's
+} Resolver;
+
+/**
+ * @brief Prepare an empty cache, and start *threads* resolver threads
+ *        (up to RESOLVER_MAX_THREADS) for resolver_prefetch().
+ *
+ * With no threads, resolver_prefetch() looks up each host in turn.
+ *
+ * @return 1 for success, 0 if a thread could not be started.
+ */
+int resolver_init(Resolver *res, int threads, int ttl_ms, int negative_ttl_ms);
+
+/**
+ * @brief Stop the threads and free the cache.  Results still held by
+ *        callers must be released first.
+ */
+void resolver_close(Resolver *res);
+
+/** Replace getaddrinfo() with *lookup*, as for a test.  Call before using *res*. */
+void resolver_set_lookup(Resolver *res, resolve_func lookup, void *data);
+
+/**
+ * @brief Find the TCP addresses of *host*, from the cache if it has a
+ *        fresh entry, waiting for a queued lookup, or looking the host
+ *        up on this thread.
+ *
+ * @return 0 with *result* set, to be passed to resolver_release(), or
+ *         the getaddrinfo() error (EAI_NONAME, for example) with
+ *         *result* set to NULL.
+ */
+int resolver_lookup(Resolver *res, const char *host, int port, ResolveResult **result);
+
+void resolver_release(Resolver *res, ResolveResult *result);
+
+/**
+ * @brief Queue lookups of the *count* destinations that have no fresh
+ *        entry, and return without waiting for them.
+ *
+ * @return The number of lookups queued.
+ */
+int resolver_prefetch(Resolver *res, const char **hosts, const int *ports, int count);
+
+/** Print the cache's counts to *target* (stderr if NULL). */
+void resolver_dump(const Resolver *res, FILE *target);
+
+#endif
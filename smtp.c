@@ -1,91 +1,44 @@
-// -*- compile-command: "base=smtp; gcc -Wall -Werror -ggdb -DSMTP_MAIN -DDEBUG -o $base ${base}.c -lssl -lcrypto -lcode64" -*-
+// -*- compile-command: "base=smtp; gcc -Wall -Werror -ggdb -DSMTP_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c -lssl -lcrypto -lcode64" -*-
 
 #include <string.h>
-#include <ctype.h>  // for isspace()
 #include <code64.h>
 
 #include "smtp.h"
 #include "smtp_caps.h"
+#include "smtp_reply.h"
 
+/**
+ * Read the possibly multi-line reply to EHLO into *buffer*.
+ * Returns the length of the reply, or 0 if it is not a success reply.
+ */
 int read_complete_ehlo_response(STalker *talker, char *buffer, int buff_len)
 {
-   char *ptr = buffer;
-   char *end_of_buffer = buffer + buff_len;
-   char *end_of_data;
-   size_t read;
-
-   int line_status;
-
-   char *cur_line = buffer;
-   char *end_cur_line;
-
-   while (ptr < end_of_buffer)
-   {
-      read = stk_recv_line(talker, ptr, end_of_buffer - ptr);
-      end_of_data = ptr + read;
+   SMTPReply reply;
 
-      // Read complete lines, detect line with space between
-      // the status number and the message: that's the last line.
+   if (smtp_recv_reply(talker, &reply, buffer, buff_len) == 250)
+      return reply.reply_len;
 
-      while (cur_line < end_of_data)
-      {
-         end_cur_line = cur_line;
-         while (end_cur_line < end_of_data && *end_cur_line != '\r')
-            ++end_cur_line;
-
-         // If we have a complete line, judge if it's the last
-         if (end_cur_line < end_of_data)
-         {
-            // If good line, set cur_line to beginning of next line
-            line_status = atoi(cur_line);
-            if (line_status >= 400)
-            {
-               fprintf(stderr,
-                       "Request failure detected with line_status == %d (%s)\n",
-                       line_status,
-                       cur_line);
-
-               goto found_end_of_data;
-            }
-
-            if (line_status == 250 && cur_line[3] == ' ')
-               goto found_end_of_data;
-            else
-            {
-               cur_line = end_cur_line;
-               while (cur_line < end_of_data && isspace(*cur_line))
-                   ++cur_line;
-            }
-         }
-         else  // If not a complete line, break while() to retrieve another batch of bytes
-            break;
-      }
-
-      ptr += read;
-   }
-
-  found_end_of_data:
-   return end_of_data - buffer;
+   smtp_log_reply_error(&reply, "EHLO");
+   return 0;
 }
 
 int start_tls(STalker *open_talker, void *data, talker_user callback)
 {
    char buffer[1024];
-   int bytes_read;
-   stk_send_line(open_talker, "STARTTLS", NULL);
+   SMTPReply reply;
 
-   /* bytes_read = read_complete_ehlo_response(talker, buffer, sizeof(buffer)); */
-   bytes_read = stk_recv_line(open_talker, buffer, sizeof(buffer));
-   if (bytes_read > 3)
+   if (smtp_command(open_talker, &reply, buffer, sizeof(buffer), "STARTTLS", NULL)
+       && smtp_reply_positive(&reply))
    {
       open_ssl_talker(open_talker, data, callback);
       return 1;
    }
 
+   smtp_log_reply_error(&reply, "STARTTLS");
    return 0;
 }
 
-int greet_smtp_server(const char *host_url, STalker *talker, SMTPCaps *scaps)
+int ehlo_smtp_server(const char *host_url, STalker *talker, SMTPCaps *scaps)
 {
    char buffer[1024];
    
@@ -103,38 +56,41 @@ int greet_smtp_server(const char *host_url, STalker *talker, SMTPCaps *scaps)
    return 0;
 }
 
-int authorize_with_login(const char *login, const char *password, STalker *stalker)
+int greet_smtp_server(const char *host_url, STalker *talker, SMTPCaps *scaps)
 {
    char buffer[1024];
-   int bytes_received = 0;
-   int reply_status;
+   SMTPReply reply;
 
-   stk_send_line(stalker, "AUTH LOGIN", NULL);
-   bytes_received = stk_recv_line(stalker, buffer, sizeof(buffer));
-   if (bytes_received)
+   if (smtp_recv_reply(talker, &reply, buffer, sizeof(buffer)) != 220)
    {
-      buffer[bytes_received] = '\0';
-      reply_status = atoi(buffer);
+      smtp_log_reply_error(&reply, "Greeting");
+      memset(scaps, 0, sizeof(SMTPCaps));
+      return 0;
+   }
+
+   return ehlo_smtp_server(host_url, talker, scaps);
+}
+
+int authorize_with_login(const char *login, const char *password, STalker *stalker)
+{
+   char buffer[1024];
+   SMTPReply reply;
 
-      if (reply_status >= 300 && reply_status < 400)
+   if (smtp_command(stalker, &reply, buffer, sizeof(buffer), "AUTH LOGIN", NULL))
+   {
+      if (smtp_reply_intermediate(&reply))
       {
          c64_encode_to_buffer(login, strlen(login), (uint32_t*)&buffer, sizeof(buffer));
 
-         stk_send_line(stalker, buffer, NULL);
-         bytes_received = stk_recv_line(stalker, buffer, sizeof(buffer));
-         buffer[bytes_received] = '\0';
-         reply_status = atoi(buffer);
+         smtp_command(stalker, &reply, buffer, sizeof(buffer), buffer, NULL);
 
-         if (reply_status >= 300 && reply_status < 400)
+         if (smtp_reply_intermediate(&reply))
          {
             c64_encode_to_buffer(password, strlen(password), (uint32_t*)&buffer, sizeof(buffer));
 
-            stk_send_line(stalker, buffer, NULL);
-            bytes_received = stk_recv_line(stalker, buffer, sizeof(buffer));
-            buffer[bytes_received] = '\0';
-            reply_status = atoi(buffer);
+            smtp_command(stalker, &reply, buffer, sizeof(buffer), buffer, NULL);
 
-            if (reply_status >= 200 && reply_status < 300)
+            if (smtp_reply_positive(&reply))
                return SMTP_SUCCESS;
             else
                return SMTP_ERROR_AUTH_WRONG_PASSWORD;
@@ -184,7 +140,11 @@ int authorize_with_login(const char *login, const char *password, STalker *stalk
 // Include source files for one-off compile
 #include "socktalk.c"
 #include "socket.c"
+#include "uring.c"
+#include "resolve.c"
 #include "smtp_caps.c"
+#include "smtp_reply.c"
+#include "arena.c"
 #include "logging.c"
 
 void use_the_smtp_tls_talker(STalker *stalker, void *data)
@@ -192,7 +152,7 @@ void use_the_smtp_tls_talker(STalker *stalker, void *data)
    SMTPCaps scaps;
    ServerCreds *sc = (ServerCreds*)data;
    SMTPError serror;
-   if (greet_smtp_server(sc->host_url, stalker, &scaps))
+   if (ehlo_smtp_server(sc->host_url, stalker, &scaps))
    {
       if (cget_auth_login(&scaps))
       {
@@ -228,9 +188,61 @@ void use_the_smtp_talker(STalker *stalker, void *data)
    stk_recv_line(stalker, buffer, sizeof(buffer));
 }
 
+/**
+ * Greet a server played by the other end of a socket pair, which
+ * sends *script* at once, and report whether the result was *expected*.
+ */
+int test_greeting(const char *label, const char *script, int expected)
+{
+   STalker talker;
+   STReplies replies;
+   char reply_buffer[1024];
+   SMTPCaps scaps;
+   char sent[256];
+   int pair[2];
+   int result, sent_len;
+   int passed;
+
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+   {
+      perror("socketpair");
+      return 0;
+   }
+
+   write(pair[1], script, strlen(script));
+   init_sock_talker(&talker, &pair[0]);
+   stk_attach_replies(&talker, &replies, reply_buffer, sizeof(reply_buffer));
+
+   result = greet_smtp_server("client.example.com", &talker, &scaps);
+
+   sent_len = recv(pair[1], sent, sizeof(sent) - 1, MSG_DONTWAIT);
+   sent[sent_len > 0 ? sent_len : 0] = '\0';
+
+   passed = result == expected
+      && (!expected || (cget_starttls(&scaps) && strcmp(sent, "EHLO client.example.com\r\n") == 0))
+      && (expected || sent_len <= 0);
+
+   printf("%-28s %s\n", label, passed ? "[32;1mpassed[m" : "[31;1mFAILED[m");
+
+   close(pair[0]);
+   close(pair[1]);
+   return passed;
+}
+
 int main(int argc, const char **argv)
 {
    ServerCreds sc;
+
+   if (!test_greeting("greeting, then EHLO",
+                      "220 mx.example.com ESMTP\r\n"
+                      "250-mx.example.com\r\n"
+                      "250 STARTTLS\r\n",
+                      1)
+       || !test_greeting("greeting refused",
+                         "554 5.3.2 No service\r\n",
+                         0))
+      return 1;
+
    init_server_creds(&sc);
 
    int exit_code = open_socket_talker(sc.host_url, sc.host_port, &sc, use_the_smtp_talker);
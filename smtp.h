@@ -29,7 +29,16 @@ void init_server_creds(ServerCreds *sc);
 
 int start_tls(STalker *open_talker, void *data, talker_user callback);
 
+/**
+ * @brief Read the server's 220 greeting, then send EHLO and read the
+ *        capabilities it replies with into *scaps*.
+ *
+ * @return 1 for success, 0 if the greeting or EHLO was refused.
+ */
 int greet_smtp_server(const char *host_url, STalker *talker, SMTPCaps *scaps);
+
+/** Send EHLO and read the capabilities, as again after STARTTLS, with no greeting. */
+int ehlo_smtp_server(const char *host_url, STalker *talker, SMTPCaps *scaps);
 int authorize_with_login(const char *login, const char *password, STalker *stalker);
 
 
@@ -1,4 +1,4 @@
-// -*- compile-command: "base=smtp_caps; gcc -Wall -Werror -ggdb -DSMTP_SETCAPS_MAIN -DDEBUG -o $base ${base}.c" -*-
+// -*- compile-command: "base=smtp_caps; gcc -Wall -Werror -ggdb -DSMTP_SETCAPS_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c -lssl -lcrypto" -*-
 
 #include <stddef.h>    // for NULL value
 #include <stdio.h>     // for printf() in show_smtp_caps()
@@ -9,6 +9,7 @@
 #include <assert.h>
 
 #include "smtp_caps.h"
+#include "smtp_reply.h"
 #include "logging.h"
 
 void cset_starttls(SMTPCaps *caps,
@@ -265,48 +266,40 @@ void parse_ehlo_auth(SMTPCaps *caps, const char *auth_line, int line_len)
 
 void parse_ehlo_response(SMTPCaps *caps, const char *buffer, int data_len)
 {
-   const char *end = &buffer[data_len];
-   const char *ptr = buffer;
-   const char *end_of_line;
-   int line_len;
-
-   int line_status;
+   SMTPReply reply;
+   const SMTPReplyText *line, *end;
    CSResult csr;
 
-   while (ptr < end)
+   if (smtp_parse_reply(&reply, buffer, data_len) <= 0)
    {
-      end_of_line = find_end_of_line(ptr);
-      
-      line_status = atoi(ptr);
-      if (line_status == 250)
-      {
-         // Shift to text following status number:
-         ptr += 4;
-
-         line_len = end_of_line - ptr;
-
-         if (strncasecmp("auth", ptr, 4) == 0)
-            parse_ehlo_auth(caps, ptr, line_len);
-         else if (find_capname_index(&csr, ptr))
-         {
-            int *ptr_cap_field = (int*)caps;
-            ptr_cap_field += csr.index;
-
-            if (csr.ptr_to_value)
-               *ptr_cap_field = atoi(csr.ptr_to_value);
-            else
-               *ptr_cap_field = 1;
-         }
-      }
-      else if (line_status >= 400)
+      log_error_message(1, "Failed to parse the EHLO reply.", NULL);
+      return;
+   }
+
+   if (reply.code != 250)
+   {
+      smtp_log_reply_error(&reply, "EHLO");
+      return;
+   }
+
+   end = reply.lines;
+   end += reply.line_count < SMTP_REPLY_MAX_LINES ? reply.line_count : SMTP_REPLY_MAX_LINES;
+
+   // The first line is the server's greeting, capabilities follow:
+   for (line = reply.lines + 1; line < end; ++line)
+   {
+      if (line->text_len >= 4 && strncasecmp("auth", line->text, 4) == 0)
+         parse_ehlo_auth(caps, line->text, line->text_len);
+      else if (find_capname_index(&csr, line->text))
       {
-         printf("SMTP server error [m34;1m%d[m (%s).\n", line_status, ptr);
-      }
+         int *ptr_cap_field = (int*)caps;
+         ptr_cap_field += csr.index;
 
-      // Go to the next line
-      ptr = end_of_line;
-      while (isspace(*ptr))
-         ++ptr;
+         if (csr.ptr_to_value)
+            *ptr_cap_field = atoi(csr.ptr_to_value);
+         else
+            *ptr_cap_field = 1;
+      }
    }
 }
 
@@ -337,6 +330,9 @@ void show_smtpcaps(const SMTPCaps *caps)
 
 #include <stdio.h>
 #include "logging.c"
+#include "smtp_reply.c"
+#include "arena.c"
+#include "socktalk.c"
 
 void test_parse_ehlo_auth(void)
 {
@@ -349,9 +345,27 @@ void test_parse_ehlo_auth(void)
    show_smtpcaps(&caps);
 }
 
+void test_parse_ehlo_response(void)
+{
+   const char *reply =
+      "250-smtp.example.com at your service\r\n"
+      "250-SIZE 35882577\r\n"
+      "250-8BITMIME\r\n"
+      "250-STARTTLS\r\n"
+      "250-AUTH LOGIN PLAIN XOAUTH2\r\n"
+      "250 PIPELINING\r\n";
+
+   SMTPCaps caps;
+   memset(&caps, 0, sizeof(SMTPCaps));
+
+   parse_ehlo_response(&caps, reply, strlen(reply));
+   show_smtpcaps(&caps);
+}
+
 int main(int argc, const char **argv)
 {
    test_parse_ehlo_auth();
+   test_parse_ehlo_response();
    return 0;
 }
 
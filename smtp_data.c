@@ -0,0 +1,206 @@
+// -*- compile-command: "base=smtp_data; gcc -Wall -Werror -ggdb -DSMTP_DATA_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c -Wl,-R,. libmailtk.so" -*-
+
+#include <string.h>    // for memcpy()
+#include "smtp_data.h"
+
+void data_encoder_init(DataEncoder *de, const STalker *talker, char *buffer, int buffer_len)
+{
+   memset(de, 0, sizeof(DataEncoder));
+   de->talker = talker;
+   de->buffer = buffer;
+   de->buffer_len = buffer_len;
+}
+
+/**
+ * Write the whole buffer, continuing after short writes.
+ *
+ * @return 1 for success, 0 if the talker failed, after which
+ *         further output is discarded.
+ */
+int data_encoder_flush(DataEncoder *de)
+{
+   const char *ptr = de->buffer;
+   const char *end = de->buffer + de->used;
+   int bytes_written;
+
+   while (!de->failed && ptr < end)
+   {
+      bytes_written = (*de->talker->writer)(de->talker, ptr, end - ptr);
+      if (bytes_written <= 0)
+         de->failed = 1;
+      else
+      {
+         ptr += bytes_written;
+         de->bytes_sent += bytes_written;
+      }
+   }
+
+   de->used = 0;
+   return !de->failed;
+}
+
+static void data_encoder_put(DataEncoder *de, const char *data, int data_len)
+{
+   int room;
+
+   while (data_len > 0)
+   {
+      room = de->buffer_len - de->used;
+      if (room == 0)
+      {
+         data_encoder_flush(de);
+         room = de->buffer_len;
+      }
+
+      if (room > data_len)
+         room = data_len;
+
+      memcpy(de->buffer + de->used, data, room);
+      de->used += room;
+      data += room;
+      data_len -= room;
+   }
+}
+
+int data_encoder_put_line(DataEncoder *de, const char *line, int line_len)
+{
+   const char *end = line + line_len;
+   const char *run;
+
+   while (line < end)
+   {
+      if (*line == '.')
+         data_encoder_put(de, ".", 1);
+
+      // Copy up to the next CR or LF in one piece:
+      run = line;
+      while (run < end && *run != '\r' && *run != '\n')
+         ++run;
+
+      data_encoder_put(de, line, run - line);
+      line = run;
+
+      // Replace CR, LF, or CRLF within the line with CRLF:
+      if (line < end)
+      {
+         if (*line == '\r' && line + 1 < end && line[1] == '\n')
+            ++line;
+         ++line;
+
+         data_encoder_put(de, "\r\n", 2);
+      }
+   }
+
+   data_encoder_put(de, "\r\n", 2);
+   return !de->failed;
+}
+
+int data_encoder_put_lines(DataEncoder *de, LineDrop *ld)
+{
+   LineSpan spans[LINEDROP_BATCH_SIZE];
+   int count, index;
+
+   do
+   {
+      count = DropGetLines(ld, spans, LINEDROP_BATCH_SIZE);
+      for (index = 0; index < count; ++index)
+         data_encoder_put_line(de, spans[index].line, spans[index].line_len);
+   } while (DropAdvance(ld));
+
+   return !de->failed;
+}
+
+int data_encoder_put_file(DataEncoder *de, int fd, off_t offset, size_t length)
+{
+   if (data_encoder_flush(de))
+   {
+      if (stk_send_file_range(de->talker, fd, offset, length))
+         de->bytes_sent += length;
+      else
+         de->failed = 1;
+   }
+
+   return !de->failed;
+}
+
+int data_encoder_finish(DataEncoder *de)
+{
+   data_encoder_put(de, ".\r\n", 3);
+   return data_encoder_flush(de);
+}
+
+
+#ifdef SMTP_DATA_MAIN
+
+#include <stdio.h>
+
+int write_count = 0;
+
+/**
+ * Show the encoded text with visible line endings.
+ */
+int show_writer(const STalker *talker, const void *data, int data_len)
+{
+   const char *ptr = (const char*)data;
+   const char *end = ptr + data_len;
+
+   ++write_count;
+   while (ptr < end)
+   {
+      if (*ptr == '\r')
+         fputs("[33;1m\\r[m", stdout);
+      else if (*ptr == '\n')
+         fputs("[33;1m\\n[m\n", stdout);
+      else
+         putchar(*ptr);
+      ++ptr;
+   }
+
+   return data_len;
+}
+
+int main(int argc, const char **argv)
+{
+   const char *body[] = {
+      "The next line starts with a period.",
+      ".hidden",
+      ".",
+      "This line has a bare\nLF and a bare\rCR, then\n.a period.",
+      "",
+      "Final line.",
+      NULL
+   };
+
+   STalker talker;
+   memset(&talker, 0, sizeof(talker));
+   talker.writer = show_writer;
+
+   ListLineDropper lld;
+   LineDrop ld;
+   list_init_dropper(&lld, body);
+   init_list_line_drop(&ld, &lld);
+   ld.break_check = NULL;
+
+   // A small buffer to show the flushing:
+   char buffer[32];
+   DataEncoder de;
+   data_encoder_init(&de, &talker, buffer, sizeof(buffer));
+
+   data_encoder_put_lines(&de, &ld);
+
+   // A prepared part is sent as it is:
+   const char *prepared = "..This part was dot-stuffed\r\nbeforehand.\r\n";
+   FILE *file = tmpfile();
+   fputs(prepared, file);
+   fflush(file);
+   data_encoder_put_file(&de, fileno(file), 0, strlen(prepared));
+   fclose(file);
+
+   data_encoder_finish(&de);
+
+   printf("Sent %lu bytes in %d writes.\n", (unsigned long)de.bytes_sent, write_count);
+
+   return 0;
+}
+
+#endif
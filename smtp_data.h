@@ -0,0 +1,50 @@
+#ifndef SMTP_DATA_H
+#define SMTP_DATA_H
+
+#include "linedrop.h"
+#include "socktalk.h"
+
+// Size of the DATA output buffer, matching the largest TLS record payload
+#define SMTP_DATA_CHUNK (16 * 1024)
+
+/**
+ * @brief Encodes message text for the SMTP DATA phase.
+ *
+ * In one pass over each line, the encoder converts bare CR or LF
+ * characters to CRLF, doubles a '.' at the start of a line
+ * (RFC 5321 section 4.5.2), and packs the result into a buffer that
+ * is written to the STalker only when it fills.
+ */
+typedef struct _smtp_data_encoder
+{
+   const STalker *talker;
+   char          *buffer;
+   int           buffer_len;
+   int           used;
+   int           failed;
+   size_t        bytes_sent;
+} DataEncoder;
+
+void data_encoder_init(DataEncoder *de, const STalker *talker, char *buffer, int buffer_len);
+
+/** Encode one line, which should not include its line ending. */
+int data_encoder_put_line(DataEncoder *de, const char *line, int line_len);
+
+/** Encode lines from the LineDrop until DropAdvance() returns 0. */
+int data_encoder_put_lines(DataEncoder *de, LineDrop *ld);
+
+int data_encoder_flush(DataEncoder *de);
+
+/**
+ * @brief Send a range of a file that is already encoded for DATA:
+ *        dot-stuffed, with CRLF line endings, and ending with CRLF.
+ *
+ * The range follows what the encoder holds, and goes out through
+ * stk_send_file_range(), never through the encoder's buffer.
+ */
+int data_encoder_put_file(DataEncoder *de, int fd, off_t offset, size_t length);
+
+/** Add the ".\r\n" that ends the DATA phase, then flush. */
+int data_encoder_finish(DataEncoder *de);
+
+#endif
@@ -1,7 +1,8 @@
-// -*- compile-command: "base=smtp_iact; gcc -Wall -Werror -ggdb -DSMTP_IACT_MAIN -DDEBUG -o $base ${base}.c -Wl,-L,. -lmailtk" -*-
+// -*- compile-command: "base=smtp_iact; gcc -Wall -Werror -ggdb -DSMTP_IACT_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c -Wl,-L,. -lmailtk" -*-
 
 #include "smtp_iact.h"
-#include <alloca.h>
+#include "smtp_reply.h"
+#include "logging.h"
 #include <string.h>
 #include <assert.h>
 
@@ -21,50 +22,83 @@ void set_link_type(RecipLink *link, const char *address)
    }
 }
 
-void build_recip_chain(RecipChainUser callback, LineDrop *ld, void *data)
+int build_recip_chain_in_arena(MTKArena *arena, RecipChainUser callback, LineDrop *ld, void *data)
 {
    RecipLink *head_link = NULL, *tail_link = NULL, *cur_link;
+   int out_of_memory = 0;
+
+   LineSpan spans[LINEDROP_BATCH_SIZE];
+   const LineSpan *span, *spans_end;
 
    const char *line;
    int line_len;
 
-   char *temp_address;
-
    do
    {
-      DropGetLine(ld, &line, &line_len);
+      spans_end = spans + DropGetLines(ld, spans, LINEDROP_BATCH_SIZE);
 
-      if (line_len > 0)
+      for (span = spans; span < spans_end && !out_of_memory; ++span)
       {
-         cur_link = (RecipLink*)alloca(sizeof(RecipLink));
-         memset(cur_link, 0, sizeof(RecipLink));
-
-         set_link_type(cur_link, line);
+         line = span->line;
+         line_len = span->line_len;
 
-         if (strchr("+-#", *line))
+         if (line_len > 0)
          {
-            ++line;
-            --line_len;
+            cur_link = (RecipLink*)arena_calloc(arena, sizeof(RecipLink));
+            if (!cur_link)
+            {
+               out_of_memory = 1;
+               break;
+            }
+
+            set_link_type(cur_link, line);
+
+            if (strchr("+-#", *line))
+            {
+               ++line;
+               --line_len;
+            }
+
+            if (!(cur_link->address = arena_strndup(arena, line, line_len)))
+            {
+               out_of_memory = 1;
+               break;
+            }
+
+            if (tail_link)
+            {
+               tail_link->next = cur_link;
+               tail_link = cur_link;
+            }
+            else
+               head_link = tail_link = cur_link;
          }
+      }
 
-         temp_address = (char*)alloca(line_len+1);
-         memcpy(temp_address, line, line_len);
-         temp_address[line_len] = '\0';
+   } while (!out_of_memory && DropAdvance(ld));
 
-         cur_link->address = temp_address;
+   // Sending to part of the list would silently drop the rest:
+   if (out_of_memory)
+   {
+      log_error_message(1, "Out of memory for the recipient list, so the message is not sent.", NULL);
+      return 0;
+   }
 
-         if (tail_link)
-         {
-            tail_link->next = cur_link;
-            tail_link = cur_link;
-         }
-         else
-            head_link = tail_link = cur_link;
-      }
+   (*callback)(head_link, data);
+   return 1;
+}
 
-   } while (DropAdvance(ld));
+int build_recip_chain(RecipChainUser callback, LineDrop *ld, void *data)
+{
+   char first_block[1024];
+   MTKArena arena;
+   int built;
+   arena_init(&arena, first_block, sizeof(first_block));
 
-   (*callback)(head_link, data);
+   built = build_recip_chain_in_arena(&arena, callback, ld, data);
+
+   arena_release(&arena);
+   return built;
 }
 
 int count_unignored_recips(const RecipLink *chain)
@@ -83,39 +117,36 @@ int count_unignored_recips(const RecipLink *chain)
 int smtp_send_envelope(STalker *stalker, const char *from, RecipLink *recipient_chain)
 {
    char buffer[1024];
+   SMTPReply reply;
 
    // Catch programming error, not a STalker object along with data
    // object passed along through build_recip_chain(), etc:
    assert(stalker);
 
-   int bytes_read;
-   int reply_status;
    int recipients_accepted = 0;
 
-   stk_send_line(stalker, "MAIL FROM: <", from , ">", NULL);
-   bytes_read = stk_recv_line(stalker, buffer, sizeof(buffer));
-   buffer[bytes_read] = '\0';
+   smtp_command(stalker, &reply, buffer, sizeof(buffer), "MAIL FROM: <", from , ">", NULL);
 
-   reply_status = atoi(buffer);
-   if (reply_status > 200 && reply_status < 300)
+   if (smtp_reply_positive(&reply))
    {
       RecipLink *rptr = recipient_chain;
       while (rptr)
       {
          if (rptr->rtype != RT_IGNORE)
          {
-            stk_send_line(stalker, "RCPT TO: <", rptr->address, ">", NULL);
-            bytes_read = stk_recv_line(stalker, buffer, sizeof(buffer));
-            buffer[bytes_read] = '\0';
+            rptr->smtp_status = smtp_command(stalker, &reply, buffer, sizeof(buffer),
+                                             "RCPT TO: <", rptr->address, ">", NULL);
 
-            rptr->smtp_status = reply_status = atoi(buffer);
-
-            if (reply_status >= 200 && reply_status < 300)
+            if (smtp_reply_positive(&reply))
                ++recipients_accepted;
+            else
+               smtp_log_reply_error(&reply, "RCPT TO");
          }
          rptr = rptr->next;
       }
    }
+   else
+      smtp_log_reply_error(&reply, "MAIL FROM");
 
    return recipients_accepted;
 }
@@ -186,8 +217,8 @@ void smtp_send_recipient_headers_by_type(STalker *stalker, RecipLink *rchain, Re
  */
 void smtp_send_headers(LineDrop *ld, STalker *stalker, RecipLink *rchain)
 {
-   const char *line;
-   int line_len;
+   LineSpan spans[LINEDROP_BATCH_SIZE];
+   int count, index;
 
    // Send recipient headers:
    smtp_send_recipient_headers_by_type(stalker, rchain, RT_TO);
@@ -197,8 +228,9 @@ void smtp_send_headers(LineDrop *ld, STalker *stalker, RecipLink *rchain)
    // Sending remaining headers
    do
    {
-      DropGetLine(ld, &line, &line_len);
-      stk_simple_send_line(stalker, line, line_len);
+      count = DropGetLines(ld, spans, LINEDROP_BATCH_SIZE);
+      for (index = 0; index < count; ++index)
+         stk_simple_send_line(stalker, spans[index].line, spans[index].line_len);
    } while (DropAdvance(ld));
 }
 
@@ -265,12 +297,49 @@ void test_build_recip_chain(void)
    build_recip_chain(use_recip_chain, &ld, NULL);
 }
 
+void fail_on_recip_chain(RecipLink *chain, void *data)
+{
+   *(int*)data = 1;
+}
+
+/**
+ * An arena that runs out of memory must not yield a partial chain.
+ */
+int test_recip_chain_out_of_memory(void)
+{
+   const char *list[] = {
+      "first@gmail.com",
+      "second@gmail.com",
+      "third@gmail.com",
+      NULL
+   };
+
+   ListLineDropper lld;
+   LineDrop ld;
+   char first_block[64];
+   MTKArena arena;
+   int called = 0, built;
+
+   list_init_dropper(&lld, list);
+   init_list_line_drop(&ld, &lld);
+
+   // Room for the first link, and blocks too large for malloc():
+   arena_init(&arena, first_block, sizeof(first_block));
+   arena.block_size = (size_t)1 << 62;
+
+   built = build_recip_chain_in_arena(&arena, fail_on_recip_chain, &ld, &called);
+   arena_release(&arena);
+
+   printf("Out of memory: %s\n", (built || called) ? "[31;1msent to a partial chain[m" : "not sent");
+   return !built && !called;
+}
+
 
 int main(int argc, const char **argv)
 {
    test_build_recip_chain();
 
-   return 0;
+   return !test_recip_chain_out_of_memory();
 }
 
 #endif
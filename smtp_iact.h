@@ -3,6 +3,7 @@
 
 #include "linedrop.h"
 #include "socktalk.h"
+#include "arena.h"
 
 typedef enum _smtp_recipient_types
 {
@@ -42,7 +43,21 @@ typedef struct _smtp_recips_and_headers
  * Callback function through which a RecipLink chain is returned.
  */
 typedef void (*RecipChainUser)(RecipLink *chain, void *data);
-void build_recip_chain(RecipChainUser callback, LineDrop *ld, void *data);
+
+/**
+ * Build a chain of the recipients in *ld* and pass it to *callback*.
+ *
+ * @return 1 if *callback* was called, or 0, after logging the reason,
+ *         if the chain ran out of memory, in which case *callback* is
+ *         not called with a partial chain.
+ */
+int build_recip_chain(RecipChainUser callback, LineDrop *ld, void *data);
+
+/**
+ * Like build_recip_chain(), but the links and addresses are allocated
+ * from *arena*, and remain valid until the arena is reset.
+ */
+int build_recip_chain_in_arena(MTKArena *arena, RecipChainUser callback, LineDrop *ld, void *data);
 
 int count_unignored_recips(const RecipLink *chain);
 void smtp_send_headers(LineDrop *ld, STalker *stalker, RecipLink *rchain);
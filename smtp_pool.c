@@ -0,0 +1,589 @@
+// -*- compile-command: "base=smtp_pool; gcc -Wall -Werror -ggdb -DSMTP_POOL_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c socket.c resolve.c socktalk.c uring.c smtp_reply.c smtp_caps.c arena.c logging.c -lssl -lcrypto" -*-
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "smtp_pool.h"
+#include "smtp_reply.h"
+#include "socket.h"
+#include "logging.h"
+
+static unsigned long long pool_now_ms(void)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+static int same_string(const char *left, const char *right)
+{
+   if (left && right)
+      return strcmp(left, right) == 0;
+   else
+      return left == right;
+}
+
+static int key_matches(const SMTPPoolKey *left, const SMTPPoolKey *right)
+{
+   return left->host_port == right->host_port
+      && left->use_tls == right->use_tls
+      && same_string(left->host_url, right->host_url)
+      && same_string(left->login, right->login)
+      && same_string(left->password, right->password);
+}
+
+static char *copy_string(const char *str)
+{
+   return str ? strdup(str) : NULL;
+}
+
+static void free_key(SMTPPoolKey *key)
+{
+   free((char*)key->host_url);
+   free((char*)key->login);
+   free((char*)key->password);
+   memset(key, 0, sizeof(SMTPPoolKey));
+}
+
+/**
+ * Close the session's connection, first ending the conversation with
+ * QUIT if *send_quit*, and empty its slot.
+ *
+ * QUIT is skipped if the server has already spoken or hung up, as it
+ * does when it times out an idle session, and its reply is not
+ * awaited, so a server that stopped answering cannot hold up the pool.
+ */
+static void session_close(SMTPPoolSession *session, int send_quit)
+{
+   struct pollfd pfd = { session->socket, POLLIN, 0 };
+
+   if (send_quit && poll(&pfd, 1, 0) == 0 && !(session->ssl && SSL_pending(session->ssl)))
+      stk_send_line(&session->talker, "QUIT", NULL);
+
+   if (session->ssl)
+      SSL_free(session->ssl);
+
+   close(session->socket);
+   free_key(&session->key);
+
+   memset(session, 0, sizeof(SMTPPoolSession));
+   session->socket = -1;
+}
+
+/** Send EHLO and save the capabilities the server reports. */
+static int session_ehlo(SMTPPoolSession *session)
+{
+   char buffer[1024];
+   SMTPReply reply;
+
+   memset(&session->caps, 0, sizeof(SMTPCaps));
+
+   if (smtp_command(&session->talker, &reply, buffer, sizeof(buffer), "EHLO ", session->key.host_url, NULL) != 250)
+   {
+      smtp_log_reply_error(&reply, "EHLO");
+      return 0;
+   }
+
+   parse_ehlo_response(&session->caps, buffer, reply.reply_len);
+   return 1;
+}
+
+/** Point the session's talker at *ssl*, or at its socket if NULL. */
+static void session_init_talker(SMTPPoolSession *session, SSL *ssl)
+{
+   if (ssl)
+      init_ssl_talker(&session->talker, ssl);
+   else
+      init_sock_talker(&session->talker, &session->socket);
+
+   stk_attach_replies(&session->talker, &session->replies, session->reply_buffer, sizeof(session->reply_buffer));
+   stk_attach_stats(&session->talker, &session->stats);
+}
+
+/**
+ * Connect, and take the conversation through the greeting, EHLO,
+ * STARTTLS and AUTH, as *key* requires.
+ */
+static int session_open(SMTPPool *pool, SMTPPoolSession *session, const SMTPPoolKey *key)
+{
+   char buffer[1024];
+   SMTPReply reply;
+   MTK_ERROR error;
+
+   if ((session->socket = connect_to_host(key->host_url, key->host_port, &error)) < 0)
+   {
+      log_error_message(1, "Failed to connect to ", key->host_url, " for the pool.", NULL);
+      return 0;
+   }
+
+   session->key.host_url = copy_string(key->host_url);
+   session->key.host_port = key->host_port;
+   session->key.use_tls = key->use_tls;
+   session->key.login = copy_string(key->login);
+   session->key.password = copy_string(key->password);
+
+   session_init_talker(session, NULL);
+
+   if (smtp_recv_reply(&session->talker, &reply, buffer, sizeof(buffer)) != 220)
+   {
+      smtp_log_reply_error(&reply, "Greeting");
+      return 0;
+   }
+
+   if (!session_ehlo(session))
+      return 0;
+
+   if (key->use_tls)
+   {
+      if (!cget_starttls(&session->caps))
+      {
+         log_error_message(1, key->host_url, " does not offer STARTTLS.", NULL);
+         return 0;
+      }
+
+      if (!smtp_command(&session->talker, &reply, buffer, sizeof(buffer), "STARTTLS", NULL)
+          || !smtp_reply_positive(&reply))
+      {
+         smtp_log_reply_error(&reply, "STARTTLS");
+         return 0;
+      }
+
+      if (!(session->ssl = start_ssl_session(&session->talker)))
+         return 0;
+
+      // What the server said before TLS no longer counts:
+      session_init_talker(session, session->ssl);
+      if (!session_ehlo(session))
+         return 0;
+   }
+
+   if (key->login)
+   {
+      if (!pool->authorize)
+      {
+         log_error_message(1, "The pool has no authorizer for the login to ", key->host_url, ".", NULL);
+         return 0;
+      }
+
+      if (!(*pool->authorize)(&session->talker, &session->caps, key->login, key->password))
+         return 0;
+   }
+
+   return 1;
+}
+
+/**
+ * Make sure an idle session is still open, and clear any transaction
+ * state, before it is borrowed.
+ *
+ * A server that timed out or closed the connection has usually said
+ * so (421) or closed its end already, which shows as something to
+ * read, so that is caught without a round trip.
+ */
+static int session_check(SMTPPoolSession *session)
+{
+   char buffer[256];
+   SMTPReply reply;
+   struct pollfd pfd = { session->socket, POLLIN, 0 };
+
+   if (poll(&pfd, 1, 0) != 0 || (session->ssl && SSL_pending(session->ssl)))
+      return 0;
+
+   return smtp_command(&session->talker, &reply, buffer, sizeof(buffer), "RSET", NULL) == 250;
+}
+
+int smtp_pool_init(SMTPPool *pool, int max_sessions, smtp_pool_authorizer authorize)
+{
+   int index;
+
+   memset(pool, 0, sizeof(SMTPPool));
+
+   if (!(pool->sessions = (SMTPPoolSession*)calloc(max_sessions, sizeof(SMTPPoolSession))))
+      return 0;
+
+   for (index = 0; index < max_sessions; ++index)
+      pool->sessions[index].socket = -1;
+
+   pool->max_sessions = max_sessions;
+   pool->idle_ms = SMTP_POOL_IDLE_MS;
+   pool->max_messages = SMTP_POOL_MAX_MESSAGES;
+   pool->authorize = authorize;
+
+   return 1;
+}
+
+void smtp_pool_close(SMTPPool *pool)
+{
+   int index;
+
+   for (index = 0; index < pool->max_sessions; ++index)
+      if (pool->sessions[index].socket >= 0)
+         session_close(&pool->sessions[index], 1);
+
+   free(pool->sessions);
+   pool->sessions = NULL;
+   pool->max_sessions = 0;
+}
+
+SMTPPoolSession *smtp_pool_borrow(SMTPPool *pool, const SMTPPoolKey *key)
+{
+   unsigned long long now = pool_now_ms();
+   SMTPPoolSession *session, *empty = NULL, *oldest = NULL;
+   int index;
+
+   for (index = 0; index < pool->max_sessions; ++index)
+   {
+      session = &pool->sessions[index];
+
+      if (session->socket >= 0 && !session->borrowed && now - session->idle_since_ms > (unsigned)pool->idle_ms)
+      {
+         session_close(session, 1);
+         ++pool->expired;
+      }
+
+      if (session->socket < 0)
+      {
+         if (!empty)
+            empty = session;
+      }
+      else if (!session->borrowed)
+      {
+         if (key_matches(&session->key, key))
+         {
+            if (session_check(session))
+            {
+               session->borrowed = 1;
+               ++pool->reused;
+               return session;
+            }
+
+            session_close(session, 0);
+            ++pool->failed_checks;
+
+            if (!empty)
+               empty = session;
+         }
+         else if (!oldest || session->idle_since_ms < oldest->idle_since_ms)
+            oldest = session;
+      }
+   }
+
+   // Make room by ending the session that has waited longest for reuse:
+   if (!empty && oldest)
+   {
+      session_close(oldest, 1);
+      empty = oldest;
+   }
+
+   if (!empty)
+   {
+      log_error_message(1, "Every session in the pool is borrowed.", NULL);
+      return NULL;
+   }
+
+   if (!session_open(pool, empty, key))
+   {
+      if (empty->socket >= 0)
+         session_close(empty, 0);
+      return NULL;
+   }
+
+   empty->borrowed = 1;
+   ++pool->opened;
+   return empty;
+}
+
+void smtp_pool_release(SMTPPool *pool, SMTPPoolSession *session, int reusable)
+{
+   session->borrowed = 0;
+   ++session->messages;
+
+   if (!reusable)
+      session_close(session, 0);
+   else if (session->messages >= pool->max_messages)
+   {
+      session_close(session, 1);
+      ++pool->retired;
+   }
+   else
+      session->idle_since_ms = pool_now_ms();
+}
+
+void smtp_pool_dump(const SMTPPool *pool, FILE *target)
+{
+   if (!target)
+      target = stderr;
+
+   fprintf(target,
+           "Pool: [32;1m%lu[m opened, [32;1m%lu[m reused, "
+           "%lu expired, %lu retired, %lu failed checks\n",
+           pool->opened,
+           pool->reused,
+           pool->expired,
+           pool->retired,
+           pool->failed_checks);
+}
+
+
+/************************************
+ * Conditionally-compiled test code.
+ ***********************************/
+
+#ifdef SMTP_POOL_MAIN
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// The fake server drops a connection, without a word, after this many messages
+#define SERVER_MESSAGE_LIMIT 5
+
+/**
+ * Fake SMTP server for one connection, which offers AUTH PLAIN and
+ * accepts any login.
+ */
+void serve_connection(int fd)
+{
+   FILE *in = fdopen(fd, "r");
+   char line[1024];
+   const char *reply;
+   int in_data = 0, messages = 0, mute = 0;
+
+   write(fd, "220 fake.example.com ESMTP\r\n", 28);
+
+   while (fgets(line, sizeof(line), in))
+   {
+      reply = NULL;
+
+      if (in_data)
+      {
+         if (strcmp(line, ".\r\n") == 0)
+         {
+            in_data = 0;
+            ++messages;
+            reply = "250 2.0.0 Queued\r\n";
+         }
+      }
+      else if (strncmp(line, "EHLO", 4) == 0)
+         reply = "250-fake.example.com\r\n250-PIPELINING\r\n250 AUTH PLAIN\r\n";
+      else if (strncmp(line, "AUTH", 4) == 0)
+      {
+         // This login's sessions never answer QUIT:
+         mute = strstr(line, "mute@") != NULL;
+         reply = "235 2.7.0 Accepted\r\n";
+      }
+      else if (strncmp(line, "DATA", 4) == 0)
+      {
+         in_data = 1;
+         reply = "354 Go ahead\r\n";
+      }
+      else if (strncmp(line, "QUIT", 4) == 0)
+      {
+         if (mute)
+            continue;
+         write(fd, "221 Bye\r\n", 9);
+         break;
+      }
+      else
+         reply = "250 2.0.0 OK\r\n";
+
+      if (reply)
+         write(fd, reply, strlen(reply));
+
+      if (messages == SERVER_MESSAGE_LIMIT && !in_data)
+         break;
+   }
+
+   fclose(in);
+}
+
+/** Accept connections on *listener* until killed, serving each in a child. */
+void run_server(int listener)
+{
+   int fd;
+
+   signal(SIGCHLD, SIG_IGN);
+
+   while ((fd = accept(listener, NULL, NULL)) >= 0)
+   {
+      if (fork() == 0)
+      {
+         close(listener);
+         serve_connection(fd);
+         exit(0);
+      }
+      close(fd);
+   }
+}
+
+int test_authorizer(STalker *talker, const SMTPCaps *caps, const char *login, const char *password)
+{
+   char buffer[256];
+   SMTPReply reply;
+
+   return smtp_command(talker, &reply, buffer, sizeof(buffer), "AUTH PLAIN ", login, NULL) == 235;
+}
+
+/** Send a short message through *session*, returning 1 if it was accepted. */
+int send_message(SMTPPoolSession *session)
+{
+   STalker *talker = &session->talker;
+   char buffer[256];
+   SMTPReply reply;
+   int ok;
+
+   if (smtp_command(talker, &reply, buffer, sizeof(buffer), "MAIL FROM:<sender@example.com>", NULL) != 250
+       || smtp_command(talker, &reply, buffer, sizeof(buffer), "RCPT TO:<recipient@example.com>", NULL) != 250
+       || smtp_command(talker, &reply, buffer, sizeof(buffer), "DATA", NULL) != 354)
+      return 0;
+
+   stk_set_more(talker, 1);
+   ok = stk_send_line(talker, "Subject: Pooled", NULL)
+      && stk_send_line(talker, "", NULL)
+      && stk_send_line(talker, "Sent over a pooled session.", NULL);
+   stk_set_more(talker, 0);
+
+   return ok && smtp_command(talker, &reply, buffer, sizeof(buffer), ".", NULL) == 250;
+}
+
+/** Send *count* messages for *key*, borrowing a session for each. */
+int send_messages(SMTPPool *pool, const SMTPPoolKey *key, int count)
+{
+   SMTPPoolSession *session;
+   int index, ok;
+
+   for (index = 0; index < count; ++index)
+   {
+      if (!(session = smtp_pool_borrow(pool, key)))
+         return 0;
+
+      ok = send_message(session);
+      smtp_pool_release(pool, session, ok);
+
+      if (!ok)
+         return 0;
+   }
+
+   return 1;
+}
+
+double elapsed_ms(const struct timespec *start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/** Time *count* messages with a pool whose sessions carry at most *max_messages*. */
+int timed_run(const char *label, const SMTPPoolKey *key, int count, int max_messages)
+{
+   SMTPPool pool;
+   struct timespec start;
+   int ok;
+
+   smtp_pool_init(&pool, 4, test_authorizer);
+   pool.max_messages = max_messages;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   ok = send_messages(&pool, key, count);
+   smtp_pool_close(&pool);
+
+   printf("%-22s %d messages in %7.2f ms, ", label, count, elapsed_ms(&start));
+   smtp_pool_dump(&pool, stdout);
+
+   return ok;
+}
+
+int main(int argc, const char **argv)
+{
+   struct sockaddr_in addr;
+   socklen_t addr_len = sizeof(addr);
+   int listener = socket(AF_INET, SOCK_STREAM, 0);
+   pid_t server;
+   SMTPPool pool;
+   int ok = 1;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   if (bind(listener, (struct sockaddr*)&addr, sizeof(addr))
+       || listen(listener, 16)
+       || getsockname(listener, (struct sockaddr*)&addr, &addr_len))
+   {
+      perror("listener");
+      return 1;
+   }
+
+   fflush(stdout);
+   if ((server = fork()) == 0)
+   {
+      run_server(listener);
+      exit(0);
+   }
+   close(listener);
+
+   SMTPPoolKey key = { "127.0.0.1", ntohs(addr.sin_port), 0, "user@example.com", "secret" };
+   SMTPPoolKey other_key = key;
+   other_key.login = "other@example.com";
+   SMTPPoolKey mute_key = key;
+   mute_key.login = "mute@example.com";
+
+   // Sessions outlive the server's message limit, so some checks fail:
+   ok &= timed_run("New session each time:", &key, 40, 1);
+   ok &= timed_run("Pooled sessions:", &key, 40, SMTP_POOL_MAX_MESSAGES);
+
+   // Two logins share the pool, and idle sessions expire:
+   smtp_pool_init(&pool, 2, test_authorizer);
+   pool.max_messages = 3;
+   pool.idle_ms = 50;
+
+   ok &= send_messages(&pool, &key, 2);
+   ok &= send_messages(&pool, &other_key, 4);
+   usleep(100 * 1000);
+   ok &= send_messages(&pool, &key, 1);
+
+   printf("%-22s ", "Limits:");
+   smtp_pool_dump(&pool, stdout);
+
+   if (pool.opened != 4 || pool.reused != 3 || pool.retired != 1 || pool.expired != 2)
+   {
+      printf("[31;1mUnexpected pool counts.[m\n");
+      ok = 0;
+   }
+
+   smtp_pool_close(&pool);
+
+   // Ending sessions whose server ignores QUIT must not wait for it:
+   struct timespec start;
+   smtp_pool_init(&pool, 1, test_authorizer);
+   pool.idle_ms = 50;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   ok &= send_messages(&pool, &mute_key, 1);
+   usleep(100 * 1000);
+   ok &= send_messages(&pool, &mute_key, 1);
+   ok &= send_messages(&pool, &key, 1);
+   smtp_pool_close(&pool);
+
+   printf("%-22s %7.2f ms, ", "Unanswered QUIT:", elapsed_ms(&start));
+   smtp_pool_dump(&pool, stdout);
+
+   if (pool.expired != 1 || elapsed_ms(&start) > 1000)
+   {
+      printf("[31;1mWaited for QUIT replies.[m\n");
+      ok = 0;
+   }
+
+   kill(server, SIGTERM);
+   waitpid(server, NULL, 0);
+
+   return !ok;
+}
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef SMTP_POOL_H
+#define SMTP_POOL_H
+
+#include "socktalk.h"
+#include "smtp_caps.h"
+
+/**
+ * A pool of SMTP sessions that stay open between messages.
+ *
+ * Opening a session costs the connect, the greeting, EHLO, and with
+ * TLS, STARTTLS, the handshake and a second EHLO, and then AUTH:
+ * six to eight round trips before the first MAIL FROM.  A pooled
+ * session pays that once, and each later message borrows it for one
+ * RSET, which also proves the server is still there.
+ *
+ * Sessions are matched by host, port, TLS and credentials.  A session
+ * idle for longer than idle_ms, or that has carried max_messages
+ * messages, is ended with QUIT.
+ */
+
+// Default idle limit, well short of the 5-minute server timeout of RFC 5321
+#define SMTP_POOL_IDLE_MS      (60 * 1000)
+#define SMTP_POOL_MAX_MESSAGES 100
+
+/**
+ * @brief What a session is for: it can be reused only for the same key.
+ *
+ * The strings are copied into the pool.
+ */
+typedef struct _smtp_pool_key
+{
+   const char *host_url;
+   int        host_port;
+   int        use_tls;       // 1 to require STARTTLS
+   const char *login;        // NULL to skip AUTH
+   const char *password;
+} SMTPPoolKey;
+
+/**
+ * @brief Authorize a newly opened session, after its (last) EHLO.
+ *
+ * @return 1 if the server accepted the credentials.
+ */
+typedef int (*smtp_pool_authorizer)(STalker *talker, const SMTPCaps *caps, const char *login, const char *password);
+
+typedef struct _smtp_pool_session
+{
+   SMTPPoolKey        key;
+   int                socket;          // -1 if the slot is empty
+   SSL                *ssl;
+   STalker            talker;          // ready for MAIL FROM when borrowed
+   STReplies          replies;
+   STalkerStats       stats;
+   SMTPCaps           caps;            // from the EHLO that counts, after STARTTLS
+   int                borrowed;
+   int                messages;
+   unsigned long long idle_since_ms;
+   char               reply_buffer[STK_REPLY_BUFFER_SIZE];
+} SMTPPoolSession;
+
+typedef struct _smtp_pool
+{
+   SMTPPoolSession      *sessions;
+   int                  max_sessions;
+   int                  idle_ms;
+   int                  max_messages;
+   smtp_pool_authorizer authorize;     // required for keys with a login
+
+   unsigned long        opened;
+   unsigned long        reused;
+   unsigned long        expired;       // closed for being idle too long
+   unsigned long        retired;       // closed after max_messages
+   unsigned long        failed_checks; // found closed, or refused RSET
+} SMTPPool;
+
+/**
+ * @brief Prepare a pool of up to *max_sessions* open sessions, with
+ *        the default limits, which may be changed before use.
+ *
+ * @return 1 for success, 0 if out of memory.
+ */
+int smtp_pool_init(SMTPPool *pool, int max_sessions, smtp_pool_authorizer authorize);
+
+/** End every session with QUIT, and free the pool's memory. */
+void smtp_pool_close(SMTPPool *pool);
+
+/**
+ * @brief Borrow a session for *key*, reusing an idle one that answers
+ *        RSET, or opening a new one.
+ *
+ * Send one message with session->talker, then return the session
+ * with smtp_pool_release().
+ *
+ * @return The session, or NULL, after logging the reason, if none
+ *         could be opened, or every slot is borrowed.
+ */
+SMTPPoolSession *smtp_pool_borrow(SMTPPool *pool, const SMTPPoolKey *key);
+
+/**
+ * @brief Return a borrowed session.
+ *
+ * Pass *reusable* 0 if the conversation did not finish cleanly, as
+ * when a reply was missing or the connection failed, to close the
+ * session instead of keeping it.
+ */
+void smtp_pool_release(SMTPPool *pool, SMTPPoolSession *session, int reusable);
+
+/** Print the pool's counts to *target* (stderr if NULL). */
+void smtp_pool_dump(const SMTPPool *pool, FILE *target);
+
+#endif
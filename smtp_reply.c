@@ -0,0 +1,436 @@
+// -*- compile-command: "base=smtp_reply; gcc -Wall -Werror -O2 -ggdb -DSMTP_REPLY_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c socktalk.c arena.c logging.c -lssl -lcrypto" -*-
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "smtp_reply.h"
+
+static inline int is_digit(char c) { return c >= '0' && c <= '9'; }
+
+/**
+ * Parse up to *max_digits* digits at *ptr*, stopping at *end*.
+ * Returns the number of digits parsed.
+ */
+static int parse_number(const char *ptr, const char *end, int max_digits, int *value)
+{
+   int count = 0;
+
+   *value = 0;
+   while (count < max_digits && ptr < end && is_digit(*ptr))
+   {
+      *value = *value * 10 + (*ptr++ - '0');
+      ++count;
+   }
+
+   return count;
+}
+
+/**
+ * Parse an RFC 3463 enhanced status code, like "5.1.1", followed
+ * by a space or the end of the line.  Returns the number of
+ * characters to skip, including the space, or 0 if there's no code.
+ */
+static int parse_enhanced_code(const char *ptr, const char *end, int *eclass, int *subject, int *detail)
+{
+   const char *start = ptr;
+   int len;
+
+   if (ptr + 5 > end || (*ptr != '2' && *ptr != '4' && *ptr != '5') || ptr[1] != '.')
+      return 0;
+
+   *eclass = *ptr - '0';
+   ptr += 2;
+
+   if (!(len = parse_number(ptr, end, 3, subject)))
+      return 0;
+   ptr += len;
+
+   if (ptr >= end || *ptr++ != '.')
+      return 0;
+
+   if (!(len = parse_number(ptr, end, 3, detail)))
+      return 0;
+   ptr += len;
+
+   if (ptr < end)
+   {
+      if (*ptr != ' ')
+         return 0;
+      ++ptr;
+   }
+
+   return ptr - start;
+}
+
+/**
+ * Parse the reply in *data*, as smtp_parse_reply() does.  If *partial*,
+ * data that ends before the reply does is the start of a truncated
+ * reply, and its last line may be cut short.
+ */
+static int parse_reply(SMTPReply *reply, const char *data, int data_len, int partial)
+{
+   const char *ptr = data;
+   const char *end = data + data_len;
+   const char *line_end, *text;
+   int code, skip;
+   int eclass, subject, detail;
+   int last_line = 0;
+
+   reply->code = 0;
+   reply->enh_class = reply->enh_subject = reply->enh_detail = 0;
+   reply->line_count = 0;
+   reply->reply_len = 0;
+   reply->truncated = 0;
+
+   while (!last_line)
+   {
+      if (!(line_end = memchr(ptr, '\n', end - ptr)))
+      {
+         if (!partial)
+            return 0;
+
+         // The reply was cut short, perhaps in mid-line, which is
+         // kept only if it has its status code:
+         reply->truncated = 1;
+         if (reply->line_count > 0 && end - ptr < 4)
+            break;
+
+         line_end = end;
+         last_line = 1;
+      }
+
+      // Text ends before the "\r\n" or bare "\n":
+      text = line_end;
+      if (text > ptr && text[-1] == '\r')
+         --text;
+
+      if (text - ptr < 3 || parse_number(ptr, text, 3, &code) != 3)
+         return -1;
+
+      if (text - ptr == 3)
+         last_line = 1;
+      else if (ptr[3] == ' ')
+         last_line = 1;
+      else if (ptr[3] != '-')
+         return -1;
+
+      if (reply->line_count == 0)
+         reply->code = code;
+
+      ptr += text - ptr > 3 ? 4 : 3;
+
+      if ((skip = parse_enhanced_code(ptr, text, &eclass, &subject, &detail)))
+      {
+         if (reply->line_count == 0)
+         {
+            reply->enh_class = eclass;
+            reply->enh_subject = subject;
+            reply->enh_detail = detail;
+         }
+         ptr += skip;
+      }
+
+      if (reply->line_count < SMTP_REPLY_MAX_LINES)
+      {
+         reply->lines[reply->line_count].text = ptr;
+         reply->lines[reply->line_count].text_len = text - ptr;
+      }
+      ++reply->line_count;
+
+      ptr = line_end < end ? line_end + 1 : end;
+   }
+
+   return reply->reply_len = ptr - data;
+}
+
+int smtp_parse_reply(SMTPReply *reply, const char *data, int data_len)
+{
+   return parse_reply(reply, data, data_len, 0);
+}
+
+int smtp_recv_reply(const STalker *talker, SMTPReply *reply, char *buffer, int buff_len)
+{
+   int bytes_read = stk_recv_reply(talker, buffer, buff_len);
+
+   // stk_recv_reply() consumes whole replies, so one that ends early
+   // was cut short to fit:
+   if (bytes_read > 0 && parse_reply(reply, buffer, bytes_read, 1) > 0)
+      return reply->code;
+
+   memset(reply, 0, sizeof(SMTPReply));
+   if (bytes_read == STK_WANT_READ || bytes_read == STK_WANT_WRITE)
+      return bytes_read;
+   else if (bytes_read > 0)
+      fprintf(stderr, "Failed to parse SMTP reply \"%s\".\n", buffer);
+
+   return 0;
+}
+
+int smtp_command(const STalker *talker, SMTPReply *reply, char *buffer, int buff_len, ...)
+{
+   size_t bytes_sent;
+   va_list args;
+   va_start(args, buff_len);
+   bytes_sent = stk_vsend_line(talker, args);
+   va_end(args);
+
+   if (!bytes_sent)
+   {
+      memset(reply, 0, sizeof(SMTPReply));
+      return 0;
+   }
+
+   return smtp_recv_reply(talker, reply, buffer, buff_len);
+}
+
+int stk_send_recv_line(const STalker *talker, ...)
+{
+   char buffer[1000];
+   SMTPReply reply;
+   size_t bytes_sent;
+
+   va_list args;
+   va_start(args, talker);
+   bytes_sent = stk_vsend_line(talker, args);
+   va_end(args);
+
+   if (!bytes_sent)
+      return 0;
+
+   smtp_recv_reply(talker, &reply, buffer, sizeof(buffer));
+   return !smtp_log_reply_error(&reply, "Command");
+}
+
+Status_Line *smtp_reply_status_chain(const SMTPReply *reply, MTKArena *arena)
+{
+   Status_Line *head = NULL, **tail = &head;
+   const SMTPReplyText *line = reply->lines;
+   const SMTPReplyText *end = line;
+
+   end += reply->line_count < SMTP_REPLY_MAX_LINES ? reply->line_count : SMTP_REPLY_MAX_LINES;
+
+   for (; line < end; ++line)
+   {
+      if (!(*tail = (Status_Line*)arena_alloc(arena, sizeof(Status_Line)))
+          || !((*tail)->message = arena_strndup(arena, line->text, line->text_len)))
+         return NULL;
+
+      (*tail)->status = reply->code;
+      (*tail)->next = NULL;
+      tail = &(*tail)->next;
+   }
+
+   return head;
+}
+
+int smtp_log_reply_error(const SMTPReply *reply, const char *command)
+{
+   int index;
+
+   if (reply->code >= 400 || reply->code == 0)
+   {
+      fprintf(stderr, "%s failed with ", command);
+      if (smtp_reply_has_enhanced(reply))
+         fprintf(stderr, "[31;1m%d %d.%d.%d[m", reply->code, reply->enh_class, reply->enh_subject, reply->enh_detail);
+      else
+         fprintf(stderr, "[31;1m%d[m", reply->code);
+
+      for (index = 0; index < reply->line_count && index < SMTP_REPLY_MAX_LINES; ++index)
+         fprintf(stderr, " %.*s", reply->lines[index].text_len, reply->lines[index].text);
+
+      fputc('\n', stderr);
+      return 1;
+   }
+
+   return 0;
+}
+
+void smtp_dump_reply(const SMTPReply *reply)
+{
+   int index;
+
+   printf("Reply [32;1m%d[m", reply->code);
+   if (smtp_reply_has_enhanced(reply))
+      printf(" ([32;1m%d.%d.%d[m)", reply->enh_class, reply->enh_subject, reply->enh_detail);
+   printf(", %d line%s, %d bytes%s:\n",
+          reply->line_count,
+          reply->line_count == 1 ? "" : "s",
+          reply->reply_len,
+          reply->truncated ? " (truncated)" : "");
+
+   for (index = 0; index < reply->line_count && index < SMTP_REPLY_MAX_LINES; ++index)
+      printf("   \"%.*s\"\n", reply->lines[index].text_len, reply->lines[index].text);
+}
+
+
+/************************************
+ * Conditionally-compiled test code.
+ ***********************************/
+
+#ifdef SMTP_REPLY_MAIN
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>      // for write(), close()
+#include <sys/socket.h>  // for socketpair()
+
+#define BENCH_REPLIES 2000000
+
+const char *samples[] = {
+   "250 OK\r\n",
+   "250-smtp.example.com at your service\r\n"
+   "250-SIZE 35882577\r\n"
+   "250-8BITMIME\r\n"
+   "250-STARTTLS\r\n"
+   "250-ENHANCEDSTATUSCODES\r\n"
+   "250-PIPELINING\r\n"
+   "250 SMTPUTF8\r\n",
+   "250 2.1.5 Recipient ok\r\n",
+   "550-5.1.1 The email account that you tried to reach does not exist.\r\n"
+   "550 5.1.1 Please try double-checking the recipient's email address.\r\n",
+   "354\r\n",
+   "221 2.0.0 closing connection\n",
+   "250-incomplete\r\n250 ",
+   "2x0 not a status code\r\n",
+   NULL
+};
+
+double elapsed_seconds(const struct timespec *start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/** The atoi() plus walk_status_reply() approach, for comparison. */
+int walk_reply(const char *buffer)
+{
+   const char *ptr = buffer;
+   const char *line;
+   int status, line_len, advance;
+   int lines = atoi(buffer) ? 0 : -1;
+
+   while (*ptr && (advance = walk_status_reply(ptr, &status, &line, &line_len)) > 0)
+   {
+      ptr += advance;
+      ++lines;
+   }
+
+   return lines;
+}
+
+/**
+ * Receive *reply_text* from a socket pair into a *buff_len* byte
+ * buffer, and report whether it parsed with the *expected* code and
+ * truncation.
+ */
+int test_recv_reply(const char *label, const char *reply_text, int buff_len, int expected, int expect_truncated)
+{
+   STalker talker;
+   STReplies replies;
+   char reply_buffer[256];
+   char buffer[1024];
+   SMTPReply reply;
+   int pair[2];
+   int result, passed;
+
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+   {
+      perror("socketpair");
+      return 0;
+   }
+
+   init_sock_talker(&talker, &pair[0]);
+   stk_attach_replies(&talker, &replies, reply_buffer, sizeof(reply_buffer));
+
+   write(pair[1], reply_text, strlen(reply_text));
+   write(pair[1], "221 Bye\r\n", 9);
+
+   result = smtp_recv_reply(&talker, &reply, buffer, buff_len);
+   passed = result == expected && reply.truncated == expect_truncated;
+
+   // The next reply must be intact:
+   passed = passed && smtp_recv_reply(&talker, &reply, buffer, buff_len) == 221;
+
+   printf("%-32s %s\n", label, passed ? "[32;1mpassed[m" : "[31;1mFAILED[m");
+
+   close(pair[0]);
+   close(pair[1]);
+   return passed;
+}
+
+int main(int argc, const char **argv)
+{
+   const char **sample;
+   SMTPReply reply;
+   struct timespec start;
+   double secs;
+   long index, lines = 0;
+   int result;
+   long total_len = 0;
+
+   for (sample = samples; *sample; ++sample)
+   {
+      result = smtp_parse_reply(&reply, *sample, strlen(*sample));
+      if (result > 0)
+         smtp_dump_reply(&reply);
+      else
+         printf("[33;1m%s[m parsing \"%s\"\n", result ? "Malformed" : "Incomplete", *sample);
+   }
+
+   // Benchmark with the EHLO reply, which has the most lines:
+   const char *ehlo = samples[1];
+   int ehlo_len = strlen(ehlo);
+
+   // A reply longer than the caller's buffer, then one longer than the
+   // 256 byte receive buffer as well:
+   char long_reply[1024];
+   strcpy(long_reply, ehlo);
+   memcpy(long_reply + ehlo_len - 14, "250-SMTPUTF8\r\n", 14);
+   for (index = 0; index < 20; ++index)
+      strcat(long_reply, "250-X-EXTENSION-OF-SOME-LENGTH\r\n");
+   strcat(long_reply, "250 DSN\r\n");
+
+   putchar('\n');
+   if (!test_recv_reply("reply that fits", ehlo, 1024, 250, 0)
+       || !test_recv_reply("reply longer than the buffer", ehlo, 40, 250, 1)
+       || !test_recv_reply("reply longer than both buffers", long_reply, 1024, 250, 1))
+      return 1;
+
+   char first_block[512];
+   MTKArena arena;
+   arena_init(&arena, first_block, sizeof(first_block));
+
+   smtp_parse_reply(&reply, ehlo, ehlo_len);
+   const Status_Line *chain = smtp_reply_status_chain(&reply, &arena);
+   printf("\nStatus chain %s PIPELINING:\n", seek_status_message(chain, "pipelining") ? "has" : "lacks");
+   show_status_chain(chain);
+   arena_release(&arena);
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (index = 0; index < BENCH_REPLIES; ++index)
+   {
+      total_len += smtp_parse_reply(&reply, ehlo, ehlo_len);
+      lines += reply.line_count;
+   }
+   secs = elapsed_seconds(&start);
+   printf("\nsmtp_parse_reply:   %8.1f MB/s, %6.1f ns/reply (%ld lines)\n",
+          (double)total_len / secs / (1024 * 1024),
+          secs * 1e9 / BENCH_REPLIES,
+          lines);
+
+   lines = 0;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (index = 0; index < BENCH_REPLIES; ++index)
+      lines += walk_reply(ehlo);
+   secs = elapsed_seconds(&start);
+   printf("walk_status_reply:  %8.1f MB/s, %6.1f ns/reply (%ld lines)\n",
+          (double)ehlo_len * BENCH_REPLIES / secs / (1024 * 1024),
+          secs * 1e9 / BENCH_REPLIES,
+          lines);
+
+   return 0;
+}
+
+#endif
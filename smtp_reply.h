@@ -0,0 +1,95 @@
+#ifndef SMTP_REPLY_H
+#define SMTP_REPLY_H
+
+#include "socktalk.h"
+#include "arena.h"
+
+// Number of reply lines whose text is saved in an SMTPReply
+#define SMTP_REPLY_MAX_LINES 32
+
+/**
+ * @brief Text of one line of an SMTP reply, after the status codes.
+ *
+ * Points into the parsed buffer, and is not NULL-terminated.
+ */
+typedef struct _smtp_reply_text
+{
+   const char *text;
+   int        text_len;
+} SMTPReplyText;
+
+/**
+ * @brief A parsed SMTP reply, meant to be declared on the stack.
+ *
+ * The text spans point into the buffer that was parsed, so they are
+ * only valid while the buffer is unchanged.
+ */
+typedef struct _smtp_reply
+{
+   int code;                 // basic status code, like 250
+   int enh_class;            // RFC 3463 enhanced status code class.subject.detail,
+   int enh_subject;          // like 2.1.5, taken from the first line, or 0.0.0
+   int enh_detail;           // if the reply has none
+   int line_count;           // lines in the reply, which may exceed SMTP_REPLY_MAX_LINES
+   int reply_len;            // bytes parsed, including the last line ending
+   int truncated;            // the reply did not fit the buffer, which holds its first lines
+   SMTPReplyText lines[SMTP_REPLY_MAX_LINES];
+} SMTPReply;
+
+/**
+ * @brief Parse the first complete reply in *data*, of one or more lines.
+ *
+ * The data need not be NULL-terminated, and nothing is copied.  The
+ * enhanced status code, if any, is removed from the text of each line.
+ *
+ * @return The number of bytes parsed, 0 if the data ends before the
+ *         reply does, or -1 if a line does not start with a status code.
+ */
+int smtp_parse_reply(SMTPReply *reply, const char *data, int data_len);
+
+/**
+ * @brief Receive a reply with stk_recv_reply() and parse it.
+ *
+ * *buffer* receives the reply text, and the spans in *reply* point into it.
+ * A reply too long for *buffer*, or for the talker's receive buffer, is
+ * parsed as far as it was kept, with *reply->truncated* set.
+ *
+ * @return The reply code, or 0 if nothing was received or the reply
+ *         could not be parsed.  A non-blocking talker may also return
+ *         STK_WANT_READ or STK_WANT_WRITE before the reply is complete.
+ */
+int smtp_recv_reply(const STalker *talker, SMTPReply *reply, char *buffer, int buff_len);
+
+/**
+ * @brief Send a NULL-terminated list of strings as one line, and
+ *        receive and parse the reply.
+ *
+ * @return The reply code, or 0 for failure.
+ */
+int smtp_command(const STalker *talker, SMTPReply *reply, char *buffer, int buff_len, ...);
+
+/** Send text like stk_send_line(), then read the reply and log it if it's an error. */
+int stk_send_recv_line(const STalker *talker, ...);
+
+static inline int smtp_reply_positive(const SMTPReply *reply)     { return reply->code / 100 == 2; }
+static inline int smtp_reply_intermediate(const SMTPReply *reply) { return reply->code / 100 == 3; }
+static inline int smtp_reply_transient(const SMTPReply *reply)    { return reply->code / 100 == 4; }
+static inline int smtp_reply_permanent(const SMTPReply *reply)    { return reply->code / 100 == 5; }
+static inline int smtp_reply_has_enhanced(const SMTPReply *reply) { return reply->enh_class != 0; }
+
+/**
+ * @brief Build a Status_Line chain from the lines of *reply*, for
+ *        seek_status_message() and show_status_chain().
+ *
+ * The links and messages are allocated from *arena*.
+ *
+ * @return The head of the chain, or NULL if the arena ran out of memory.
+ */
+Status_Line *smtp_reply_status_chain(const SMTPReply *reply, MTKArena *arena);
+
+/** Print the reply to stderr, if it's an error reply.  Returns 1 if it was. */
+int smtp_log_reply_error(const SMTPReply *reply, const char *command);
+
+void smtp_dump_reply(const SMTPReply *reply);
+
+#endif
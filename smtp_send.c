@@ -1,4 +1,4 @@
-// -*- compile-command: "base=smtp_send; gcc -Wall -Werror -ggdb -DDEBUG -o $base ${base}.c -Wl,-R,. libmailtk.so" -*-
+// -*- compile-command: "base=smtp_send; gcc -Wall -Werror -ggdb -DDEBUG -D_GNU_SOURCE -o $base ${base}.c -Wl,-R,. libmailtk.so" -*-
 
 #include "mailtk.h"
 
@@ -10,6 +10,7 @@ typedef struct _smtp_email_sack
    SMTPCaps    scaps;
    STalker     *stalker;
    LineDrop    *linedrop;
+   MTKArena    *arena;       // for data kept while sending one message
 } EmailSack;
 
 typedef struct _my_data
@@ -45,8 +46,9 @@ void send_email(void *emailsack)
    EmailSack *es = (EmailSack*)emailsack;
 
    LineDrop *ld = es->linedrop;
-   const char *line;
-   int line_len;
+
+   char data_buffer[SMTP_DATA_CHUNK];
+   DataEncoder de;
 
    // Replace break_check to stop breaking on empty lines
    // and start breaking on a new character the marks the
@@ -65,11 +67,14 @@ void send_email(void *emailsack)
       es->stalker = &stdout_talker;
    }
 
-   do
-   {
-      DropGetLine(ld, &line, &line_len);
-      stk_simple_send_line(es->stalker, line, line_len);
-   } while (DropAdvance(ld));
+   // Dot-stuff, fix line endings, and send in large pieces,
+   // finishing with the line that ends the DATA phase:
+   data_encoder_init(&de, es->stalker, data_buffer, sizeof(data_buffer));
+   data_encoder_put_lines(&de, ld);
+
+   // Let the end of the message go out without waiting for more:
+   stk_set_more(es->stalker, 0);
+   data_encoder_finish(&de);
 
    if (write_to_stdout)
       es->stalker = old_talker;
@@ -82,7 +87,7 @@ void send_preamble(RecipLink *rchain, void *data)
 {
    EmailSack *es = (EmailSack*)data;
    char buffer[1024];  // for reading response to DATA line
-   int reply_status, bytes_received;
+   SMTPReply reply;
 
    // Count is the number of email addresses accepted by
    // the SMTP server.  There is no point in continuing
@@ -95,16 +100,17 @@ void send_preamble(RecipLink *rchain, void *data)
 
    if (count)
    {
-      stk_simple_send_line(es->stalker, "DATA", 4);
-      bytes_received = stk_recv_line(es->stalker, buffer, sizeof(buffer));
-      reply_status = atoi(buffer);
+      smtp_command(es->stalker, &reply, buffer, sizeof(buffer), "DATA", NULL);
 
-      if (reply_status >=300 && reply_status < 400)
+      if (smtp_reply_intermediate(&reply))
       {
          LineDrop *ld = es->linedrop;
          // Advance past recipients break line
          if (DropAdvance(ld))
          {
+            // Headers and body follow each other without replies,
+            // so let the socket fill its packets:
+            stk_set_more(es->stalker, 1);
             smtp_send_headers(es->linedrop, es->stalker, rchain);
 
             // Advance past headers break line
@@ -112,26 +118,20 @@ void send_preamble(RecipLink *rchain, void *data)
             {
                send_email(es);
 
-               stk_send_line(es->stalker, ".", NULL);
-               stk_send_line(es->stalker, NULL);
-
-               bytes_received = stk_recv_line(es->stalker, buffer, sizeof(buffer));
-               buffer[bytes_received] = '\0';
-
-               reply_status = atoi(buffer);
-               fprintf(stderr,
-                       "Result of sending email is %d, [33;1m%s[m\n",
-                       reply_status,
-                       buffer);
-               
+               smtp_recv_reply(es->stalker, &reply, buffer, sizeof(buffer));
+               if (!smtp_log_reply_error(&reply, "Sending email"))
+                  fprintf(stderr,
+                          "Result of sending email is %d, [33;1m%.*s[m\n",
+                          reply.code,
+                          reply.lines[0].text_len,
+                          reply.lines[0].text);
             }
+
+            stk_set_more(es->stalker, 0);
          }
       }
       else
-         fprintf(stderr,
-                 "DATA message returned an error (%d): [33;1m%s[m.\n",
-                 reply_status,
-                 buffer);
+         smtp_log_reply_error(&reply, "DATA");
    }
    else
       printf("The SMTP server is not prepared to accept any addresses.\n");
@@ -139,11 +139,33 @@ void send_preamble(RecipLink *rchain, void *data)
 
 void process_emails(STalker *stalker, void *emailsack)
 {
-   // Save settled-on stalker object to the EmailSack object:
    EmailSack *es = (EmailSack*)emailsack;
+
+   // Collect commands and headers into larger writes.  The
+   // buffer is flushed whenever a reply is read.
+   char     out_buffer[STK_BUFFER_SIZE];
+   STBuffer stb;
+   STalker  buffered_talker;
+   init_buffered_talker(&buffered_talker, &stb, stalker, out_buffer, sizeof(out_buffer));
+
+   // Recipient links and other per-message data come from the arena,
+   // which is reset after each message and released with the connection:
+   char     arena_block[4096];
+   MTKArena arena;
+   arena_init(&arena, arena_block, sizeof(arena_block));
+   es->arena = &arena;
+
+   // Save settled-on stalker object to the EmailSack object:
+   es->stalker = &buffered_talker;
+
+   build_recip_chain_in_arena(es->arena, send_preamble, es->linedrop, emailsack);
+   arena_reset(es->arena);
+
+   stk_flush(&buffered_talker);
    es->stalker = stalker;
 
-   build_recip_chain(send_preamble, es->linedrop, emailsack);
+   arena_release(&arena);
+   es->arena = NULL;
 }
 
 void smtp_tls_stalker_user(STalker *stalker, void *emailsack)
@@ -152,7 +174,7 @@ void smtp_tls_stalker_user(STalker *stalker, void *emailsack)
    ServerCreds *sc = &es->sc;
 
    SMTPError serror;
-   if (greet_smtp_server(sc->host_url, stalker, &es->scaps))
+   if (ehlo_smtp_server(sc->host_url, stalker, &es->scaps))
    {
       if (cget_auth_login(&es->scaps))
       {
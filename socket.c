@@ -6,14 +6,17 @@
 #include <netdb.h>       // For getaddrinfo() and supporting structures
 #include <arpa/inet.h>   // Functions that convert addrinfo member values.
 #include <unistd.h>      // for close() function
+#include <stdlib.h>      // for qsort()
+#include <time.h>        // for clock_gettime()
+#include <pthread.h>     // for the lock on the connect records
 
-#include <fcntl.h>
-#include <sys/select.h>  // support controlable socket timeout.
 
 #include <assert.h>
 
 #include "socktalk.h"
 #include "socket.h"
+#include "uring.h"
+#include "resolve.h"
 #include "logging.h"
 
 int digits_in_base(int value, int base)
@@ -104,122 +107,447 @@ void log_ssl_error(const SSL *ssl, int return_value)
    }
 }
 
-MTK_ERROR open_socket_talker(const char *host_url, int host_port, void *data, talker_user callback)
+static FILE *stats_dump_target = NULL;
+
+void set_talker_stats_dump(FILE *target)
+{
+   stats_dump_target = target;
+}
+
+static int ktls_requested = 0;
+
+void set_talker_ktls(int enable)
+{
+   ktls_requested = enable;
+}
+
+static Resolver *talker_resolver = NULL;
+
+void set_talker_resolver(Resolver *res)
+{
+   talker_resolver = res;
+}
+
+/***************************
+ * Happy Eyeballs connects
+ **************************/
+
+// RFC 8305 section 8: the Connection Attempt Delay, and the least
+// it may be shortened to when an address has connected quickly before
+#define CONNECT_ATTEMPT_DELAY_MS 250
+#define CONNECT_MIN_DELAY_MS     100
+
+#define CONNECT_TIMEOUT_MS       1000   // for each address
+#define CONNECT_MAX_ADDRESSES    16
+#define CONNECT_RECORD_COUNT     64
+
+/**
+ * What happened the last times an address was tried, so the next
+ * connect can start with the addresses that answered, and quickly.
+ */
+typedef struct _connect_record
+{
+   struct sockaddr_storage addr;
+   socklen_t               addr_len;
+   int                     latency_ms;    // smoothed connect time, -1 until one succeeds
+   int                     failures;      // failures since the last success
+   unsigned long long      used_ms;       // the least recently used record is replaced
+} ConnectRecord;
+
+static ConnectRecord connect_records[CONNECT_RECORD_COUNT];
+static pthread_mutex_t connect_records_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct _connect_attempt
+{
+   const struct addrinfo *ai;
+   int                   socket;
+   int                   order;         // position in the getaddrinfo() list
+   int                   rank;          // 0 connected before, 1 unknown, 2 failed last time
+   int                   latency_ms;
+   URingConn             conn;
+   unsigned long long    started_ms;
+   int                   done;
+} ConnectAttempt;
+
+static unsigned long long connect_now_ms(void)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+/** The record for *addr*, or NULL.  Call with connect_records_lock held. */
+static ConnectRecord *find_connect_record(const struct sockaddr *addr, socklen_t addr_len)
+{
+   int index;
+
+   for (index = 0; index < CONNECT_RECORD_COUNT; ++index)
+      if (connect_records[index].addr_len == addr_len
+          && memcmp(&connect_records[index].addr, addr, addr_len) == 0)
+         return &connect_records[index];
+
+   return NULL;
+}
+
+/** Note a connect to *addr* that took *latency_ms*, or failed if negative. */
+static void record_connect(const struct sockaddr *addr, socklen_t addr_len, int latency_ms)
+{
+   ConnectRecord *record, *oldest;
+   int index;
+
+   if (addr_len > sizeof(struct sockaddr_storage))
+      return;
+
+   pthread_mutex_lock(&connect_records_lock);
+
+   if (!(record = find_connect_record(addr, addr_len)))
+   {
+      oldest = &connect_records[0];
+      for (index = 1; index < CONNECT_RECORD_COUNT; ++index)
+         if (connect_records[index].used_ms < oldest->used_ms)
+            oldest = &connect_records[index];
+
+      record = oldest;
+      memset(record, 0, sizeof(ConnectRecord));
+      memcpy(&record->addr, addr, addr_len);
+      record->addr_len = addr_len;
+      record->latency_ms = -1;
+   }
+
+   record->used_ms = connect_now_ms();
+
+   if (latency_ms < 0)
+      ++record->failures;
+   else
+   {
+      record->failures = 0;
+      if (record->latency_ms < 0)
+         record->latency_ms = latency_ms;
+      else
+         record->latency_ms = (3 * record->latency_ms + latency_ms) / 4;
+   }
+
+   pthread_mutex_unlock(&connect_records_lock);
+}
+
+int get_connect_latency(const struct sockaddr *addr, socklen_t addr_len, int *failures)
+{
+   ConnectRecord *record;
+   int latency_ms = -1;
+
+   pthread_mutex_lock(&connect_records_lock);
+
+   if ((record = find_connect_record(addr, addr_len)))
+   {
+      latency_ms = record->latency_ms;
+      if (failures)
+         *failures = record->failures;
+   }
+   else if (failures)
+      *failures = 0;
+
+   pthread_mutex_unlock(&connect_records_lock);
+   return latency_ms;
+}
+
+static int compare_attempts(const void *left, const void *right)
+{
+   const ConnectAttempt *la = (const ConnectAttempt*)left;
+   const ConnectAttempt *ra = (const ConnectAttempt*)right;
+
+   if (la->rank != ra->rank)
+      return la->rank - ra->rank;
+   else if (la->rank == 0 && la->latency_ms != ra->latency_ms)
+      return la->latency_ms - ra->latency_ms;
+   else
+      // Otherwise keep getaddrinfo()'s order (RFC 6724):
+      return la->order - ra->order;
+}
+
+/**
+ * Fill *attempts* with the usable addresses of *ai_chain*, those that
+ * connected before first, fastest first, then alternating between
+ * address families (RFC 8305 section 4).
+ */
+static int order_attempts(ConnectAttempt *attempts, const struct addrinfo *ai_chain)
+{
+   ConnectAttempt sorted[CONNECT_MAX_ADDRESSES];
+   const struct addrinfo *ai;
+   int count = 0, failures, index, taken[CONNECT_MAX_ADDRESSES] = { 0 };
+   int out, family;
+
+   for (ai = ai_chain; ai && count < CONNECT_MAX_ADDRESSES; ai = ai->ai_next)
+   {
+      if ((ai->ai_family == PF_INET || ai->ai_family == PF_INET6)
+          && ai->ai_socktype == SOCK_STREAM
+          && ai->ai_protocol == IPPROTO_TCP)
+      {
+         memset(&sorted[count], 0, sizeof(ConnectAttempt));
+         sorted[count].ai = ai;
+         sorted[count].order = count;
+         sorted[count].socket = -1;
+         sorted[count].latency_ms = get_connect_latency(ai->ai_addr, ai->ai_addrlen, &failures);
+         sorted[count].rank = failures ? 2 : (sorted[count].latency_ms >= 0 ? 0 : 1);
+         ++count;
+      }
+   }
+
+   qsort(sorted, count, sizeof(ConnectAttempt), compare_attempts);
+
+   // Take the next address of the other family when there is one:
+   family = count ? sorted[0].ai->ai_family : 0;
+   for (out = 0; out < count; ++out)
+   {
+      for (index = 0; index < count && (taken[index] || sorted[index].ai->ai_family != family); ++index)
+         ;
+      if (index == count)
+         for (index = 0; taken[index]; ++index)
+            ;
+
+      taken[index] = 1;
+      attempts[out] = sorted[index];
+      family = sorted[index].ai->ai_family == PF_INET ? PF_INET6 : PF_INET;
+   }
+
+   return count;
+}
+
+/**
+ * Start connecting to the next address.
+ *
+ * @return 1 if the attempt is under way or connected, 0 if it failed at once.
+ */
+static int start_attempt(URing *ur, ConnectAttempt *attempt)
+{
+   const struct addrinfo *ai = attempt->ai;
+
+   attempt->started_ms = connect_now_ms();
+
+   if ((attempt->socket = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+      return 0;
+
+   if (!init_uring_conn(&attempt->conn, ur, attempt->socket))
+      return 0;
+
+   return uring_start_connect(&attempt->conn, ai->ai_addr, ai->ai_addrlen, CONNECT_TIMEOUT_MS);
+}
+
+/** How long to wait for an attempt before starting the next one. */
+static int attempt_delay(const ConnectAttempt *attempt)
+{
+   int delay = 2 * attempt->latency_ms;
+
+   if (attempt->rank != 0 || delay > CONNECT_ATTEMPT_DELAY_MS)
+      return CONNECT_ATTEMPT_DELAY_MS;
+   else
+      return delay < CONNECT_MIN_DELAY_MS ? CONNECT_MIN_DELAY_MS : delay;
+}
+
+int connect_to_addresses(const struct addrinfo *ai_chain)
+{
+   ConnectAttempt attempts[CONNECT_MAX_ADDRESSES];
+   ConnectAttempt *attempt;
+   URing ur;
+   unsigned long long now, next_start, deadline;
+   int count, started = 0, active = 0, winner = -1;
+   int index, last_error = EHOSTUNREACH;
+
+   if (!(count = order_attempts(attempts, ai_chain)))
+   {
+      errno = EAFNOSUPPORT;
+      return -1;
+   }
+
+   if (!uring_init(&ur, count))
+      return -1;
+
+   next_start = connect_now_ms();
+
+   for (;;)
+   {
+      now = connect_now_ms();
+
+      for (index = 0; index < started && winner < 0; ++index)
+      {
+         attempt = &attempts[index];
+         if (attempt->done)
+            continue;
+
+         if (attempt->conn.connect_status == 0)
+         {
+            winner = index;
+            record_connect(attempt->ai->ai_addr, attempt->ai->ai_addrlen, now - attempt->started_ms);
+         }
+         else if (attempt->conn.connect_status < 0 || now >= attempt->started_ms + CONNECT_TIMEOUT_MS)
+         {
+            last_error = attempt->conn.connect_status < 0 ? -attempt->conn.connect_status : ETIMEDOUT;
+            attempt->done = 1;
+            --active;
+            record_connect(attempt->ai->ai_addr, attempt->ai->ai_addrlen, -1);
+
+            // A failure lets the next address start right away:
+            next_start = now;
+         }
+      }
+
+      if (winner >= 0 || (started == count && active == 0))
+         break;
+
+      // Start the next address when its turn comes, or at once if
+      // nothing else is under way:
+      if (started < count && (now >= next_start || active == 0))
+      {
+         attempt = &attempts[started++];
+
+         if (start_attempt(&ur, attempt))
+         {
+            ++active;
+            next_start = now + attempt_delay(attempt);
+         }
+         else
+         {
+            last_error = errno;
+            attempt->done = 1;
+            record_connect(attempt->ai->ai_addr, attempt->ai->ai_addrlen, -1);
+         }
+
+         continue;
+      }
+
+      // Wait for a connect to finish, but only until the next start
+      // or until the oldest attempt's time runs out:
+      deadline = started < count ? next_start : now + CONNECT_TIMEOUT_MS;
+      for (index = 0; index < started; ++index)
+         if (!attempts[index].done && attempts[index].started_ms + CONNECT_TIMEOUT_MS < deadline)
+            deadline = attempts[index].started_ms + CONNECT_TIMEOUT_MS;
+
+      if (uring_wait_timeout(&ur, 1, deadline > now ? deadline - now : 0) < 0)
+      {
+         last_error = errno;
+         break;
+      }
+   }
+
+   // Abandon the slower connects:
+   for (index = 0; index < started; ++index)
+   {
+      attempt = &attempts[index];
+
+      if (attempt->conn.ur)
+         uring_conn_close(&attempt->conn);
+
+      if (index != winner && attempt->socket >= 0)
+         close(attempt->socket);
+   }
+
+   uring_close(&ur);
+
+   if (winner < 0)
+   {
+      errno = last_error;
+      return -1;
+   }
+
+   return attempts[winner].socket;
+}
+
+int connect_to_host(const char *host_url, int host_port, MTK_ERROR *error)
 {
    struct addrinfo hints;
-   struct addrinfo *ai_chain, *rp;
+   struct addrinfo *ai_chain = NULL;
+   ResolveResult *cached = NULL;
 
-   int open_socket = -1, temp_socket = -1;
+   int open_socket = -1;
 
    int port_buffer_len = digits_in_base(host_port, 10) + 1;
    char *port_buffer = (char*)alloca(port_buffer_len);
    if (!itoa_buff(host_port, 10, port_buffer, port_buffer_len))
-      return MTKE_INT_OVERFLOW;
+      *error = MTKE_INT_OVERFLOW;
    else
    {
+      // Both IPv4 and IPv6 addresses, to race against each other:
       memset((void*)&hints, 0, sizeof(struct addrinfo));
-      hints.ai_family = AF_INET;
+      hints.ai_family = AF_UNSPEC;
       hints.ai_socktype = SOCK_STREAM;
-      hints.ai_flags = AI_CANONNAME;
       hints.ai_protocol = IPPROTO_TCP;
 
-      if (getaddrinfo(host_url, port_buffer, &hints, &ai_chain))
-         return MTKE_UNKNOWN_HOST;
-      else
+      if (talker_resolver)
       {
-         rp = ai_chain;
+         if (resolver_lookup(talker_resolver, host_url, host_port, &cached) == 0)
+            ai_chain = cached->ai;
+      }
+      else if (getaddrinfo(host_url, port_buffer, &hints, &ai_chain))
+         ai_chain = NULL;
 
-         // Scan options until we successfully open a socket
-         while (rp)
+      if (!ai_chain)
+         *error = MTKE_UNKNOWN_HOST;
+      else
+      {
+         if ((open_socket = connect_to_addresses(ai_chain)) >= 0)
+            *error = MTKE_SUCCESS;
+         else
          {
-            if ((rp->ai_family == PF_INET || rp->ai_family == PF_INET6)
-                && rp->ai_socktype == SOCK_STREAM
-                && rp->ai_protocol == IPPROTO_TCP)
-            {
-               temp_socket = socket(rp->ai_family,
-                                    rp->ai_socktype,
-                                    rp->ai_protocol);
-               break;
-            }
-
-            rp = rp->ai_next;
+            int saved_errno = errno;
+            fprintf(stderr,
+                    "Failed to connect to url=\"%s\", port=%d: %s.\n",
+                    host_url,
+                    host_port,
+                    strerror(saved_errno));
+            *error = saved_errno == EAFNOSUPPORT ? MTKE_SOCKET_UNAVAILABLE : MTKE_CONNECTION_TIMEOUT;
          }
 
-         if (temp_socket < 0)
-            return MTKE_SOCKET_UNAVAILABLE;
+         // Clean up allocated memory
+         if (cached)
+            resolver_release(talker_resolver, cached);
          else
-         {
-            // Unblock connection to impose a time limit
-            int starting_options;
-            if ( ( (starting_options=fcntl(temp_socket, F_GETFL, NULL)) < 0 )
-                 || ( fcntl(temp_socket, F_SETFL, starting_options | O_NONBLOCK) < 0 ) )
-               return MTKE_UNBLOCKING_FAILURE;
-
-            // Two chances to connect, immediately, or during timed interval
-            if (connect(temp_socket, rp->ai_addr, rp->ai_addrlen) == 0)
-               open_socket = temp_socket;
-            else
-            {
-               // Refer to `man 2 lect_tut`
-               struct timeval timeout;
-               timeout.tv_sec = 1;
-               timeout.tv_usec = 0;
-
-               fd_set wait_set;
-               FD_ZERO(&wait_set);
-               FD_SET(temp_socket, &wait_set);
-
-               select(temp_socket+1, NULL, &wait_set, NULL, &timeout);
-
-               if (FD_ISSET(temp_socket, &wait_set))
-                  open_socket = temp_socket;
-               else
-               {
-                  fprintf(stderr, "Timeout expired for url=\"%s\", port=%d.\n", host_url, host_port);
-                  close(temp_socket);
-               }
-            }
+            freeaddrinfo(ai_chain);
+      }
+   }
 
-            // Unblock the socket for subsequent execution
-            fcntl(temp_socket, F_SETFL, starting_options); 
-         }
+   return open_socket;
+}
 
-         // Clean up allocated memory
-         freeaddrinfo(ai_chain);
-
-         // If successfully connected with an open socket, construct
-         // an STalker and use it to invoke the callback, closing the
-         // socket upon the callback's return.
-         if (open_socket < 0)
-            return MTKE_CONNECTION_TIMEOUT;
-         if (open_socket >= 0)
-         {
-            STalker talker;
-            memset(&talker, 0, sizeof(talker));
-            init_sock_talker(&talker, &open_socket);
+MTK_ERROR open_socket_talker(const char *host_url, int host_port, void *data, talker_user callback)
+{
+   MTK_ERROR error;
+   int open_socket = connect_to_host(host_url, host_port, &error);
 
-            (*callback)(&talker, data);
+   // If successfully connected with an open socket, construct
+   // an STalker and use it to invoke the callback, closing the
+   // socket upon the callback's return.
+   if (open_socket >= 0)
+   {
+      STalker talker;
+      STReplies replies;
+      STalkerStats stats;
+      char reply_buffer[STK_REPLY_BUFFER_SIZE];
 
-            close(open_socket);
-         }
-      }
+      memset(&talker, 0, sizeof(talker));
+      init_sock_talker(&talker, &open_socket);
+      stk_attach_replies(&talker, &replies, reply_buffer, sizeof(reply_buffer));
+      stk_attach_stats(&talker, &stats);
+
+      (*callback)(&talker, data);
+
+      if (stats_dump_target)
+         stk_dump_stats(&stats, host_url, stats_dump_target);
+
+      close(open_socket);
    }
 
-   return MTKE_SUCCESS;
+   return error;
 }
 
 /**
- * This function assumes that open_talker is a regular socket talker
- * because it will use the socket member to open SSL.
+ * @brief Make a client SSL context for one connection, logging the
+ *        reason if that fails.
+ *
+ * @return The new context, for SSL_CTX_free() when done, or NULL.
  */
-void open_ssl_talker(STalker *open_talker, void *data, talker_user callback)
+static SSL_CTX *new_client_ssl_context(void)
 {
    const SSL_METHOD *method;
    SSL_CTX *context;
-   SSL *ssl;
-   int connect_outcome;
-
-   assert(is_socket_talker(open_talker));
 
    OpenSSL_add_all_algorithms();
    /* err_load_bio_strings(); */
@@ -230,76 +558,204 @@ void open_ssl_talker(STalker *open_talker, void *data, talker_user callback)
    SSL_library_init();
 
    method = SSLv23_client_method();
-   if (method)
+   if (!method)
+      log_error_message(1, "Failed to find SSL client method.", NULL);
+   else if (!(context = SSL_CTX_new(method)))
+      log_error_message(1, "Failed to initiate an SSL context.", NULL);
+   else
    {
-      context = SSL_CTX_new(method);
+      // following two not included in most recent example code i found.
+      // it may be appropriate to uncomment these lines as i learn more.
+      // ssl_ctx_set_verify(context, ssl_verify_peer, null);
+      // ssl_ctx_set_verify_depth(context, 4);
+
+      // we could set some flags, but i'm not doing it until i need to and i understand 'em
+      /* const long ctx_flags = SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_COMPRESSION; */
+      /* SSL_CTX_set_options(context, ctx_flags); */
+      SSL_CTX_set_options(context, SSL_OP_NO_SSLv2);
 
-      if (context)
+      if (ktls_requested)
       {
-         // following two not included in most recent example code i found.
-         // it may be appropriate to uncomment these lines as i learn more.
-         // ssl_ctx_set_verify(context, ssl_verify_peer, null);
-         // ssl_ctx_set_verify_depth(context, 4);
-
-         // we could set some flags, but i'm not doing it until i need to and i understand 'em
-         /* const long ctx_flags = SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_COMPRESSION; */
-         /* SSL_CTX_set_options(context, ctx_flags); */
-         SSL_CTX_set_options(context, SSL_OP_NO_SSLv2);
-
-         ssl = SSL_new(context);
-         if (ssl)
-         {
-            SSL_set_fd(ssl, get_socket_handle(open_talker));
+#ifdef SSL_OP_ENABLE_KTLS
+         SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+#else
+         log_error_message(1, "kTLS was requested, but this OpenSSL cannot use it.", NULL);
+#endif
+      }
 
-            connect_outcome = SSL_connect(ssl);
+      return context;
+   }
 
-            if (connect_outcome == -1)
-            {
-               char msg[1024];
-               ERR_error_string_n(ERR_get_error(), msg, sizeof(msg));
-
-               fprintf(stderr, "msg: [32;1m%s[m, "
-                       "lib error: [32;1m%s[m, "
-                       "func error: [32;1m%s[m, "
-                       "reason: [32;1m%s[m, "
-                       "verify result: [32;1m%ld[m\n",
-                       msg,
-                       ERR_lib_error_string(0),
-                       ERR_func_error_string(0),
-                       ERR_reason_error_string(0),
-                       SSL_get_verify_result(ssl));
-            }
+   return NULL;
+}
 
+/**
+ * @brief Print the OpenSSL error queue's account of a failed handshake.
+ */
+static void log_ssl_connect_failure(const SSL *ssl)
+{
+   char msg[1024];
+   ERR_error_string_n(ERR_get_error(), msg, sizeof(msg));
+
+   fprintf(stderr, "msg: [32;1m%s[m, "
+           "lib error: [32;1m%s[m, "
+           "func error: [32;1m%s[m, "
+           "reason: [32;1m%s[m, "
+           "verify result: [32;1m%ld[m\n",
+           msg,
+           ERR_lib_error_string(0),
+           ERR_func_error_string(0),
+           ERR_reason_error_string(0),
+           SSL_get_verify_result(ssl));
+}
 
-            if (connect_outcome == 1)
-            {
-               STalker ssl_talker;
-               init_ssl_talker(&ssl_talker, ssl);
+SSL *start_ssl_session(STalker *open_talker)
+{
+   SSL_CTX *context;
+   SSL *ssl;
+   int connect_outcome;
 
-               (*callback)(&ssl_talker, data);
-            }
-            else if (connect_outcome == 0)
-            {
-               // failed with controlled shutdown
-               log_ssl_error(ssl, connect_outcome);
-            }
-            else
+   assert(is_socket_talker(open_talker));
+
+   // Plaintext that arrived after the STARTTLS reply may have been
+   // injected, so it must not be read as part of the TLS session:
+   if (stk_discard_received(open_talker))
+      log_error_message(1, "Discarded plaintext received before the TLS handshake.", NULL);
+
+   if (!(context = new_client_ssl_context()))
+      return NULL;
+
+   // The session keeps its own reference to the context:
+   ssl = SSL_new(context);
+   SSL_CTX_free(context);
+
+   if (!ssl)
+   {
+      log_error_message(1, "Failed to create a new SSL instance.", NULL);
+      return NULL;
+   }
+
+   SSL_set_fd(ssl, get_socket_handle(open_talker));
+
+   connect_outcome = SSL_connect(ssl);
+
+   if (connect_outcome == 1)
+   {
+#ifdef SSL_OP_ENABLE_KTLS
+      // OpenSSL quietly keeps encrypting if the kernel refuses the cipher:
+      if (ktls_requested && !BIO_get_ktls_send(SSL_get_wbio(ssl)))
+         log_error_message(0, "kTLS was requested, but the kernel is not encrypting.", NULL);
+#endif
+
+      return ssl;
+   }
+
+   if (connect_outcome == -1)
+      log_ssl_connect_failure(ssl);
+
+   // 0 is a failure with controlled shutdown
+   log_ssl_error(ssl, connect_outcome);
+
+   SSL_free(ssl);
+   return NULL;
+}
+
+/**
+ * This function assumes that open_talker is a regular socket talker
+ * because it will use the socket member to open SSL.
+ */
+void open_ssl_talker(STalker *open_talker, void *data, talker_user callback)
+{
+   SSL *ssl = start_ssl_session(open_talker);
+
+   if (ssl)
+   {
+      STalker ssl_talker;
+      STReplies replies;
+      STalkerStats stats;
+      char reply_buffer[STK_REPLY_BUFFER_SIZE];
+
+      init_ssl_talker(&ssl_talker, ssl);
+      stk_attach_replies(&ssl_talker, &replies, reply_buffer, sizeof(reply_buffer));
+      stk_attach_stats(&ssl_talker, &stats);
+
+      (*callback)(&ssl_talker, data);
+
+      if (stats_dump_target)
+      {
+         stk_dump_stats(&stats, "TLS", stats_dump_target);
+         if (ktls_requested)
+            fprintf(stats_dump_target,
+                    "TLS: kTLS send %s, receive %s\n",
+                    stk_ktls_send(&ssl_talker) ? "on" : "off",
+                    stk_ktls_recv(&ssl_talker) ? "on" : "off");
+      }
+
+      SSL_free(ssl);
+   }
+}
+
+/**
+ * Like open_ssl_talker(), but with OpenSSL working on memory BIOs, so
+ * the records of consecutive writes can be sent together (see
+ * STMemTLS), and time spent encrypting is reported apart from time
+ * spent sending.
+ */
+void open_mem_tls_talker(STalker *open_talker, void *data, talker_user callback)
+{
+   SSL_CTX *context;
+   SSL *ssl;
+
+   assert(is_socket_talker(open_talker));
+
+   if (stk_discard_received(open_talker))
+      log_error_message(1, "Discarded plaintext received before the TLS handshake.", NULL);
+
+   if (!(context = new_client_ssl_context()))
+      return;
+
+   ssl = SSL_new(context);
+   if (ssl)
+   {
+      STalker tls_talker;
+      STMemTLS mt;
+
+      if (!init_mem_tls_talker(&tls_talker, &mt, ssl, stk_base_talker(open_talker)))
+         log_error_message(1, "Failed to create the TLS BIO pair.", NULL);
+      else
+      {
+         if (stk_mem_tls_handshake(&tls_talker) == 1)
+         {
+            STReplies replies;
+            STalkerStats stats;
+            char reply_buffer[STK_REPLY_BUFFER_SIZE];
+
+            stk_attach_replies(&tls_talker, &replies, reply_buffer, sizeof(reply_buffer));
+            stk_attach_stats(&tls_talker, &stats);
+
+            (*callback)(&tls_talker, data);
+
+            if (stats_dump_target)
             {
-               log_ssl_error(ssl, connect_outcome);
+               stk_dump_stats(&stats, "TLS", stats_dump_target);
+               stk_dump_mem_tls(&mt, "TLS", stats_dump_target);
             }
-
-            SSL_free(ssl);
          }
          else
-            log_error_message(1, "Failed to create a new SSL instance.", NULL);
+         {
+            log_ssl_connect_failure(ssl);
+            log_error_message(1, "TLS handshake failed.", NULL);
+         }
 
-         SSL_CTX_free(context);
+         mem_tls_close(&mt);
       }
-      else
-         log_error_message(1, "Failed to initiate an SSL context.", NULL);
+
+      SSL_free(ssl);
    }
    else
-      log_error_message(1, "Failed to find SSL client method.", NULL);
+      log_error_message(1, "Failed to create a new SSL instance.", NULL);
+
+   SSL_CTX_free(context);
 }
 
 /**
@@ -545,6 +1001,8 @@ void open_ssl_talker(STalker *open_talker, void *data, talker_user callback)
 #ifdef SOCKET_MAIN
 
 #include "socktalk.c"
+#include "uring.c"
+#include "resolve.c"
 #include "logging.c"
 
 void use_the_talker(STalker *talker, void *data)
@@ -557,8 +1015,239 @@ void use_the_talker(STalker *talker, void *data)
    printf("Result of EHLO is [34;1m%s[m\n", buffer);
 }
 
+/** Listen on *ip*, setting *port* to the port chosen. */
+int listen_on(const char *ip, int family, int backlog, int *port)
+{
+   struct sockaddr_storage addr;
+   socklen_t addr_len = sizeof(addr);
+   int listener = socket(family, SOCK_STREAM, 0);
+
+   memset(&addr, 0, sizeof(addr));
+   addr.ss_family = family;
+   if (family == AF_INET)
+      inet_pton(AF_INET, ip, &((struct sockaddr_in*)&addr)->sin_addr);
+   else
+      inet_pton(AF_INET6, ip, &((struct sockaddr_in6*)&addr)->sin6_addr);
+
+   if (listener < 0
+       || bind(listener, (struct sockaddr*)&addr, family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6))
+       || listen(listener, backlog)
+       || getsockname(listener, (struct sockaddr*)&addr, &addr_len))
+   {
+      if (listener >= 0)
+         close(listener);
+      return -1;
+   }
+
+   *port = ntohs(((struct sockaddr_in*)&addr)->sin_port);
+   return listener;
+}
+
+/**
+ * Fill the accept queue of *listener*, so further connects to it get
+ * no answer, like a host that is down.  The filler sockets are left open.
+ */
+void stall_listener(const struct sockaddr *addr, socklen_t addr_len)
+{
+   int index, fd;
+
+   for (index = 0; index < 4; ++index)
+   {
+      fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      connect(fd, addr, addr_len);
+   }
+   usleep(20 * 1000);
+}
+
+typedef struct _test_address
+{
+   struct addrinfo         ai;
+   struct sockaddr_storage addr;
+} TestAddress;
+
+void make_address(TestAddress *ta, const char *ip, int port, TestAddress *next)
+{
+   memset(ta, 0, sizeof(TestAddress));
+
+   if (strchr(ip, ':'))
+   {
+      struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&ta->addr;
+      sin6->sin6_family = AF_INET6;
+      sin6->sin6_port = htons(port);
+      inet_pton(AF_INET6, ip, &sin6->sin6_addr);
+      ta->ai.ai_addrlen = sizeof(struct sockaddr_in6);
+   }
+   else
+   {
+      struct sockaddr_in *sin = (struct sockaddr_in*)&ta->addr;
+      sin->sin_family = AF_INET;
+      sin->sin_port = htons(port);
+      inet_pton(AF_INET, ip, &sin->sin_addr);
+      ta->ai.ai_addrlen = sizeof(struct sockaddr_in);
+   }
+
+   ta->ai.ai_family = ta->addr.ss_family;
+   ta->ai.ai_socktype = SOCK_STREAM;
+   ta->ai.ai_protocol = IPPROTO_TCP;
+   ta->ai.ai_addr = (struct sockaddr*)&ta->addr;
+   ta->ai.ai_next = next ? &next->ai : NULL;
+}
+
+/**
+ * Connect to *chain*, expecting to reach *expected* (NULL for a
+ * failure) in about *expected_ms*.
+ */
+int race(const char *label, TestAddress *chain, const TestAddress *expected, int expected_ms)
+{
+   struct sockaddr_storage peer;
+   socklen_t peer_len = sizeof(peer);
+   struct timespec start, end;
+   char name[INET6_ADDRSTRLEN];
+   int fd, elapsed_ms, ok;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   fd = connect_to_addresses(&chain->ai);
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+
+   if (fd >= 0)
+   {
+      getpeername(fd, (struct sockaddr*)&peer, &peer_len);
+      if (peer.ss_family == AF_INET)
+         inet_ntop(AF_INET, &((struct sockaddr_in*)&peer)->sin_addr, name, sizeof(name));
+      else
+         inet_ntop(AF_INET6, &((struct sockaddr_in6*)&peer)->sin6_addr, name, sizeof(name));
+
+      ok = expected && peer_len == expected->ai.ai_addrlen && memcmp(&peer, &expected->addr, peer_len) == 0;
+      close(fd);
+   }
+   else
+   {
+      snprintf(name, sizeof(name), "%s", strerror(errno));
+      ok = !expected;
+   }
+
+   ok = ok && elapsed_ms >= expected_ms - 20 && elapsed_ms <= expected_ms + 100;
+
+   printf("%-34s %4d ms, %s%s\n", label, elapsed_ms, name, ok ? "" : "  [31;1mFAILED[m");
+   return ok;
+}
+
+int test_happy_eyeballs(void)
+{
+   TestAddress down, down6, refused, good, other_good, good6, down_again, unreachable, fresh;
+   int good_port, other_port, down_port, refused_port, good6_port, fresh_port;
+   int good_listener, other_listener, down_listener, refused_listener, good6_listener, fresh_listener;
+   int ok = 1, failures;
+
+   if ((good_listener = listen_on("127.0.0.1", AF_INET, 16, &good_port)) < 0
+       || (other_listener = listen_on("127.0.0.4", AF_INET, 16, &other_port)) < 0
+       || (down_listener = listen_on("127.0.0.2", AF_INET, 0, &down_port)) < 0
+       || (refused_listener = listen_on("127.0.0.3", AF_INET, 0, &refused_port)) < 0
+       || (fresh_listener = listen_on("127.0.0.5", AF_INET, 16, &fresh_port)) < 0)
+   {
+      perror("listeners");
+      return 0;
+   }
+
+   // Nothing listens on a closed listener's port:
+   close(refused_listener);
+
+   make_address(&good, "127.0.0.1", good_port, NULL);
+   make_address(&other_good, "127.0.0.4", other_port, NULL);
+   make_address(&down, "127.0.0.2", down_port, &other_good);
+   make_address(&refused, "127.0.0.3", refused_port, &good);
+   make_address(&fresh, "127.0.0.5", fresh_port, NULL);
+   make_address(&unreachable, "255.255.255.255", fresh_port, &fresh);
+   stall_listener(down.ai.ai_addr, down.ai.ai_addrlen);
+
+   printf("Happy Eyeballs connects:\n");
+
+   ok &= race("Refused, then good: at once", &refused, &good, 0);
+
+   // connect() fails at once, which must not win the race with an
+   // unconnected socket.  Neither address has a record, so the
+   // unreachable one goes first.
+   ok &= race("Unreachable, then good: at once", &unreachable, &fresh, 0);
+   ok &= race("Down, then good: after one delay", &down, &other_good, CONNECT_ATTEMPT_DELAY_MS);
+
+   // The good address connected before, so it goes first:
+   ok &= race("Down, then good, again: at once", &down, &other_good, 0);
+
+   make_address(&refused, "127.0.0.3", refused_port, NULL);
+   ok &= race("Refused only: fails at once", &refused, NULL, 0);
+
+   if (get_connect_latency(refused.ai.ai_addr, refused.ai.ai_addrlen, &failures) != -1 || failures != 2)
+   {
+      printf("[31;1mThe refused address has %d failures recorded.[m\n", failures);
+      ok = 0;
+   }
+
+   // With IPv6, the families alternate: down (v4), good (v6), then down again (v4).
+   // The down address has no record, as its connects were abandoned.
+   if ((good6_listener = listen_on("::1", AF_INET6, 16, &good6_port)) >= 0)
+   {
+      make_address(&good6, "::1", good6_port, NULL);
+      make_address(&down_again, "127.0.0.2", down_port, &good6);
+      make_address(&down6, "127.0.0.2", down_port, &down_again);
+
+      ok &= race("Down, down, IPv6 good: one delay", &down6, &good6, CONNECT_ATTEMPT_DELAY_MS);
+      close(good6_listener);
+   }
+   else
+      printf("No IPv6 loopback, so the interleaving is not tested.\n");
+
+   close(good_listener);
+   close(other_listener);
+   close(fresh_listener);
+   close(down_listener);
+   return ok;
+}
+
+/** Connect to localhost twice through a resolver, which should look it up once. */
+int test_cached_connects(void)
+{
+   Resolver res;
+   MTK_ERROR error;
+   int listener, port, index, fd;
+   int ok = 1;
+
+   if ((listener = listen_on("127.0.0.1", AF_INET, 16, &port)) < 0
+       || !resolver_init(&res, 0, RESOLVER_TTL_MS, RESOLVER_NEGATIVE_MS))
+   {
+      perror("resolver test");
+      return 0;
+   }
+
+   set_talker_resolver(&res);
+
+   for (index = 0; index < 2; ++index)
+   {
+      if ((fd = connect_to_host("localhost", port, &error)) >= 0)
+         close(fd);
+      else
+         ok = 0;
+   }
+
+   if (connect_to_host("nowhere.invalid", port, &error) >= 0 || error != MTKE_UNKNOWN_HOST)
+      ok = 0;
+
+   ok = ok && res.lookups == 2 && res.hits == 1;
+
+   printf("Cached connects: %s\n", ok ? "localhost looked up once" : "[31;1mFAILED[m");
+   resolver_dump(&res, stdout);
+
+   set_talker_resolver(NULL);
+   resolver_close(&res);
+   close(listener);
+   return ok;
+}
+
 int main(int argc, const char **argv)
 {
+   if (!test_happy_eyeballs() || !test_cached_connects())
+      return 1;
+
    const char *host_url = "smtp.gmail.com";
    int host_port = 587;
    
@@ -578,5 +1267,5 @@ int main(int argc, const char **argv)
 
 
 /* Local Variables: */
-/* compile-command: "base=socket; gcc -Wall -Werror -ggdb -DSOCKET_MAIN -DDEBUG  -o $base ${base}.c -lssl -lcrypto" */
+/* compile-command: "base=socket; gcc -Wall -Werror -ggdb -DSOCKET_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c -lssl -lcrypto" */
 /* End: */
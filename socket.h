@@ -1,7 +1,9 @@
 #ifndef SOCKET_H
 #define SOCKET_H
 
+#include <netdb.h>      // for struct addrinfo
 #include "socktalk.h"
+#include "resolve.h"
 
 typedef enum _mtk_socket_error
 {
@@ -18,6 +20,85 @@ typedef void (*talker_user)(STalker *talker, void *data);
 MTK_ERROR open_socket_talker(const char *host_url, int host_port, void *data, talker_user callback);
 void open_ssl_talker(STalker *open_talker, void *data, talker_user callback);
 
+/**
+ * @brief Connect a TCP socket to *host_url* at *host_port*, for a
+ *        connection that outlives any one callback.
+ *
+ * Every IPv4 and IPv6 address of the host may be tried, with
+ * connect_to_addresses().
+ *
+ * @return The connected socket, for the caller to close, or -1 with
+ *         the reason in *error*.
+ */
+int connect_to_host(const char *host_url, int host_port, MTK_ERROR *error);
+
+/**
+ * @brief Connect to whichever address of *ai_chain* answers first,
+ *        racing IPv4 and IPv6 as RFC 8305 (Happy Eyeballs) describes.
+ *
+ * Addresses that connected before go first, fastest first, and then
+ * the families alternate.  Each connect starts 250 ms after the one
+ * before (less for an address known to answer quickly), or at once if
+ * the one before fails, and gets 1 second.  The connect time or
+ * failure of each address that finishes is recorded for next time.
+ *
+ * @return The connected socket, or -1 with errno set.
+ */
+int connect_to_addresses(const struct addrinfo *ai_chain);
+
+/**
+ * @brief The smoothed connect time recorded for *addr*, or -1 if it
+ *        has never connected.  *failures*, if not NULL, is set to the
+ *        number of failures since it last connected.
+ */
+int get_connect_latency(const struct sockaddr *addr, socklen_t addr_len, int *failures);
+
+/**
+ * @brief Complete the TLS handshake over the socket of *open_talker*,
+ *        as open_ssl_talker() does, but return the session rather than
+ *        using it in a callback.
+ *
+ * @return The session, for SSL_free() when done, or NULL, after
+ *         logging the reason.
+ */
+SSL *start_ssl_session(STalker *open_talker);
+
+/**
+ * @brief Like open_ssl_talker(), but the callback gets a memory TLS
+ *        talker (see STMemTLS) whose ciphertext goes through
+ *        *open_talker*.
+ */
+void open_mem_tls_talker(STalker *open_talker, void *data, talker_user callback);
+
+/**
+ * @brief Print each connection's I/O statistics to *target* when it
+ *        closes, or stop printing them if *target* is NULL.
+ *
+ * The talkers passed to a talker_user callback always count their
+ * I/O, which the callback can read with stk_get_stats().
+ */
+void set_talker_stats_dump(FILE *target);
+
+/**
+ * @brief Have open_ssl_talker() ask OpenSSL to hand record encryption
+ *        to the kernel (kTLS) after the handshake.
+ *
+ * Whether the kernel took over depends on its tls module and the
+ * negotiated cipher, so check stk_ktls_send() on the talker.  The
+ * talker of open_mem_tls_talker() never uses kTLS.
+ */
+void set_talker_ktls(int enable);
+
+/**
+ * @brief Have connect_to_host(), and so open_socket_talker(), find
+ *        hosts through the cache of *res*, or with getaddrinfo() again
+ *        if *res* is NULL.
+ *
+ * *res* must outlive its use.  Call resolver_prefetch() with a job's
+ * destinations to have them resolved before its first connection.
+ */
+void set_talker_resolver(Resolver *res);
+
 #endif
 
 
@@ -1,5 +1,16 @@
+// -*- compile-command: "base=socktalk; gcc -Wall -Werror -ggdb -DSOCKTALK_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c -lssl -lcrypto" -*-
+
 #include <stdarg.h>    // for va_arg, etc.
 #include <string.h>    // for memset, etc;
+#include <stdlib.h>    // for malloc()
+#include <errno.h>
+#include <fcntl.h>     // for O_NONBLOCK, splice() with _GNU_SOURCE
+#include <time.h>      // for clock_gettime()
+#include <signal.h>    // for pthread_sigmask(), sigtimedwait()
+#include <unistd.h>    // for pread(), close()
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 #include "socktalk.h"
 
 
@@ -64,7 +75,7 @@ void dump_status_reply(const char *buffer, int buffer_len)
    
    while (ptr < end && *ptr)
    {
-      advance_chars = walk_status_reply(buffer, &status, &line, &line_len);
+      advance_chars = walk_status_reply(ptr, &status, &line, &line_len);
       switch(advance_chars)
       {
          case -1:
@@ -95,7 +106,7 @@ int log_status_reply_errors(const char *buffer, int buffer_len)
    
    while (ptr < end && *ptr)
    {
-      advance_chars = walk_status_reply(buffer, &status, &line, &line_len);
+      advance_chars = walk_status_reply(ptr, &status, &line, &line_len);
       switch(advance_chars)
       {
          case -1:
@@ -116,14 +127,170 @@ int log_status_reply_errors(const char *buffer, int buffer_len)
    return errors;
 }
 
+/***************************
+ * I/O statistics
+ **************************/
+
+static inline unsigned long long stk_now_ns(void)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/** Record one writer call that asked to send *requested* bytes and returned *result*. */
+static void stk_count_write(STalkerStats *stats, int requested, int result, unsigned long long start, int would_block)
+{
+   int saved_errno = errno;
+
+   stats->write_ns += stk_now_ns() - start;
+   ++stats->write_calls;
+
+   if (result > 0)
+   {
+      stats->bytes_out += result;
+      if (result < requested)
+         ++stats->short_writes;
+   }
+   else if (would_block)
+      ++stats->would_block;
+   else
+      ++stats->errors;
+
+   errno = saved_errno;
+}
+
+/** Record one reader call. */
+static void stk_count_read(STalkerStats *stats, int result, unsigned long long start, int would_block)
+{
+   int saved_errno = errno;
+
+   stats->read_ns += stk_now_ns() - start;
+   ++stats->read_calls;
+
+   if (result > 0)
+      stats->bytes_in += result;
+   else if (would_block)
+      ++stats->would_block;
+   else if (result < 0)
+      ++stats->errors;
+
+   errno = saved_errno;
+}
+
+static inline int sock_would_block(int result)
+{
+   return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static inline int ssl_would_block(SSL *ssl, int result)
+{
+   int error;
+   if (result > 0)
+      return 0;
+
+   error = SSL_get_error(ssl, result);
+   return error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE;
+}
+
+void stk_attach_stats(struct _stalker *talker, STalkerStats *stats)
+{
+   memset(stats, 0, sizeof(STalkerStats));
+   talker->stats = stats;
+}
+
+const STalkerStats *stk_get_stats(const struct _stalker *talker)
+{
+   return stk_base_talker(talker)->stats;
+}
+
+void stk_dump_stats(const STalkerStats *stats, const char *label, FILE *target)
+{
+   if (!target)
+      target = stderr;
+
+   fprintf(target,
+           "%s: out [32;1m%llu[m bytes in %lu writes (%lu short, %.3f ms), "
+           "in [32;1m%llu[m bytes in %lu reads (%.3f ms), "
+           "%lu would-block, %lu errors",
+           label,
+           stats->bytes_out,
+           stats->write_calls,
+           stats->short_writes,
+           stats->write_ns / 1e6,
+           stats->bytes_in,
+           stats->read_calls,
+           stats->read_ns / 1e6,
+           stats->would_block,
+           stats->errors);
+
+   if (stats->tls_records_out)
+      fprintf(target, ", about %lu TLS records out", stats->tls_records_out);
+
+   fputc('\n', target);
+}
+
 int stk_sock_talker(const struct _stalker* talker, const void *data, int data_len)
 {
-   return send(*(int*)talker->conduit, (void*)data, data_len, 0);
+   STalkerStats *stats = talker->stats;
+   unsigned long long start = stats ? stk_now_ns() : 0;
+
+   int result = send(*(int*)talker->conduit,
+                     (void*)data,
+                     data_len,
+                     MSG_NOSIGNAL | ((talker->flags & STK_MORE) ? MSG_MORE : 0));
+
+   if (stats)
+      stk_count_write(stats, data_len, result, start, sock_would_block(result));
+
+   return result;
+}
+
+/**
+ * Gather-write for plain sockets.  MSG_NOSIGNAL turns a closed
+ * connection into an error return instead of a SIGPIPE.
+ */
+int stk_sock_writev(const struct _stalker* talker, const struct iovec *iov, int iov_count)
+{
+   STalkerStats *stats = talker->stats;
+   unsigned long long start = stats ? stk_now_ns() : 0;
+   int index, requested = 0;
+
+   struct msghdr msg;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = (struct iovec*)iov;
+   msg.msg_iovlen = iov_count;
+
+   int result = sendmsg(*(int*)talker->conduit,
+                        &msg,
+                        MSG_NOSIGNAL | ((talker->flags & STK_MORE) ? MSG_MORE : 0));
+
+   if (stats)
+   {
+      for (index = 0; index < iov_count; ++index)
+         requested += iov[index].iov_len;
+      stk_count_write(stats, requested, result, start, sock_would_block(result));
+   }
+
+   return result;
 }
 
 int stk_ssl_talker(const struct _stalker* talker, const void *data, int data_len)
 {
-   return SSL_write((SSL*)talker->conduit, data, data_len);
+   STalkerStats *stats = talker->stats;
+   unsigned long long start = stats ? stk_now_ns() : 0;
+   SSL *ssl = (SSL*)talker->conduit;
+
+   int result = SSL_write(ssl, data, data_len);
+
+   if (stats)
+   {
+      stk_count_write(stats, data_len, result, start, ssl_would_block(ssl, result));
+      if (result > 0)
+         stats->tls_records_out += (result + STK_BUFFER_SIZE - 1) / STK_BUFFER_SIZE;
+   }
+
+   return result;
 }
 
 /**
@@ -141,181 +308,1688 @@ int stk_stdout_talker(const struct _stalker* talker, const void *buffer, int dat
 
 int stk_sock_reader(const struct _stalker* talker, void *buffer, int buff_len)
 {
-   return recv(*(int*)talker->conduit, buffer, buff_len, 0);
+   STalkerStats *stats = talker->stats;
+   unsigned long long start = stats ? stk_now_ns() : 0;
+
+   int result = recv(*(int*)talker->conduit, buffer, buff_len, 0);
+
+   if (stats)
+      stk_count_read(stats, result, start, sock_would_block(result));
+
+   return result;
 }
 
 int stk_ssl_reader(const struct _stalker* talker, void *buffer, int buff_len)
 {
-   return SSL_read((SSL*)talker->conduit, buffer, buff_len);
+   STalkerStats *stats = talker->stats;
+   unsigned long long start = stats ? stk_now_ns() : 0;
+   SSL *ssl = (SSL*)talker->conduit;
+
+   int result = SSL_read(ssl, buffer, buff_len);
+
+   if (stats)
+      stk_count_read(stats, result, start, ssl_would_block(ssl, result));
+
+   return result;
 }
 
+/**************************
+ * Non-blocking talkers
+ *************************/
 
-void init_ssl_talker(struct _stalker* talker, SSL* ssl)
+/** Translate a failed non-blocking socket call into STK_WANT_WRITE, or -1. */
+static inline int sock_nb_result(int result, int want)
 {
-   memset(talker, 0, sizeof(struct _stalker));
-   talker->conduit = ssl;
-   talker->writer = stk_ssl_talker;
-   talker->reader = stk_ssl_reader;
+   if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return want;
+   else
+      return result;
 }
 
-void init_sock_talker(struct _stalker* talker, int* socket)
+/** Translate SSL_write() or SSL_read() results into STK_WANT_READ, STK_WANT_WRITE, or -1. */
+static int ssl_nb_result(SSL *ssl, int result)
 {
-   memset(talker, 0, sizeof(struct _stalker));
-   talker->conduit = socket;
-   talker->writer = stk_sock_talker;
-   talker->reader = stk_sock_reader;
+   if (result > 0)
+      return result;
+
+   switch(SSL_get_error(ssl, result))
+   {
+      case SSL_ERROR_WANT_READ:
+         return STK_WANT_READ;
+      case SSL_ERROR_WANT_WRITE:
+         return STK_WANT_WRITE;
+      case SSL_ERROR_ZERO_RETURN:
+         return 0;
+      default:
+         return -1;
+   }
 }
 
-void init_stdout_talker(struct _stalker *talker)
+int stk_nb_sock_talker(const struct _stalker* talker, const void *data, int data_len)
 {
-   memset(talker, 0, sizeof(struct _stalker));
-   talker->writer = stk_stdout_talker;
+   return sock_nb_result(stk_sock_talker(talker, data, data_len), STK_WANT_WRITE);
+}
 
-   // leave talker->conduit and talker->reader set to  NULL to trigger an eror if used
+int stk_nb_sock_writev(const struct _stalker* talker, const struct iovec *iov, int iov_count)
+{
+   return sock_nb_result(stk_sock_writev(talker, iov, iov_count), STK_WANT_WRITE);
 }
 
-int is_socket_talker(const STalker *talker)
+int stk_nb_sock_reader(const struct _stalker* talker, void *buffer, int buff_len)
 {
-   return talker->writer == stk_sock_talker && talker->conduit != NULL;
+   return sock_nb_result(stk_sock_reader(talker, buffer, buff_len), STK_WANT_READ);
 }
 
-int is_ssl_talker(const STalker *talker)
+int stk_nb_ssl_talker(const struct _stalker* talker, const void *data, int data_len)
 {
-   return talker->writer == stk_ssl_talker && talker->conduit != NULL;
+   return ssl_nb_result((SSL*)talker->conduit, stk_ssl_talker(talker, data, data_len));
 }
 
-int get_socket_handle(const STalker *talker)
+int stk_nb_ssl_reader(const struct _stalker* talker, void *buffer, int buff_len)
 {
-   if (is_socket_talker(talker))
-      return *(int*)talker->conduit;
-   else
-      return 0;
+   return ssl_nb_result((SSL*)talker->conduit, stk_ssl_reader(talker, buffer, buff_len));
 }
-   
 
-/**
- * @brief Sends data by char* and byte count.  To be paired with use of BuffControl object.
- */
-size_t stk_simple_send_line(const struct _stalker* talker, const char *data, int data_len)
+int stk_ktls_send(const struct _stalker *talker)
 {
-   size_t bytes_sent = (*talker->writer)(talker, data, data_len);
-   bytes_sent += (*talker->writer)(talker, "\r\n", 2);
-   return bytes_sent;
+#ifndef OPENSSL_NO_KTLS
+   if (is_ssl_talker(talker))
+      return BIO_get_ktls_send(SSL_get_wbio((SSL*)stk_base_talker(talker)->conduit));
+#endif
+   return 0;
 }
 
-/**
- * @brief Send raw string, without adding a newline. 
- *
- * This function is meant for building a line in multiple steps.
- * The main example is creating a comma-separated To: header field.
- */
-size_t stk_simple_send_unlined(const struct _stalker* talker, const char *data, int data_len)
+int stk_ktls_recv(const struct _stalker *talker)
 {
-   return (*talker->writer)(talker, data, data_len);
+#ifndef OPENSSL_NO_KTLS
+   if (is_ssl_talker(talker))
+      return BIO_get_ktls_recv(SSL_get_rbio((SSL*)stk_base_talker(talker)->conduit));
+#endif
+   return 0;
 }
 
-size_t stk_vsend_line(const struct _stalker* talker, va_list args)
+int stk_ssl_handshake(const struct _stalker *talker)
 {
-   size_t bytes_sent, total_bytes = 0;
-   size_t bite_len;
+   SSL *ssl = (SSL*)talker->conduit;
+   int result = ssl_nb_result(ssl, SSL_connect(ssl));
 
-   va_list args_copy;
-   va_copy(args_copy, args);
+   // SSL_connect() returns 1 for success, 0 for a controlled failure:
+   return result == 0 ? -1 : result;
+}
 
-   const char *bite = va_arg(args_copy, const char*);
-   while (bite)
-   {
-      bite_len = strlen(bite);
-      total_bytes += bytes_sent = (*talker->writer)(talker, bite, bite_len);
-      if (bytes_sent != bite_len)
-         fprintf(stderr, "Socket talker failed to write complete contents of string.\n");
+static int set_nonblocking(int handle)
+{
+   int options = fcntl(handle, F_GETFL, NULL);
+   return options >= 0 && fcntl(handle, F_SETFL, options | O_NONBLOCK) >= 0;
+}
 
-      bite = va_arg(args_copy, const char*);
-   }
+int init_nb_sock_talker(struct _stalker* talker, int* socket)
+{
+   memset(talker, 0, sizeof(struct _stalker));
+   talker->conduit = socket;
+   talker->writer = stk_nb_sock_talker;
+   talker->reader = stk_nb_sock_reader;
+   talker->writev = stk_nb_sock_writev;
 
-   va_end(args_copy);
+   return set_nonblocking(*socket);
+}
+
+int init_nb_ssl_talker(struct _stalker* talker, SSL* ssl)
+{
+   memset(talker, 0, sizeof(struct _stalker));
+   talker->conduit = ssl;
+   talker->writer = stk_nb_ssl_talker;
+   talker->reader = stk_nb_ssl_reader;
 
-   total_bytes += bytes_sent = (*talker->writer)(talker, "\r\n", 2);
+   // A write that returned STK_WANT_WRITE may be retried from a
+   // buffer that has since moved, and may complete in pieces:
+   SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_ENABLE_PARTIAL_WRITE);
 
-   return total_bytes;
+   return set_nonblocking(SSL_get_fd(ssl));
+}
+
+int is_nonblocking_talker(const STalker *talker)
+{
+   talker = stk_base_talker(talker);
+
+   if (is_mem_tls_talker(talker))
+      return is_nonblocking_talker(((const STMemTLS*)talker->conduit)->inner);
+
+   return talker->writer == stk_nb_sock_talker || talker->writer == stk_nb_ssl_talker;
 }
 
+/**************************
+ * Memory BIO TLS talker
+ *************************/
+
 /**
- * @brief Write string of const char* arguments to socket or ssl socket, finish with "\r\n";
- *
- * This is a variable-argument function, with the _talker argument first,
- * followed by const char* arguments, terminated with a NULL argument to
- * indicate the end of the list.
+ * Send the ciphertext waiting in the BIO pair, straight from the
+ * pair's buffer.
  *
- * No spaces will be added between argument strings, but a final "\r\n"
- * will be sent upon encountering the terminating NULL.
+ * @return 1 when nothing remains, otherwise the failed inner
+ *         writer's result: 0, -1, or STK_WANT_WRITE.
  */
-size_t stk_send_line(const struct _stalker* talker, ...)
+static int mem_tls_send(STMemTLS *mt)
 {
-   size_t bytes_sent, total_bytes = 0;
-   size_t bite_len;
-   va_list ap;
-   va_start(ap, talker);
+   char *pending;
+   int pending_len, bytes_written;
 
-   const char *bite = va_arg(ap, const char*);
-   while (bite)
+   while ((pending_len = BIO_nread0(mt->network, &pending)) > 0)
    {
-      bite_len = strlen(bite);
-      total_bytes += bytes_sent = (*talker->writer)(talker, bite, bite_len);
-      if (bytes_sent != bite_len)
-         fprintf(stderr, "Socket talker failed to write complete contents of string.\n");
+      bytes_written = (*mt->inner->writer)(mt->inner, pending, pending_len);
+      if (bytes_written <= 0)
+         return bytes_written;
 
-      bite = va_arg(ap, const char*);
+      BIO_nread(mt->network, &pending, bytes_written);
+      mt->cipher_out += bytes_written;
+      ++mt->sends;
    }
 
-   va_end(ap);
+   return 1;
+}
 
-   total_bytes += bytes_sent = (*talker->writer)(talker, "\r\n", 2);
+/**
+ * Read ciphertext from the inner talker straight into the BIO pair.
+ *
+ * @return The number of bytes received, or the inner reader's result
+ *         if it received nothing.
+ */
+static int mem_tls_receive(STMemTLS *mt)
+{
+   char *space;
+   int space_len, bytes_read;
 
-   return total_bytes;
+   if ((space_len = BIO_nwrite0(mt->network, &space)) <= 0)
+      return -1;
+
+   bytes_read = (*mt->inner->reader)(mt->inner, space, space_len);
+   if (bytes_read > 0)
+   {
+      BIO_nwrite(mt->network, &space, bytes_read);
+      mt->cipher_in += bytes_read;
+   }
+
+   return bytes_read;
 }
 
 /**
- * @brief Read from server using current communication protocol.  Add \0 to end, if room.
+ * Move ciphertext in the direction SSL is waiting for after a call
+ * returned *result*.
+ *
+ * @return 1 to repeat the SSL call, otherwise the value to return:
+ *         0 for a closed connection, -1, or a want code.
  */
-size_t stk_recv_line(const struct _stalker* talker, void* buffer, int buff_len)
+static int mem_tls_service(STMemTLS *mt, int result)
 {
-   size_t bytes_read = (*talker->reader)(talker, buffer, buff_len);
-   if (bytes_read+1 < buff_len)
-      ((char*)buffer)[bytes_read] = '\0';
-   return bytes_read;
+   int moved;
+
+   switch(SSL_get_error(mt->ssl, result))
+   {
+      case SSL_ERROR_WANT_READ:
+         // The peer may be waiting for what SSL has written:
+         if ((moved = mem_tls_send(mt)) != 1)
+            return moved;
+         moved = mem_tls_receive(mt);
+         return moved > 0 ? 1 : moved;
+
+      case SSL_ERROR_WANT_WRITE:
+         // The BIO pair is full:
+         moved = mem_tls_send(mt);
+         return moved;
+
+      case SSL_ERROR_ZERO_RETURN:
+         return 0;
+
+      default:
+         return -1;
+   }
 }
 
-int stk_send_recv_line(const struct _stalker *talker, ...)
+int stk_mem_tls_writer(const struct _stalker* talker, const void *data, int data_len)
 {
-   char buffer[1000];
+   STMemTLS *mt = (STMemTLS*)talker->conduit;
+   STalkerStats *stats = talker->stats;
+   unsigned long long start = stats ? stk_now_ns() : 0;
+   unsigned long long crypto_start;
+   int result, moved = -1;
+
+   if (mt->accepted)
+   {
+      // This is the retry of a write whose records could not all be
+      // sent, and it is done when they are:
+      if ((moved = mem_tls_send(mt)) == 1)
+      {
+         result = mt->accepted;
+         mt->accepted = 0;
+      }
+      else
+         result = moved == 0 ? -1 : moved;
+   }
+   else
+   {
+      do
+      {
+         crypto_start = stk_now_ns();
+         result = SSL_write(mt->ssl, data, data_len);
+         mt->crypto_ns += stk_now_ns() - crypto_start;
+         ++mt->crypto_calls;
+      }
+      while (result <= 0 && (moved = mem_tls_service(mt, result)) == 1);
+
+      if (result > 0)
+      {
+         // Hold the records while more writes are coming.  If a
+         // non-blocking inner talker leaves some unsent, report that
+         // the write must wait, so the caller retries when it can:
+         moved = (talker->flags & STK_MORE) ? 1 : mem_tls_send(mt);
+         if (moved == STK_WANT_WRITE)
+         {
+            mt->accepted = result;
+            result = STK_WANT_WRITE;
+         }
+         else if (moved != 1)
+            result = -1;
+      }
+      else
+         result = moved == 0 ? -1 : moved;
+   }
 
-   va_list args;
-   va_start(args, talker);
-   stk_vsend_line(talker, args);
-   va_end(args);
+   if (stats)
+   {
+      stk_count_write(stats, data_len, result, start, result == STK_WANT_READ || result == STK_WANT_WRITE);
+      if (result > 0)
+         stats->tls_records_out += (result + STK_BUFFER_SIZE - 1) / STK_BUFFER_SIZE;
+   }
 
-   stk_recv_line(talker, buffer, sizeof(buffer));
-   return 0 == log_status_reply_errors(buffer, sizeof(buffer));
+   return result;
 }
 
-int seek_status_message(const struct _status_line* sl, const char *value)
+int stk_mem_tls_reader(const struct _stalker* talker, void *buffer, int buff_len)
 {
-   while (sl)
+   STMemTLS *mt = (STMemTLS*)talker->conduit;
+   STalkerStats *stats = talker->stats;
+   unsigned long long start = stats ? stk_now_ns() : 0;
+   unsigned long long crypto_start;
+   int result, moved = -1;
+
+   // The reply may depend on records still held back:
+   if ((moved = mem_tls_send(mt)) != 1)
+      result = moved == 0 ? -1 : moved;
+   else
    {
-      if ( 0 == strcasecmp(sl->message, value))
-         return 1;
-      sl = sl->next;
+      do
+      {
+         crypto_start = stk_now_ns();
+         result = SSL_read(mt->ssl, buffer, buff_len);
+         mt->crypto_ns += stk_now_ns() - crypto_start;
+         ++mt->crypto_calls;
+      }
+      while (result <= 0 && (moved = mem_tls_service(mt, result)) == 1);
+
+      if (result <= 0)
+         result = moved;
    }
 
-   return 0;
+   if (stats)
+      stk_count_read(stats, result, start, result == STK_WANT_READ || result == STK_WANT_WRITE);
+
+   return result;
 }
 
-void show_status_chain(const Status_Line *sl)
+int stk_mem_tls_handshake(const struct _stalker *talker)
 {
-   while (sl)
+   STMemTLS *mt = (STMemTLS*)talker->conduit;
+   unsigned long long crypto_start;
+   int result, moved = -1;
+
+   do
    {
-      printf("%d : \"[44;1m%s[m\"\n", sl->status, sl->message);
-      sl = sl->next;
+      crypto_start = stk_now_ns();
+      result = SSL_connect(mt->ssl);
+      mt->crypto_ns += stk_now_ns() - crypto_start;
+      ++mt->crypto_calls;
+   }
+   while (result <= 0 && (moved = mem_tls_service(mt, result)) == 1);
+
+   if (result == 1)
+   {
+      // Send the client's last handshake message now, or with the first write:
+      moved = mem_tls_send(mt);
+      return moved == 1 || moved == STK_WANT_WRITE ? 1 : -1;
+   }
+
+   return moved == 0 ? -1 : moved;
+}
+
+int stk_mem_tls_pending(const struct _stalker *talker)
+{
+   return BIO_ctrl_pending(((const STMemTLS*)talker->conduit)->network);
+}
+
+int init_mem_tls_talker(struct _stalker *talker, STMemTLS *mt, SSL *ssl, const struct _stalker *inner)
+{
+   BIO *internal;
+
+   memset(mt, 0, sizeof(STMemTLS));
+   mt->ssl = ssl;
+   mt->inner = inner;
+
+   if (!BIO_new_bio_pair(&internal, STK_TLS_BIO_SIZE, &mt->network, STK_TLS_BIO_SIZE))
+      return 0;
+
+   SSL_set_bio(ssl, internal, internal);
+
+   // A write that returned STK_WANT_WRITE may be retried from a
+   // buffer that has since moved, and may complete in pieces:
+   SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_ENABLE_PARTIAL_WRITE);
+
+   memset(talker, 0, sizeof(struct _stalker));
+   talker->conduit = mt;
+   talker->writer = stk_mem_tls_writer;
+   talker->reader = stk_mem_tls_reader;
+
+   return 1;
+}
+
+void mem_tls_close(STMemTLS *mt)
+{
+   if (mt->network)
+      BIO_free(mt->network);
+
+   mt->network = NULL;
+}
+
+int is_mem_tls_talker(const STalker *talker)
+{
+   return talker->writer == stk_mem_tls_writer && talker->conduit != NULL;
+}
+
+void stk_dump_mem_tls(const STMemTLS *mt, const char *label, FILE *target)
+{
+   if (!target)
+      target = stderr;
+
+   fprintf(target,
+           "%s: [32;1m%.3f[m ms in %lu OpenSSL calls, "
+           "ciphertext out %llu bytes in %lu sends, in %llu bytes\n",
+           label,
+           mt->crypto_ns / 1e6,
+           mt->crypto_calls,
+           mt->cipher_out,
+           mt->sends,
+           mt->cipher_in);
+}
+
+/**
+ * Write all of *data* through *talker*, continuing after short writes.
+ *
+ * @return 1 for success, 0 if the talker failed.
+ */
+static int stk_write_all(const struct _stalker *talker, const char *data, int data_len)
+{
+   int bytes_written;
+
+   while (data_len > 0)
+   {
+      bytes_written = (*talker->writer)(talker, data, data_len);
+      if (bytes_written <= 0)
+         return 0;
+
+      data += bytes_written;
+      data_len -= bytes_written;
    }
+
+   return 1;
+}
+
+/**
+ * Collect *data* in the buffer, flushing first if it will not fit.
+ * Data at least as large as the buffer is written straight through.
+ */
+int stk_buffered_writer(const struct _stalker* talker, const void *data, int data_len)
+{
+   STBuffer *stb = (STBuffer*)talker->conduit;
+
+   if (data_len > stb->buffer_len - stb->used && !stk_flush(talker))
+      return -1;
+
+   if (data_len >= stb->buffer_len)
+      return stk_write_all(stb->inner, (const char*)data, data_len) ? data_len : -1;
+
+   memcpy(stb->buffer + stb->used, data, data_len);
+   stb->used += data_len;
+   return data_len;
 }
+
+/**
+ * The server will not reply to requests it has not received,
+ * so flush before waiting for a reply.
+ */
+int stk_buffered_reader(const struct _stalker* talker, void *buffer, int buff_len)
+{
+   STBuffer *stb = (STBuffer*)talker->conduit;
+
+   if (!stk_flush(talker))
+      return -1;
+
+   return (*stb->inner->reader)(stb->inner, buffer, buff_len);
+}
+
+
+void init_ssl_talker(struct _stalker* talker, SSL* ssl)
+{
+   memset(talker, 0, sizeof(struct _stalker));
+   talker->conduit = ssl;
+   talker->writer = stk_ssl_talker;
+   talker->reader = stk_ssl_reader;
+}
+
+void init_sock_talker(struct _stalker* talker, int* socket)
+{
+   memset(talker, 0, sizeof(struct _stalker));
+   talker->conduit = socket;
+   talker->writer = stk_sock_talker;
+   talker->reader = stk_sock_reader;
+   talker->writev = stk_sock_writev;
+}
+
+void init_stdout_talker(struct _stalker *talker)
+{
+   memset(talker, 0, sizeof(struct _stalker));
+   talker->writer = stk_stdout_talker;
+
+   // leave talker->conduit and talker->reader set to  NULL to trigger an eror if used
+}
+
+/**
+ * Prepare *talker* to collect output in *buffer* and send it through *inner*.
+ *
+ * The STBuffer and buffer must remain in scope while the talker is used.
+ * Call stk_flush() after the last write that is not followed by a read.
+ */
+void init_buffered_talker(struct _stalker *talker,
+                          STBuffer *stb,
+                          const struct _stalker *inner,
+                          char *buffer,
+                          int buffer_len)
+{
+   memset(stb, 0, sizeof(STBuffer));
+   stb->inner = inner;
+   stb->buffer = buffer;
+   stb->buffer_len = buffer_len;
+
+   memset(talker, 0, sizeof(struct _stalker));
+   talker->conduit = stb;
+   talker->writer = stk_buffered_writer;
+   talker->reader = stk_buffered_reader;
+}
+
+int is_buffered_talker(const STalker *talker)
+{
+   return talker->writer == stk_buffered_writer && talker->conduit != NULL;
+}
+
+const STalker *stk_base_talker(const STalker *talker)
+{
+   while (is_buffered_talker(talker))
+      talker = ((const STBuffer*)talker->conduit)->inner;
+
+   return talker;
+}
+
+int stk_flush(const struct _stalker *talker)
+{
+   STBuffer *stb;
+   int success;
+
+   if (is_mem_tls_talker(talker))
+      return mem_tls_send((STMemTLS*)talker->conduit) == 1;
+
+   if (!is_buffered_talker(talker))
+      return 1;
+
+   stb = (STBuffer*)talker->conduit;
+   success = stk_write_all(stb->inner, stb->buffer, stb->used);
+   stb->used = 0;
+
+   // Pass the flush along to a buffered inner talker:
+   return success && stk_flush(stb->inner);
+}
+
+int is_socket_talker(const STalker *talker)
+{
+   talker = stk_base_talker(talker);
+   return (talker->writer == stk_sock_talker || talker->writer == stk_nb_sock_talker)
+      && talker->conduit != NULL;
+}
+
+int is_ssl_talker(const STalker *talker)
+{
+   talker = stk_base_talker(talker);
+   return (talker->writer == stk_ssl_talker || talker->writer == stk_nb_ssl_talker)
+      && talker->conduit != NULL;
+}
+
+int get_socket_handle(const STalker *talker)
+{
+   if (is_socket_talker(talker))
+      return *(int*)stk_base_talker(talker)->conduit;
+   else
+      return 0;
+}
+   
+
+/**
+ * Set or clear STK_MORE on *talker* and any talkers it wraps, so the
+ * flag reaches the socket talker that does the writing.
+ */
+void stk_set_more(struct _stalker *talker, int more)
+{
+   while (talker)
+   {
+      if (more)
+         talker->flags |= STK_MORE;
+      else
+         talker->flags &= ~STK_MORE;
+
+      if (is_buffered_talker(talker))
+         talker = (STalker*)((STBuffer*)talker->conduit)->inner;
+      else
+         talker = NULL;
+   }
+}
+
+/**
+ * Write every byte described by *iov*, continuing after short writes.
+ *
+ * Talkers without a gather-write get small requests copied into one
+ * buffer, so an SSL talker sends one TLS record rather than one per
+ * piece, and larger requests written piece by piece.
+ *
+ * @return 1 for success, 0 if the talker failed.
+ */
+int stk_writev_all(const struct _stalker *talker, const struct iovec *iov, int iov_count)
+{
+   struct iovec pending[STK_MAX_IOV];
+   int index, bytes_written;
+   size_t total = 0;
+
+   for (index = 0; index < iov_count; ++index)
+      total += iov[index].iov_len;
+
+   if (!talker->writev)
+   {
+      if (total <= 1024)
+      {
+         char gathered[1024];
+         char *ptr = gathered;
+         for (index = 0; index < iov_count; ++index)
+         {
+            memcpy(ptr, iov[index].iov_base, iov[index].iov_len);
+            ptr += iov[index].iov_len;
+         }
+
+         return stk_write_all(talker, gathered, total);
+      }
+
+      for (index = 0; index < iov_count; ++index)
+         if (!stk_write_all(talker, (const char*)iov[index].iov_base, iov[index].iov_len))
+            return 0;
+
+      return 1;
+   }
+
+   // Writev until done, dropping or trimming the entries already sent:
+   while (iov_count > STK_MAX_IOV)
+   {
+      if (!stk_writev_all(talker, iov, STK_MAX_IOV))
+         return 0;
+      for (index = 0; index < STK_MAX_IOV; ++index)
+         total -= iov[index].iov_len;
+      iov += STK_MAX_IOV;
+      iov_count -= STK_MAX_IOV;
+   }
+
+   memcpy(pending, iov, iov_count * sizeof(struct iovec));
+   iov = pending;
+
+   while (total > 0)
+   {
+      bytes_written = (*talker->writev)(talker, iov, iov_count);
+      if (bytes_written <= 0)
+         return 0;
+
+      total -= bytes_written;
+
+      while (iov_count > 0 && (size_t)bytes_written >= iov->iov_len)
+      {
+         bytes_written -= iov->iov_len;
+         ++iov;
+         --iov_count;
+      }
+
+      if (bytes_written > 0)
+      {
+         ((struct iovec*)iov)->iov_base = (char*)iov->iov_base + bytes_written;
+         ((struct iovec*)iov)->iov_len -= bytes_written;
+      }
+   }
+
+   return 1;
+}
+
+/**************************
+ * Sending file ranges
+ *************************/
+
+// Most bytes asked of one sendfile() or splice() call
+#define STK_SENDFILE_PIECE (1 << 30)
+
+/**
+ * sendfile() and splice() have no MSG_NOSIGNAL, so SIGPIPE is blocked
+ * while they run, and one raised by a closed connection is discarded
+ * before it is unblocked.
+ */
+static int sigpipe_block(sigset_t *old_mask)
+{
+   sigset_t pipe_set, pending;
+
+   sigemptyset(&pipe_set);
+   sigaddset(&pipe_set, SIGPIPE);
+   sigpending(&pending);
+   pthread_sigmask(SIG_BLOCK, &pipe_set, old_mask);
+
+   return sigismember(&pending, SIGPIPE);
+}
+
+static void sigpipe_restore(const sigset_t *old_mask, int was_pending)
+{
+   int saved_errno = errno;
+   sigset_t pipe_set, pending;
+   struct timespec no_wait = { 0, 0 };
+
+   sigemptyset(&pipe_set);
+   sigaddset(&pipe_set, SIGPIPE);
+   sigpending(&pending);
+
+   if (!was_pending && sigismember(&pending, SIGPIPE))
+      while (sigtimedwait(&pipe_set, NULL, &no_wait) < 0 && errno == EINTR)
+         ;
+
+   pthread_sigmask(SIG_SETMASK, old_mask, NULL);
+   errno = saved_errno;
+}
+
+/**
+ * Move a file range to a socket talker's socket with splice(),
+ * through a pipe, marking each piece SPLICE_F_MORE.
+ */
+static int sock_splice_file(const STalker *talker, int fd, off_t offset, size_t length)
+{
+   STalkerStats *stats = talker->stats;
+   int socket = *(int*)talker->conduit;
+   int pipe_fds[2], success = 1;
+   unsigned long long start;
+   ssize_t in_pipe, result;
+
+   if (pipe2(pipe_fds, O_CLOEXEC))
+      return 0;
+
+   while (success && length > 0)
+   {
+      in_pipe = splice(fd, &offset, pipe_fds[1], NULL,
+                       length < STK_SENDFILE_PIECE ? length : STK_SENDFILE_PIECE,
+                       SPLICE_F_MOVE);
+      if (in_pipe <= 0)
+         success = 0;
+      else
+         length -= in_pipe;
+
+      while (success && in_pipe > 0)
+      {
+         start = stats ? stk_now_ns() : 0;
+         result = splice(pipe_fds[0], NULL, socket, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+         if (stats)
+            stk_count_write(stats, in_pipe, result, start, sock_would_block(result));
+
+         if (result <= 0)
+            success = 0;
+         else
+            in_pipe -= result;
+      }
+   }
+
+   close(pipe_fds[0]);
+   close(pipe_fds[1]);
+   return success;
+}
+
+/**
+ * Move a file range to a socket talker's socket in the kernel.
+ *
+ * @return 1 for success, 0 for failure, or -1 if *fd* cannot be sent
+ *         this way, in which case nothing was sent.
+ */
+static int sock_send_file(const STalker *talker, int fd, off_t offset, size_t length)
+{
+   STalkerStats *stats = talker->stats;
+   int socket = *(int*)talker->conduit;
+   unsigned long long start;
+   size_t piece;
+   ssize_t result;
+   int first = 1;
+
+   // sendfile() lets the last packet go at once, so use splice(),
+   // which can say that more is coming:
+   if (talker->flags & STK_MORE)
+      return sock_splice_file(talker, fd, offset, length);
+
+   while (length > 0)
+   {
+      piece = length < STK_SENDFILE_PIECE ? length : STK_SENDFILE_PIECE;
+
+      start = stats ? stk_now_ns() : 0;
+      result = sendfile(socket, fd, &offset, piece);
+
+      if (stats)
+         stk_count_write(stats, piece, result, start, sock_would_block(result));
+
+      if (result <= 0)
+         return (first && result < 0 && (errno == EINVAL || errno == ENOSYS)) ? -1 : 0;
+
+      length -= result;
+      first = 0;
+   }
+
+   return 1;
+}
+
+/** Like sock_send_file(), for an SSL talker using kTLS. */
+static int ktls_send_file(const STalker *talker, int fd, off_t offset, size_t length)
+{
+#ifndef OPENSSL_NO_KTLS
+   STalkerStats *stats = talker->stats;
+   SSL *ssl = (SSL*)talker->conduit;
+   unsigned long long start;
+   size_t piece;
+   ossl_ssize_t result;
+   int first = 1;
+
+   while (length > 0)
+   {
+      piece = length < STK_SENDFILE_PIECE ? length : STK_SENDFILE_PIECE;
+
+      start = stats ? stk_now_ns() : 0;
+      result = SSL_sendfile(ssl, fd, offset, piece, 0);
+
+      if (stats)
+      {
+         stk_count_write(stats, piece, result, start, ssl_would_block(ssl, result));
+         if (result > 0)
+            stats->tls_records_out += (result + STK_BUFFER_SIZE - 1) / STK_BUFFER_SIZE;
+      }
+
+      if (result <= 0)
+         return (first && SSL_get_error(ssl, result) == SSL_ERROR_SYSCALL && errno == EINVAL) ? -1 : 0;
+
+      offset += result;
+      length -= result;
+      first = 0;
+   }
+
+   return 1;
+#else
+   return -1;
+#endif
+}
+
+/**
+ * Write a file range through *talker*, from a mapping of the file if
+ * possible, so that only the talker's own processing (encryption, for
+ * SSL) touches the bytes.
+ */
+static int stk_copy_file_range(const STalker *talker, int fd, off_t offset, size_t length, int mappable)
+{
+   char *map = MAP_FAILED, *ptr;
+   off_t map_start = offset - offset % sysconf(_SC_PAGESIZE);
+   size_t map_len = length + (offset - map_start);
+   size_t piece;
+   ssize_t bytes_read;
+   int success = 1;
+
+   if (mappable)
+      map = (char*)mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, map_start);
+
+   if (map != MAP_FAILED)
+   {
+      madvise(map, map_len, MADV_SEQUENTIAL);
+
+      for (ptr = map + (offset - map_start); success && length > 0; ptr += piece, length -= piece)
+      {
+         piece = length < STK_FILE_CHUNK ? length : STK_FILE_CHUNK;
+         success = stk_write_all(talker, ptr, piece);
+      }
+
+      munmap(map, map_len);
+      return success;
+   }
+
+   char *buffer = (char*)malloc(STK_FILE_CHUNK);
+   if (!buffer)
+      return 0;
+
+   while (success && length > 0)
+   {
+      bytes_read = pread(fd, buffer, length < STK_FILE_CHUNK ? length : STK_FILE_CHUNK, offset);
+      if (bytes_read <= 0)
+         success = 0;
+      else
+      {
+         success = stk_write_all(talker, buffer, bytes_read);
+         offset += bytes_read;
+         length -= bytes_read;
+      }
+   }
+
+   free(buffer);
+   return success;
+}
+
+int stk_send_file_range(const struct _stalker *talker, int fd, off_t offset, size_t length)
+{
+   const STalker *base = stk_base_talker(talker);
+   struct stat st;
+   sigset_t old_mask;
+   int was_pending, result = -1;
+
+   if (fstat(fd, &st))
+      return 0;
+
+   // Mapping past the end of a file faults, so check the range first:
+   if (S_ISREG(st.st_mode) && (offset < 0 || (size_t)offset + length > (size_t)st.st_size))
+   {
+      errno = EINVAL;
+      return 0;
+   }
+
+   if (length == 0)
+      return 1;
+
+   if (is_socket_talker(base) || stk_ktls_send(base))
+   {
+      // Whatever the talker holds goes before the file:
+      if (!stk_flush(talker))
+         return 0;
+
+      was_pending = sigpipe_block(&old_mask);
+
+      if (is_socket_talker(base))
+         result = sock_send_file(base, fd, offset, length);
+      else
+         result = ktls_send_file(base, fd, offset, length);
+
+      sigpipe_restore(&old_mask, was_pending);
+
+      if (result >= 0)
+         return result;
+   }
+
+   return stk_copy_file_range(talker, fd, offset, length, S_ISREG(st.st_mode));
+}
+
+/**
+ * @brief Sends data by char* and byte count.  To be paired with use of BuffControl object.
+ */
+size_t stk_simple_send_line(const struct _stalker* talker, const char *data, int data_len)
+{
+   struct iovec iov[2] = { { (void*)data, data_len }, { "\r\n", 2 } };
+
+   if (stk_writev_all(talker, iov, 2))
+      return data_len + 2;
+   else
+   {
+      fprintf(stderr, "Socket talker failed to write complete contents of string.\n");
+      return 0;
+   }
+}
+
+/**
+ * @brief Send raw string, without adding a newline. 
+ *
+ * This function is meant for building a line in multiple steps.
+ * The main example is creating a comma-separated To: header field.
+ */
+size_t stk_simple_send_unlined(const struct _stalker* talker, const char *data, int data_len)
+{
+   return (*talker->writer)(talker, data, data_len);
+}
+
+/**
+ * @brief Send the NULL-terminated list of strings in *args*, followed by "\r\n".
+ *
+ * The strings and line ending are sent with as few writes as the
+ * talker allows, normally one.
+ */
+size_t stk_vsend_line(const struct _stalker* talker, va_list args)
+{
+   struct iovec iov[STK_MAX_IOV];
+   int iov_count = 0;
+   size_t total_bytes = 0;
+   int failed = 0;
+
+   va_list args_copy;
+   va_copy(args_copy, args);
+
+   const char *bite = va_arg(args_copy, const char*);
+   while (bite)
+   {
+      // Leave room for the line ending:
+      if (iov_count == STK_MAX_IOV - 1)
+      {
+         failed |= !stk_writev_all(talker, iov, iov_count);
+         iov_count = 0;
+      }
+
+      iov[iov_count].iov_base = (void*)bite;
+      iov[iov_count].iov_len = strlen(bite);
+      total_bytes += iov[iov_count].iov_len;
+      ++iov_count;
+
+      bite = va_arg(args_copy, const char*);
+   }
+
+   va_end(args_copy);
+
+   iov[iov_count].iov_base = "\r\n";
+   iov[iov_count].iov_len = 2;
+   total_bytes += 2;
+   ++iov_count;
+
+   failed |= !stk_writev_all(talker, iov, iov_count);
+
+   if (failed)
+   {
+      fprintf(stderr, "Socket talker failed to write complete contents of string.\n");
+      return 0;
+   }
+
+   return total_bytes;
+}
+
+/**
+ * @brief Write string of const char* arguments to socket or ssl socket, finish with "\r\n";
+ *
+ * This is a variable-argument function, with the _talker argument first,
+ * followed by const char* arguments, terminated with a NULL argument to
+ * indicate the end of the list.
+ *
+ * No spaces will be added between argument strings, but a final "\r\n"
+ * will be sent upon encountering the terminating NULL.
+ */
+size_t stk_send_line(const struct _stalker* talker, ...)
+{
+   size_t total_bytes;
+   va_list ap;
+   va_start(ap, talker);
+   total_bytes = stk_vsend_line(talker, ap);
+   va_end(ap);
+
+   return total_bytes;
+}
+
+/** Attach a receive buffer to *talker*, for stk_recv_reply(). */
+void stk_attach_replies(struct _stalker *talker, STReplies *str, char *buffer, int buffer_len)
+{
+   memset(str, 0, sizeof(STReplies));
+   str->buffer = buffer;
+   str->buffer_len = buffer_len;
+   talker->replies = str;
+}
+
+/** Return the talker whose reads are framed for *talker*, which may be itself. */
+static const STalker *stk_replies_owner(const STalker *talker)
+{
+   while (!talker->replies && is_buffered_talker(talker))
+      talker = ((const STBuffer*)talker->conduit)->inner;
+
+   return talker;
+}
+
+/**
+ * Return a pointer to the byte after the last line of the first
+ * complete reply in [ptr, end), or NULL if the reply is incomplete.
+ * The last line has a space or nothing, rather than a '-', after the
+ * status code.
+ */
+static const char *find_reply_end(const char *ptr, const char *end)
+{
+   const char *line = ptr;
+
+   while (ptr < end)
+   {
+      if (*ptr++ == '\n')
+      {
+         if (ptr - line < 5 || line[3] != '-')
+            return ptr;
+
+         line = ptr;
+      }
+   }
+
+   return NULL;
+}
+
+int stk_discard_received(const struct _stalker *talker)
+{
+   STReplies *str = stk_replies_owner(talker)->replies;
+   int discarded = 0;
+
+   if (str)
+   {
+      discarded = str->end - str->start;
+      str->start = str->end = 0;
+   }
+
+   return discarded;
+}
+
+int stk_recv_reply(const struct _stalker *talker, char *buffer, int buff_len)
+{
+   const STalker *owner = stk_replies_owner(talker);
+   STReplies *str = owner->replies;
+   const char *reply_end, *last_line;
+   int bytes_read, reply_len, copy_len;
+   int copied = -1;     // bytes already saved from a reply too long for the receive buffer
+
+   if (!str)
+   {
+      bytes_read = (*talker->reader)(talker, buffer, buff_len - 1);
+      if (bytes_read < 0)
+         bytes_read = 0;
+      buffer[bytes_read] = '\0';
+      return bytes_read;
+   }
+
+   // Send anything held by wrapping talkers before awaiting the reply:
+   if (!stk_flush(talker))
+      return 0;
+
+   while (!(reply_end = find_reply_end(str->buffer + str->start, str->buffer + str->end)))
+   {
+      if (str->end == str->buffer_len)
+      {
+         if (str->start > 0)
+         {
+            memmove(str->buffer, str->buffer + str->start, str->end - str->start);
+            str->end -= str->start;
+            str->start = 0;
+         }
+         else
+         {
+            // Save what fits of the reply, then keep only the
+            // unfinished last line, or the part of it that shows
+            // whether it is a continuation line:
+            if (copied < 0)
+            {
+               copied = str->end < buff_len ? str->end : buff_len - 1;
+               memcpy(buffer, str->buffer, copied);
+               buffer[copied] = '\0';
+               fprintf(stderr, "Reply longer than the %d byte receive buffer.\n", str->buffer_len);
+            }
+
+            last_line = str->buffer + str->end;
+            while (last_line > str->buffer && last_line[-1] != '\n')
+               --last_line;
+
+            if (last_line == str->buffer)
+               str->end = 4;
+            else
+            {
+               str->end -= last_line - str->buffer;
+               memmove(str->buffer, last_line, str->end);
+            }
+         }
+      }
+
+      bytes_read = (*owner->reader)(owner, str->buffer + str->end, str->buffer_len - str->end);
+      if (bytes_read == STK_WANT_READ || bytes_read == STK_WANT_WRITE)
+         return bytes_read;
+      else if (bytes_read <= 0)
+         return 0;
+
+      str->end += bytes_read;
+   }
+
+   reply_len = reply_end - (str->buffer + str->start);
+
+   if (copied < 0)
+   {
+      copy_len = reply_len < buff_len ? reply_len : buff_len - 1;
+      memcpy(buffer, str->buffer + str->start, copy_len);
+      buffer[copy_len] = '\0';
+   }
+   else
+      copy_len = copied;
+
+   str->start += reply_len;
+   if (str->start == str->end)
+      str->start = str->end = 0;
+
+   return copy_len;
+}
+
+/**
+ * @brief Read from server using current communication protocol.  Add \0 to end, if room.
+ *
+ * With a receive buffer attached (see stk_attach_replies()), this is
+ * stk_recv_reply(), and reads one complete reply.
+ */
+size_t stk_recv_line(const struct _stalker* talker, void* buffer, int buff_len)
+{
+   if (stk_replies_owner(talker)->replies)
+      return stk_recv_reply(talker, (char*)buffer, buff_len);
+
+   size_t bytes_read = (*talker->reader)(talker, buffer, buff_len);
+   if (bytes_read+1 < buff_len)
+      ((char*)buffer)[bytes_read] = '\0';
+   return bytes_read;
+}
+
+int seek_status_message(const struct _status_line* sl, const char *value)
+{
+   while (sl)
+   {
+      if ( 0 == strcasecmp(sl->message, value))
+         return 1;
+      sl = sl->next;
+   }
+
+   return 0;
+}
+
+void show_status_chain(const Status_Line *sl)
+{
+   while (sl)
+   {
+      printf("%d : \"[44;1m%s[m\"\n", sl->status, sl->message);
+      sl = sl->next;
+   }
+}
+
+
+/************************************
+ * Conditionally-compiled test code.
+ ***********************************/
+
+#ifdef SOCKTALK_MAIN
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <openssl/x509.h>
+
+#define HEADER_LINES 200
+#define ROUNDS 20
+
+/** Make a throwaway key and self-signed certificate for the test server. */
+SSL_CTX *make_server_context(void)
+{
+   SSL_CTX *context = SSL_CTX_new(TLS_server_method());
+   EVP_PKEY *key = EVP_EC_gen("P-256");
+   X509 *cert = X509_new();
+
+   ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+   X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+   X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+   X509_set_pubkey(cert, key);
+   X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                              (const unsigned char*)"localhost", -1, -1, 0);
+   X509_set_issuer_name(cert, X509_get_subject_name(cert));
+   X509_sign(cert, key, EVP_sha256());
+
+   SSL_CTX_use_certificate(context, cert);
+   SSL_CTX_use_PrivateKey(context, key);
+
+   X509_free(cert);
+   EVP_PKEY_free(key);
+   return context;
+}
+
+/** TLS server that answers each NOOP with 250 and QUIT with 221. */
+void tls_server(SSL_CTX *context, int fd)
+{
+   SSL *ssl = SSL_new(context);
+   STalker talker;
+   char buffer[1024];
+   int used = 0, bytes_read;
+   char *line, *end;
+
+   SSL_set_fd(ssl, fd);
+   if (SSL_accept(ssl) == 1)
+   {
+      init_ssl_talker(&talker, ssl);
+
+      while ((bytes_read = stk_ssl_reader(&talker, buffer + used, sizeof(buffer) - used - 1)) > 0)
+      {
+         used += bytes_read;
+         buffer[used] = '\0';
+
+         line = buffer;
+         while ((end = strstr(line, "\r\n")))
+         {
+            if (strncmp(line, "NOOP", 4) == 0)
+               stk_ssl_talker(&talker, "250 OK\r\n", 8);
+            else if (strncmp(line, "QUIT", 4) == 0)
+               stk_ssl_talker(&talker, "221 Bye\r\n", 9);
+            line = end + 2;
+         }
+
+         memmove(buffer, line, buffer + used - line);
+         used -= line - buffer;
+      }
+   }
+
+   SSL_free(ssl);
+   close(fd);
+}
+
+/** Send ROUNDS batches of header lines, each ending with a NOOP, then QUIT. */
+int run_client(STalker *talker)
+{
+   char buffer[256];
+   int round, line;
+
+   for (round = 0; round < ROUNDS; ++round)
+   {
+      stk_set_more(talker, 1);
+      for (line = 0; line < HEADER_LINES; ++line)
+         stk_send_line(talker, "X-Test-Header: some value to encrypt", NULL);
+      stk_set_more(talker, 0);
+
+      stk_send_line(talker, "NOOP", NULL);
+      if (stk_recv_reply(talker, buffer, sizeof(buffer)) == 0 || strncmp(buffer, "250", 3))
+         return 0;
+   }
+
+   stk_send_line(talker, "QUIT", NULL);
+   return stk_recv_reply(talker, buffer, sizeof(buffer)) > 0 && strncmp(buffer, "221", 3) == 0;
+}
+
+double elapsed_ms(const struct timespec *start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/** Make a connected pair of loopback TCP sockets, which kTLS can use. */
+int tcp_pair(int pair[2])
+{
+   struct sockaddr_in addr;
+   socklen_t addr_len = sizeof(addr);
+   int listener = socket(AF_INET, SOCK_STREAM, 0);
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   if (bind(listener, (struct sockaddr*)&addr, sizeof(addr))
+       || listen(listener, 1)
+       || getsockname(listener, (struct sockaddr*)&addr, &addr_len)
+       || (pair[0] = socket(AF_INET, SOCK_STREAM, 0)) < 0
+       || connect(pair[0], (struct sockaddr*)&addr, sizeof(addr))
+       || (pair[1] = accept(listener, NULL, NULL)) < 0)
+   {
+      close(listener);
+      return -1;
+   }
+
+   close(listener);
+   return 0;
+}
+
+/** Run the client over a new connection to a forked server, with or without memory BIOs. */
+int test_tls(SSL_CTX *server_context, SSL_CTX *client_context, int use_memory)
+{
+   int pair[2], ok = 0;
+   pid_t child;
+   SSL *ssl;
+   STalker sock_talker, talker;
+   STMemTLS mt;
+   STReplies replies;
+   char reply_buffer[STK_REPLY_BUFFER_SIZE];
+   struct timespec start;
+
+   if (tcp_pair(pair))
+      return 0;
+
+   fflush(stdout);
+   if ((child = fork()) == 0)
+   {
+      close(pair[0]);
+      tls_server(server_context, pair[1]);
+      exit(0);
+   }
+   close(pair[1]);
+
+   ssl = SSL_new(client_context);
+   init_sock_talker(&sock_talker, &pair[0]);
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   if (use_memory)
+   {
+      if (init_mem_tls_talker(&talker, &mt, ssl, &sock_talker) && stk_mem_tls_handshake(&talker) == 1)
+      {
+         stk_attach_replies(&talker, &replies, reply_buffer, sizeof(reply_buffer));
+         ok = run_client(&talker);
+      }
+   }
+   else
+   {
+      SSL_set_fd(ssl, pair[0]);
+      if (SSL_connect(ssl) == 1)
+      {
+         init_ssl_talker(&talker, ssl);
+         stk_attach_replies(&talker, &replies, reply_buffer, sizeof(reply_buffer));
+         ok = run_client(&talker);
+      }
+   }
+
+   printf("%-14s %s in %7.2f ms",
+          use_memory ? "Memory BIOs:" : "SSL_set_fd:",
+          ok ? "completed" : "[31;1mFAILED[m",
+          elapsed_ms(&start));
+
+   if (use_memory)
+   {
+      printf(", [32;1m%lu[m socket writes\n", mt.sends);
+      stk_dump_mem_tls(&mt, "   OpenSSL", stdout);
+      mem_tls_close(&mt);
+   }
+   else
+      printf(" (each line is its own record and socket write), kTLS send %s\n",
+             stk_ktls_send(&talker) ? "[32;1mon[m" : "off");
+
+   SSL_free(ssl);
+   close(pair[0]);
+   waitpid(child, NULL, 0);
+
+   return ok;
+}
+
+#define FILE_SIZE (1024 * 1024)
+
+enum { SEND_SOCKET, SEND_BUFFERED_MORE, SEND_COPY };
+
+/** A writer that hides the socket, so stk_send_file_range() must copy. */
+int relay_writer(const STalker *talker, const void *data, int data_len)
+{
+   return stk_sock_talker((const STalker*)talker->conduit, data, data_len);
+}
+
+/** Read from *fd* until end-of-file, and compare with *expected*. */
+int receive_and_compare(int fd, const char *expected, size_t expected_len)
+{
+   char *received = (char*)malloc(expected_len + 1);
+   size_t used = 0;
+   ssize_t bytes_read;
+
+   while (used <= expected_len && (bytes_read = read(fd, received + used, expected_len + 1 - used)) > 0)
+      used += bytes_read;
+
+   int same = used == expected_len && memcmp(received, expected, used) == 0;
+   free(received);
+   return same;
+}
+
+/**
+ * Send a line, a range of *file_data* (open as *fd*), and the line
+ * ending DATA, and have a forked reader check that all arrived in order.
+ */
+int test_file_range(const char *label, int mode, int fd, const char *file_data, off_t offset, size_t length)
+{
+   const char *before = "354 Go ahead\r\n";
+   const char *after = ".\r\n";
+   int pair[2], status, ok;
+   pid_t child;
+   STalker sock_talker, relay_talker, buffered_talker, *talker;
+   STBuffer stb;
+   STalkerStats stats;
+   char out_buffer[STK_BUFFER_SIZE];
+   struct timespec start;
+
+   if (tcp_pair(pair))
+      return 0;
+
+   fflush(stdout);
+   if ((child = fork()) == 0)
+   {
+      size_t expected_len = strlen(before) + length + strlen(after);
+      char *expected = (char*)malloc(expected_len);
+      strcpy(expected, before);
+      memcpy(expected + strlen(before), file_data + offset, length);
+      memcpy(expected + strlen(before) + length, after, strlen(after));
+
+      close(pair[0]);
+      exit(!receive_and_compare(pair[1], expected, expected_len));
+   }
+   close(pair[1]);
+
+   init_sock_talker(&sock_talker, &pair[0]);
+   stk_attach_stats(&sock_talker, &stats);
+   talker = &sock_talker;
+
+   if (mode == SEND_BUFFERED_MORE)
+   {
+      init_buffered_talker(&buffered_talker, &stb, &sock_talker, out_buffer, sizeof(out_buffer));
+      talker = &buffered_talker;
+      stk_set_more(talker, 1);
+   }
+   else if (mode == SEND_COPY)
+   {
+      memset(&relay_talker, 0, sizeof(relay_talker));
+      relay_talker.conduit = &sock_talker;
+      relay_talker.writer = relay_writer;
+      talker = &relay_talker;
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   ok = stk_write_all(talker, before, strlen(before))
+      && stk_send_file_range(talker, fd, offset, length);
+
+   stk_set_more(talker, 0);
+   ok = ok && stk_write_all(talker, after, strlen(after)) && stk_flush(talker);
+
+   printf("%-19s %7.3f ms, ", label, elapsed_ms(&start));
+   stk_dump_stats(&stats, "socket", stdout);
+
+   close(pair[0]);
+   waitpid(child, &status, 0);
+   ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+   if (!ok)
+      printf("   [31;1mFAILED[m\n");
+
+   return ok;
+}
+
+int test_file_ranges(void)
+{
+   char path[] = "/tmp/socktalk_XXXXXX";
+   char *file_data = (char*)malloc(FILE_SIZE);
+   STalker talker;
+   int fd, index, ok;
+
+   for (index = 0; index < FILE_SIZE; ++index)
+      file_data[index] = (index % 64 == 63) ? '\n' : 'a' + (index * 7) % 26;
+
+   if ((fd = mkstemp(path)) < 0 || write(fd, file_data, FILE_SIZE) != FILE_SIZE)
+      return 0;
+   unlink(path);
+
+   printf("\nSending %d bytes of a file, starting at offset 1000:\n", FILE_SIZE - 2000);
+
+   ok = test_file_range("sendfile:", SEND_SOCKET, fd, file_data, 1000, FILE_SIZE - 2000);
+   ok &= test_file_range("splice (MSG_MORE):", SEND_BUFFERED_MORE, fd, file_data, 1000, FILE_SIZE - 2000);
+   ok &= test_file_range("mapped copy:", SEND_COPY, fd, file_data, 1000, FILE_SIZE - 2000);
+
+   // A range past the end of the file is refused before anything is sent:
+   init_stdout_talker(&talker);
+   if (stk_send_file_range(&talker, fd, FILE_SIZE - 10, 20))
+   {
+      printf("[31;1mA range past the end of the file was accepted.[m\n");
+      ok = 0;
+   }
+
+   close(fd);
+   free(file_data);
+   return ok;
+}
+
+/** Gather-write more pieces than one writev() takes. */
+int test_long_writev(void)
+{
+   struct iovec iov[STK_MAX_IOV + 4];
+   char expected[2 * (STK_MAX_IOV + 4) + 1];
+   char received[sizeof(expected)];
+   int pair[2], index, bytes_read, total = 0, sent, ok;
+   STalker talker;
+
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+      return 0;
+
+   for (index = 0; index < STK_MAX_IOV + 4; ++index)
+   {
+      expected[2 * index] = 'a' + index;
+      expected[2 * index + 1] = '\n';
+      iov[index].iov_base = &expected[2 * index];
+      iov[index].iov_len = 2;
+   }
+
+   init_sock_talker(&talker, &pair[0]);
+   sent = stk_writev_all(&talker, iov, STK_MAX_IOV + 4);
+   close(pair[0]);
+
+   while (total < (int)sizeof(received)
+          && (bytes_read = read(pair[1], received + total, sizeof(received) - total)) > 0)
+      total += bytes_read;
+   close(pair[1]);
+
+   ok = sent && total == 2 * (STK_MAX_IOV + 4) && memcmp(received, expected, total) == 0;
+   printf("\n%d pieces gather-written: %s\n",
+          STK_MAX_IOV + 4,
+          ok ? "all sent" : "[31;1mFAILED[m");
+
+   return ok;
+}
+
+int refuse_next_write = 0;
+
+/** An inner writer that refuses a write when asked, like a full non-blocking socket. */
+int balky_writer(const STalker *talker, const void *data, int data_len)
+{
+   if (refuse_next_write)
+   {
+      refuse_next_write = 0;
+      return STK_WANT_WRITE;
+   }
+
+   return stk_sock_talker((const STalker*)talker->conduit, data, data_len);
+}
+
+int balky_reader(const STalker *talker, void *buffer, int buff_len)
+{
+   return stk_sock_reader((const STalker*)talker->conduit, buffer, buff_len);
+}
+
+/**
+ * Write a NOOP through memory BIOs whose inner talker refuses the
+ * first try, as evsession_flush() would, and check that the write
+ * waits for its records to be sent.
+ */
+int test_tls_want_write(SSL_CTX *server_context, SSL_CTX *client_context)
+{
+   int pair[2], result, wants = 0, ok = 0;
+   pid_t child;
+   SSL *ssl;
+   STalker sock_talker, balky_talker, talker;
+   STMemTLS mt;
+   STReplies replies;
+   char reply_buffer[STK_REPLY_BUFFER_SIZE];
+   char buffer[256];
+
+   if (tcp_pair(pair))
+      return 0;
+
+   fflush(stdout);
+   if ((child = fork()) == 0)
+   {
+      close(pair[0]);
+      tls_server(server_context, pair[1]);
+      exit(0);
+   }
+   close(pair[1]);
+
+   ssl = SSL_new(client_context);
+   init_sock_talker(&sock_talker, &pair[0]);
+   memset(&balky_talker, 0, sizeof(balky_talker));
+   balky_talker.conduit = &sock_talker;
+   balky_talker.writer = balky_writer;
+   balky_talker.reader = balky_reader;
+
+   if (init_mem_tls_talker(&talker, &mt, ssl, &balky_talker) && stk_mem_tls_handshake(&talker) == 1)
+   {
+      stk_attach_replies(&talker, &replies, reply_buffer, sizeof(reply_buffer));
+
+      refuse_next_write = 1;
+      while ((result = stk_mem_tls_writer(&talker, "NOOP\r\n", 6)) == STK_WANT_WRITE)
+         ++wants;
+
+      ok = result == 6
+         && wants == 1
+         && stk_mem_tls_pending(&talker) == 0
+         && stk_recv_reply(&talker, buffer, sizeof(buffer)) > 0
+         && strncmp(buffer, "250", 3) == 0;
+   }
+
+   printf("\nRefused TLS write: %s\n", ok ? "retried until sent" : "[31;1mFAILED[m");
+
+   mem_tls_close(&mt);
+   SSL_free(ssl);
+   close(pair[0]);
+   waitpid(child, NULL, 0);
+
+   return ok;
+}
+
+int main(int argc, const char **argv)
+{
+   SSL_CTX *server_context = make_server_context();
+   SSL_CTX *client_context = SSL_CTX_new(TLS_client_method());
+   int ok;
+
+   printf("%d rounds of %d header lines and a NOOP:\n", ROUNDS, HEADER_LINES);
+
+   ok = test_tls(server_context, client_context, 0);
+   ok &= test_tls(server_context, client_context, 1);
+
+   ok &= test_tls_want_write(server_context, client_context);
+
+#ifdef SSL_OP_ENABLE_KTLS
+   SSL_CTX_set_options(client_context, SSL_OP_ENABLE_KTLS);
+   ok &= test_tls(server_context, client_context, 0);
+#endif
+
+   SSL_CTX_free(client_context);
+   SSL_CTX_free(server_context);
+
+   ok &= test_file_ranges();
+   ok &= test_long_writev();
+
+   return !ok;
+}
+
+#endif
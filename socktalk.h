@@ -1,9 +1,11 @@
 #ifndef SOCKTALK_H
 #define SOCKTALK_H
 
+#include <stdio.h>         // for FILE
 #include <sys/types.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h>       // for struct iovec
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/conf.h>
@@ -13,6 +15,7 @@ struct _stalker;
 
 typedef int (*SockWriter)(const struct _stalker*, const void *data, int data_len);
 typedef int (*SockReader)(const struct _stalker*, void *buffer, int buff_len);
+typedef int (*SockWriterV)(const struct _stalker*, const struct iovec *iov, int iov_count);
 
 
 /**
@@ -46,6 +49,39 @@ int stk_stdout_talker(const struct _stalker* talker, const void *data, int data_
 int stk_sock_reader(const struct _stalker* talker, void *buffer, int buff_len);
 int stk_ssl_reader(const struct _stalker* talker, void *buffer, int buff_len);
 
+int stk_sock_writev(const struct _stalker* talker, const struct iovec *iov, int iov_count);
+
+/**
+ * Non-blocking talkers return STK_WANT_READ or STK_WANT_WRITE instead
+ * of waiting, meaning the call should be repeated when the socket is
+ * ready for reading or writing.  (An SSL talker may need to read in
+ * order to write, or the reverse.)  Use them with an EVLoop.
+ */
+#define STK_WANT_READ  -2
+#define STK_WANT_WRITE -3
+
+int stk_nb_sock_talker(const struct _stalker* talker, const void *data, int data_len);
+int stk_nb_sock_writev(const struct _stalker* talker, const struct iovec *iov, int iov_count);
+int stk_nb_sock_reader(const struct _stalker* talker, void *buffer, int buff_len);
+int stk_nb_ssl_talker(const struct _stalker* talker, const void *data, int data_len);
+int stk_nb_ssl_reader(const struct _stalker* talker, void *buffer, int buff_len);
+
+/**
+ * @brief Whether the kernel encrypts what an SSL talker sends (kTLS),
+ *        or decrypts what it receives.
+ *
+ * True only if kTLS was enabled for the connection, with
+ * SSL_OP_ENABLE_KTLS, and the kernel accepted the negotiated cipher.
+ */
+int stk_ktls_send(const struct _stalker *talker);
+int stk_ktls_recv(const struct _stalker *talker);
+
+/** Continue the TLS handshake of a non-blocking SSL talker.  Returns 1 when complete. */
+int stk_ssl_handshake(const struct _stalker *talker);
+
+int stk_buffered_writer(const struct _stalker* talker, const void *data, int data_len);
+int stk_buffered_reader(const struct _stalker* talker, void *buffer, int buff_len);
+
 /**
  * @brief Linked-list structure for preserving results of a socket read.
  */
@@ -59,20 +95,233 @@ typedef struct _status_line
 
 typedef struct _stalker
 {
-   void       *conduit;
-   SockWriter writer;
-   SockReader reader;
+   void        *conduit;
+   SockWriter  writer;
+   SockReader  reader;
+   SockWriterV writev;     // optional, NULL if the conduit has no gather-write
+   int         flags;
+   struct _stalker_replies *replies;   // optional, see stk_attach_replies()
+   struct _stalker_stats   *stats;     // optional, see stk_attach_stats()
 } STalker;
 
+// STalker::flags values
+#define STK_MORE 1         // more data follows soon: let the kernel hold partial packets
+
+// Most pieces sent with one gather-write by stk_vsend_line()
+#define STK_MAX_IOV 16
+
+/**
+ * @brief Output buffer for a buffered STalker, which collects the
+ *        bytes written through it to send them to another STalker
+ *        in fewer, larger writes.
+ *
+ * The buffer is flushed when it fills, before any read (because
+ * a reply is about to be awaited), and by stk_flush().
+ */
+typedef struct _stalker_buffer
+{
+   const struct _stalker *inner;
+   char                  *buffer;
+   int                   buffer_len;
+   int                   used;
+} STBuffer;
+
+// Suggested STBuffer buffer size, the largest TLS record payload
+#define STK_BUFFER_SIZE (16 * 1024)
+
+/**
+ * @brief Receive buffer that frames complete SMTP replies for an STalker.
+ *
+ * Bytes are read in as large pieces as the buffer allows.  Each call
+ * to stk_recv_reply() returns one complete reply, including all the
+ * "250-" continuation lines of a multi-line reply, and keeps any
+ * bytes that follow it for the next call.  That lets several
+ * pipelined replies arrive in one read without any being lost.
+ */
+typedef struct _stalker_replies
+{
+   char *buffer;
+   int  buffer_len;
+   int  start;          // offset of the first byte not yet returned
+   int  end;            // offset after the last byte received
+} STReplies;
+
+// Suggested STReplies buffer size
+#define STK_REPLY_BUFFER_SIZE 4096
+
+/**
+ * @brief I/O counters for a socket or SSL talker.
+ *
+ * With a stats block attached, each writer and reader call is counted
+ * and timed, at the cost of two clock_gettime() calls.  For an SSL
+ * talker, bytes are the plaintext and the record count is estimated
+ * from the sizes written.
+ */
+typedef struct _stalker_stats
+{
+   unsigned long long bytes_out;
+   unsigned long long bytes_in;
+   unsigned long      write_calls;
+   unsigned long      read_calls;
+   unsigned long      short_writes;     // writes that sent less than requested
+   unsigned long      would_block;      // EAGAIN, or SSL wanting to read or write
+   unsigned long      errors;
+   unsigned long      tls_records_out;
+   unsigned long long write_ns;         // time spent in writer calls
+   unsigned long long read_ns;          // time spent in reader calls, including waiting
+} STalkerStats;
+
+/** Start counting I/O for *talker* in *stats*, which is cleared. */
+void stk_attach_stats(struct _stalker *talker, STalkerStats *stats);
+
+/** The stats block of *talker*, or of the talker it wraps, or NULL. */
+const STalkerStats *stk_get_stats(const struct _stalker *talker);
+
+/** Print one line of statistics to *target* (stderr if NULL). */
+void stk_dump_stats(const STalkerStats *stats, const char *label, FILE *target);
+
+/**
+ * @brief TLS through memory: SSL encrypts into and decrypts from a
+ *        BIO pair, and another STalker carries the ciphertext.
+ *
+ * Ciphertext moves only when this library moves it.  While STK_MORE
+ * is set, the records of several writes collect in the BIO pair, to
+ * be sent in one inner write by stk_flush() or before the next read.
+ * The inner talker can be a socket talker, a non-blocking socket
+ * talker, or anything else that carries bytes.  As with SSL_write(),
+ * a write that returns STK_WANT_WRITE must be repeated with the same
+ * data, which is then counted as written once its records are sent.
+ *
+ * Time spent in OpenSSL is counted here, apart from the time spent
+ * by the inner talker, which can have its own STalkerStats.
+ */
+typedef struct _stalker_mem_tls
+{
+   SSL                   *ssl;
+   BIO                   *network;      // this end of the BIO pair, SSL has the other
+   const struct _stalker *inner;        // carries the ciphertext
+   unsigned long long    crypto_ns;     // time in SSL_connect(), SSL_write() and SSL_read()
+   unsigned long         crypto_calls;
+   unsigned long long    cipher_out;    // ciphertext bytes sent
+   unsigned long long    cipher_in;     // ciphertext bytes received
+   unsigned long         sends;         // inner writes of ciphertext
+   int                   accepted;      // plaintext taken by a write that returned STK_WANT_WRITE
+} STMemTLS;
+
+// Size of each direction of the BIO pair, room for several full TLS records
+#define STK_TLS_BIO_SIZE (64 * 1024)
+
+int stk_mem_tls_writer(const struct _stalker* talker, const void *data, int data_len);
+int stk_mem_tls_reader(const struct _stalker* talker, void *buffer, int buff_len);
+
+/**
+ * @brief Prepare *talker* to run TLS on *ssl* with its ciphertext
+ *        carried by *inner*.
+ *
+ * The SSL gets a new BIO pair, replacing any file descriptor or BIO
+ * already set.  Call stk_mem_tls_handshake() before writing.
+ *
+ * @return 1 for success, 0 if the BIO pair could not be made.
+ */
+int init_mem_tls_talker(struct _stalker *talker, STMemTLS *mt, SSL *ssl, const struct _stalker *inner);
+
+/** Free the BIO pair end kept by *mt*.  SSL_free() frees the other. */
+void mem_tls_close(STMemTLS *mt);
+
+/**
+ * @brief Perform the TLS handshake of a memory TLS talker.
+ *
+ * @return 1 when complete, -1 for failure, or with a non-blocking
+ *         inner talker, STK_WANT_READ or STK_WANT_WRITE.
+ */
+int stk_mem_tls_handshake(const struct _stalker *talker);
+
+/** Ciphertext bytes waiting to be sent by a memory TLS talker. */
+int stk_mem_tls_pending(const struct _stalker *talker);
+
+int is_mem_tls_talker(const STalker *talker);
+
+/** Print the crypto and ciphertext counts of *mt* to *target* (stderr if NULL). */
+void stk_dump_mem_tls(const STMemTLS *mt, const char *label, FILE *target);
+
 /** STalker initialization functions to prepare STalker to call send_line, recv_line. */
 void init_ssl_talker(struct _stalker* talker, SSL* ssl);
 void init_sock_talker(struct _stalker* talker, int* socket);
 void init_stdout_talker(struct _stalker *talker);
 
+/** Non-blocking talkers, which also set O_NONBLOCK.  Return 0 if that failed. */
+int init_nb_sock_talker(struct _stalker* talker, int* socket);
+int init_nb_ssl_talker(struct _stalker* talker, SSL* ssl);
+void init_buffered_talker(struct _stalker *talker,
+                          STBuffer *stb,
+                          const struct _stalker *inner,
+                          char *buffer,
+                          int buffer_len);
+
 int is_socket_talker(const STalker *talker);
 int is_ssl_talker(const STalker *talker);
+int is_buffered_talker(const STalker *talker);
+int is_nonblocking_talker(const STalker *talker);
 int get_socket_handle(const STalker *talker);
 
+/** Return the STalker that does the actual I/O, looking past any buffered talkers. */
+const STalker *stk_base_talker(const STalker *talker);
+
+/**
+ * @brief Give *talker* a receive buffer so stk_recv_reply() and
+ *        stk_recv_line() return complete replies.
+ *
+ * Attach it to the transport talker (socket or SSL), after init_*_talker().
+ * Wrapping talkers, like a buffered talker, use the buffer of the
+ * talker they wrap.
+ */
+void stk_attach_replies(struct _stalker *talker, STReplies *str, char *buffer, int buffer_len);
+
+/**
+ * @brief Discard received bytes not yet returned as a reply.
+ *
+ * Use when the conversation changes underneath the talker, as with
+ * STARTTLS, after which nothing sent before the TLS handshake may be
+ * trusted.
+ *
+ * @return The number of bytes discarded.
+ */
+int stk_discard_received(const struct _stalker *talker);
+
+/** Set or clear STK_MORE, which socket talkers pass to the kernel as MSG_MORE. */
+void stk_set_more(struct _stalker *talker, int more);
+
+/** Write every byte of *iov*, using the talker's gather-write if it has one. */
+int stk_writev_all(const struct _stalker *talker, const struct iovec *iov, int iov_count);
+
+/**
+ * Send any bytes held by a buffered talker, or ciphertext held by a
+ * memory TLS talker.  Returns 0 if the write failed or would block.
+ */
+int stk_flush(const struct _stalker *talker);
+
+// Largest piece written at once when a file range must be copied
+#define STK_FILE_CHUNK (64 * 1024)
+
+/**
+ * @brief Send *length* bytes of file *fd*, starting at *offset*,
+ *        after anything *talker* is holding.
+ *
+ * A socket talker has the kernel move the bytes, with sendfile(), or
+ * with splice() while STK_MORE is set so the end of the range waits
+ * for what follows.  An SSL talker whose connection uses kTLS sends
+ * them with SSL_sendfile().  Other talkers write the range from a
+ * read-only mapping of the file, or, for files that cannot be mapped,
+ * through a STK_FILE_CHUNK buffer.
+ *
+ * The file position of *fd* is not changed.  Meant for blocking
+ * talkers: a non-blocking talker fails when the socket is full.
+ *
+ * @return 1 for success, 0 if the file was shorter than the range,
+ *         or reading or writing failed.
+ */
+int stk_send_file_range(const struct _stalker *talker, int fd, off_t offset, size_t length);
+
 /**
  * Functions that actually read or write using the STalker object.
  */
@@ -81,8 +330,20 @@ size_t stk_simple_send_unlined(const struct _stalker* talker, const char *data,
 size_t stk_vsend_line(const struct _stalker* talker, va_list args);
 size_t stk_send_line(const struct _stalker* talker, ...);
 size_t stk_recv_line(const struct _stalker* talker, void *buffer, int buff_len);
-/** Send text like std_send_line, read and check response before returning. */
-int stk_send_recv_line(const struct _stalker *talker, ...);
+
+/**
+ * @brief Read one complete SMTP reply, of one or more lines, into *buffer*.
+ *
+ * Without an attached STReplies buffer, this is a single read.  A
+ * reply longer than *buff_len* is truncated, but consumed entirely.
+ *
+ * With a non-blocking talker, a partial reply is kept in the STReplies
+ * buffer and STK_WANT_READ or STK_WANT_WRITE is returned.
+ *
+ * @return The number of bytes copied to *buffer*, which is always
+ *         NULL-terminated, or 0 if the connection failed or closed.
+ */
+int stk_recv_reply(const struct _stalker *talker, char *buffer, int buff_len);
 
 /**
  * @brief Given a chain of Status_Line, return 1 if a given message can be found, 0 otherwise.
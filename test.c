@@ -1,4 +1,4 @@
-// -*- compile-command: "base=test; gcc -Wall -Werror -ggdb -DDEBUG -o $base ${base}.c -lcode64 -Wl,-R,. libmailtk.so" -*-
+// -*- compile-command: "base=test; gcc -Wall -Werror -ggdb -DDEBUG -D_GNU_SOURCE -o $base ${base}.c -lcode64 -Wl,-R,. libmailtk.so" -*-
 
 #include "mailtk.h"
 #include <stdio.h>
@@ -83,28 +83,19 @@ int mtk_auth_login(STalker *talker, const void *data)
    char *output = (char*)alloca(len_output);
 
    char recv_buffer[256];
-   int recv_status;
+   SMTPReply reply;
 
-   stk_send_line(talker, "AUTH LOGIN ", NULL);
-   stk_recv_line(talker, recv_buffer, sizeof(recv_buffer));
-   recv_status = atoi(recv_buffer);
-   if (recv_status == 334)
+   if (smtp_command(talker, &reply, recv_buffer, sizeof(recv_buffer), "AUTH LOGIN ", NULL) == 334)
    {
       c64_encode_to_buffer(login, len_login, (uint32_t*)output, len_output);
-      stk_send_line(talker, output, NULL);
-      stk_recv_line(talker, recv_buffer, sizeof(recv_buffer));
-      recv_status = atoi(recv_buffer);
-      if (recv_status == 334)
+      if (smtp_command(talker, &reply, recv_buffer, sizeof(recv_buffer), output, NULL) == 334)
       {
          c64_encode_to_buffer(password, len_password, (uint32_t*)output, len_output);
-         stk_send_line(talker, output, NULL);
-         stk_recv_line(talker, recv_buffer, sizeof(recv_buffer));
-         recv_status = atoi(recv_buffer);
-         return recv_status == 235;
+         return smtp_command(talker, &reply, recv_buffer, sizeof(recv_buffer), output, NULL) == 235;
       }
    }
    else
-      fprintf(stderr, "AUTH LOGIN failed: \"%s\"\n", recv_buffer);
+      smtp_log_reply_error(&reply, "AUTH LOGIN");
 
    return 0;
 }
@@ -125,7 +116,7 @@ int mtk_auth_plain(STalker *talker, const void *data)
    char *source_str = (char*)alloca(len_together);
    char *coded_str = (char*)alloca(len_coded);
    char recv_buffer[256];
-   int recv_status;
+   SMTPReply reply;
 
    char *ptr = source_str;
    
@@ -138,15 +129,11 @@ int mtk_auth_plain(STalker *talker, const void *data)
 
    c64_encode_to_buffer(source_str, len_together, (uint32_t*)coded_str, len_coded);
 
-   stk_send_line(talker, "AUTH PLAIN ", coded_str, NULL);
-   stk_recv_line(talker, recv_buffer, sizeof(recv_buffer));
-   recv_status = atoi(recv_buffer);
-
-   if (recv_status == 235)
+   if (smtp_command(talker, &reply, recv_buffer, sizeof(recv_buffer), "AUTH PLAIN ", coded_str, NULL) == 235)
       return 1;
    else
    {
-      fprintf(stderr, "AUTH PLAIN failed: \"%s\"\n", recv_buffer);
+      smtp_log_reply_error(&reply, "AUTH PLAIN");
       return 0;
    }
 }
@@ -177,15 +164,13 @@ int mtk_say_ehlo_get_smtp_caps(STalker *talker, SocketSpec *specs)
 {
    char buffer[2048];
    SMTPCaps *scaps = &specs->smtp_caps;
-   int bytes_read;
+   SMTPReply reply;
 
    memset(scaps, 0, sizeof(SMTPCaps));
 
-   stk_send_line(talker, "EHLO ", specs->host_url, NULL);
-   bytes_read = stk_recv_line(talker, buffer, sizeof(buffer));
-   if (bytes_read > 0)
+   if (smtp_command(talker, &reply, buffer, sizeof(buffer), "EHLO ", specs->host_url, NULL))
    {
-      parse_ehlo_response(scaps, buffer, bytes_read);
+      parse_ehlo_response(scaps, buffer, reply.reply_len);
       return 1;
    }
    else
@@ -242,14 +227,13 @@ void mtk_internal_receive_socket_talker(STalker *talker, void *data)
    TCParams *tcp = (TCParams*)data;
    SocketSpec *ss = (SocketSpec*)tcp->data;
    char buffer[1024];
-   int reply_status;
-   int bytes_received;
+   SMTPReply reply;
    int is_smtp = mtk_is_smtp(ss);
 
    // Read SMTP server greeting
    if (is_smtp)
    {
-      stk_recv_line(talker, buffer, sizeof(buffer));
+      smtp_recv_reply(talker, &reply, buffer, sizeof(buffer));
       mtk_say_ehlo_get_smtp_caps(talker, ss);
    }
 
@@ -264,10 +248,8 @@ void mtk_internal_receive_socket_talker(STalker *talker, void *data)
          }
          else
          {
-            stk_send_line(talker, "STARTTLS", NULL);
-            bytes_received = stk_recv_line(talker, buffer, sizeof(buffer));
-            reply_status = atoi(buffer);
-            if (bytes_received > 0 && reply_status < 400)
+            if (smtp_command(talker, &reply, buffer, sizeof(buffer), "STARTTLS", NULL)
+                && smtp_reply_positive(&reply))
             {
                open_ssl_talker(talker, data, mtk_internal_receive_ssl_talker);
                goto abort_process;
@@ -275,7 +257,7 @@ void mtk_internal_receive_socket_talker(STalker *talker, void *data)
             }
             else
             {
-               fprintf(stderr, "STARTTLS failed \"%s\"\n", buffer);
+               smtp_log_reply_error(&reply, "STARTTLS");
                goto abort_process;
             }
          }
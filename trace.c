@@ -0,0 +1,471 @@
+// -*- compile-command: "base=trace; gcc -Wall -Werror -ggdb -DTRACE_MAIN -DDEBUG -D_GNU_SOURCE -o $base ${base}.c socktalk.c smtp_reply.c smtp_caps.c smtp_iact.c smtp_data.c linedrop.c linescan.c arena.c logging.c -lssl -lcrypto" -*-
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+
+#include "trace.h"
+#include "logging.h"
+
+static unsigned long long trace_now_ns(void)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/****************
+ * Recording
+ ***************/
+
+static void recorder_save(STRecorder *rec, char type, const void *data, int data_len)
+{
+   unsigned long long now = trace_now_ns();
+   uint32_t delay_us = (now - rec->last_ns) / 1000;
+   uint32_t length = data_len;
+   char header[TRACE_RECORD_HEADER];
+
+   header[0] = type;
+   memcpy(&header[1], &delay_us, sizeof(delay_us));
+   memcpy(&header[5], &length, sizeof(length));
+
+   fwrite(header, sizeof(header), 1, rec->trace);
+   fwrite(data, data_len, 1, rec->trace);
+
+   rec->last_ns = now;
+}
+
+int stk_recording_writer(const STalker *talker, const void *data, int data_len)
+{
+   STRecorder *rec = (STRecorder*)talker->conduit;
+   int result = (*rec->inner->writer)(rec->inner, data, data_len);
+
+   if (result > 0)
+      recorder_save(rec, 'W', data, result);
+
+   return result;
+}
+
+int stk_recording_reader(const STalker *talker, void *buffer, int buff_len)
+{
+   STRecorder *rec = (STRecorder*)talker->conduit;
+   int result = (*rec->inner->reader)(rec->inner, buffer, buff_len);
+
+   if (result > 0)
+      recorder_save(rec, 'R', buffer, result);
+
+   return result;
+}
+
+int init_recording_talker(STalker *talker, STRecorder *rec, const STalker *inner, const char *trace_path)
+{
+   memset(rec, 0, sizeof(STRecorder));
+   rec->inner = inner;
+
+   if (!(rec->trace = fopen(trace_path, "wb")))
+   {
+      log_error_message(1, "Failed to create trace file \"", trace_path, "\": ", strerror(errno), NULL);
+      return 0;
+   }
+
+   fwrite(TRACE_MAGIC, TRACE_MAGIC_LEN, 1, rec->trace);
+   rec->last_ns = trace_now_ns();
+
+   memset(talker, 0, sizeof(STalker));
+   talker->conduit = rec;
+   talker->writer = stk_recording_writer;
+   talker->reader = stk_recording_reader;
+   talker->flags = inner->flags;
+
+   return 1;
+}
+
+void recorder_close(STRecorder *rec)
+{
+   if (rec->trace)
+      fclose(rec->trace);
+
+   rec->trace = NULL;
+}
+
+/****************
+ * Replaying
+ ***************/
+
+typedef struct _trace_record
+{
+   char       type;
+   uint32_t   delay_us;
+   uint32_t   length;
+   const char *data;
+} TraceRecord;
+
+/** Read the record at rp->record.  Returns 0 at the end of the trace. */
+static int replay_record(const STReplayer *rp, TraceRecord *tr)
+{
+   const char *header = rp->trace + rp->record;
+
+   if (rp->record + TRACE_RECORD_HEADER > rp->trace_len)
+      return 0;
+
+   tr->type = header[0];
+   memcpy(&tr->delay_us, &header[1], sizeof(tr->delay_us));
+   memcpy(&tr->length, &header[5], sizeof(tr->length));
+   tr->data = header + TRACE_RECORD_HEADER;
+
+   // A truncated last record ends the trace:
+   return rp->record + TRACE_RECORD_HEADER + tr->length <= rp->trace_len;
+}
+
+static void replay_next_record(STReplayer *rp, const TraceRecord *tr)
+{
+   rp->record += TRACE_RECORD_HEADER + tr->length;
+   rp->consumed = 0;
+}
+
+/** Wait until the recorded delay, scaled, has passed since the last replayed record. */
+static void replay_wait(STReplayer *rp, uint32_t delay_us)
+{
+   unsigned long long due = rp->last_ns + (unsigned long long)(delay_us * 1000.0 * rp->time_scale);
+   unsigned long long now = trace_now_ns();
+   struct timespec pause;
+
+   if (rp->time_scale > 0 && due > now)
+   {
+      pause.tv_sec = (due - now) / 1000000000ULL;
+      pause.tv_nsec = (due - now) % 1000000000ULL;
+      while (nanosleep(&pause, &pause) && errno == EINTR)
+         ;
+   }
+}
+
+int stk_replay_writer(const STalker *talker, const void *data, int data_len)
+{
+   STReplayer *rp = (STReplayer*)talker->conduit;
+   const char *ptr = (const char*)data;
+   const char *end = ptr + data_len;
+   TraceRecord tr;
+   int bite;
+
+   while (ptr < end)
+   {
+      if (!replay_record(rp, &tr) || tr.type != 'W')
+      {
+         // Written beyond what was recorded:
+         ++rp->mismatches;
+         break;
+      }
+
+      if (rp->consumed == 0)
+         replay_wait(rp, tr.delay_us);
+
+      bite = tr.length - rp->consumed;
+      if (bite > end - ptr)
+         bite = end - ptr;
+
+      if (memcmp(ptr, tr.data + rp->consumed, bite))
+         ++rp->mismatches;
+
+      ptr += bite;
+      rp->consumed += bite;
+      if (rp->consumed == tr.length)
+         replay_next_record(rp, &tr);
+   }
+
+   rp->last_ns = trace_now_ns();
+   return data_len;
+}
+
+int stk_replay_reader(const STalker *talker, void *buffer, int buff_len)
+{
+   STReplayer *rp = (STReplayer*)talker->conduit;
+   TraceRecord tr;
+   int bite;
+
+   // Skip recorded writes the client didn't make:
+   while (replay_record(rp, &tr) && tr.type == 'W')
+   {
+      ++rp->mismatches;
+      replay_next_record(rp, &tr);
+   }
+
+   if (!replay_record(rp, &tr))
+      return 0;
+
+   if (rp->consumed == 0)
+      replay_wait(rp, tr.delay_us);
+
+   bite = tr.length - rp->consumed;
+   if (bite > buff_len)
+      bite = buff_len;
+
+   memcpy(buffer, tr.data + rp->consumed, bite);
+   rp->consumed += bite;
+   if (rp->consumed == tr.length)
+      replay_next_record(rp, &tr);
+
+   rp->last_ns = trace_now_ns();
+   return bite;
+}
+
+int init_replay_talker(STalker *talker, STReplayer *rp, const char *trace_path, double time_scale)
+{
+   FILE *file;
+   long file_len;
+
+   memset(rp, 0, sizeof(STReplayer));
+   rp->time_scale = time_scale;
+
+   if (!(file = fopen(trace_path, "rb")))
+   {
+      log_error_message(1, "Failed to open trace file \"", trace_path, "\": ", strerror(errno), NULL);
+      return 0;
+   }
+
+   if (fseek(file, 0, SEEK_END) == 0
+       && (file_len = ftell(file)) >= TRACE_MAGIC_LEN
+       && fseek(file, 0, SEEK_SET) == 0
+       && (rp->trace = (char*)malloc(file_len))
+       && fread(rp->trace, file_len, 1, file) == 1
+       && memcmp(rp->trace, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0)
+   {
+      rp->trace_len = file_len;
+   }
+   else
+   {
+      log_error_message(1, "Failed to load trace file \"", trace_path, "\".", NULL);
+      free(rp->trace);
+      rp->trace = NULL;
+   }
+
+   fclose(file);
+
+   if (!rp->trace)
+      return 0;
+
+   replay_rewind(rp);
+
+   memset(talker, 0, sizeof(STalker));
+   talker->conduit = rp;
+   talker->writer = stk_replay_writer;
+   talker->reader = stk_replay_reader;
+
+   return 1;
+}
+
+void replay_rewind(STReplayer *rp)
+{
+   rp->record = TRACE_MAGIC_LEN;
+   rp->consumed = 0;
+   rp->mismatches = 0;
+   rp->last_ns = trace_now_ns();
+}
+
+void replay_close(STReplayer *rp)
+{
+   free(rp->trace);
+   rp->trace = NULL;
+}
+
+
+/************************************
+ * Conditionally-compiled test code.
+ ***********************************/
+
+#ifdef TRACE_MAIN
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include "smtp_reply.h"
+#include "smtp_caps.h"
+#include "smtp_iact.h"
+#include "smtp_data.h"
+
+#define REPLAYS 10000
+
+/**
+ * Minimal SMTP server for recording, run in a child process.  Each
+ * reply is delayed a millisecond so the trace has some timing.
+ */
+void fake_server(int fd)
+{
+   char buffer[4096];
+   int used = 0, bytes_read, in_data = 0;
+   char *line, *end;
+   const char *reply;
+
+   write(fd, "220 fake.example.com ESMTP\r\n", 28);
+
+   while ((bytes_read = read(fd, buffer + used, sizeof(buffer) - used - 1)) > 0)
+   {
+      used += bytes_read;
+      buffer[used] = '\0';
+
+      line = buffer;
+      while ((end = strstr(line, "\r\n")))
+      {
+         reply = NULL;
+         if (in_data)
+         {
+            if (end == line + 1 && *line == '.')
+            {
+               reply = "250 2.0.0 Queued\r\n";
+               in_data = 0;
+            }
+         }
+         else if (strncmp(line, "EHLO", 4) == 0)
+            reply = "250-fake.example.com\r\n250-PIPELINING\r\n250-8BITMIME\r\n250 ENHANCEDSTATUSCODES\r\n";
+         else if (strncmp(line, "DATA", 4) == 0)
+         {
+            reply = "354 Go ahead\r\n";
+            in_data = 1;
+         }
+         else if (strncmp(line, "QUIT", 4) == 0)
+            reply = "221 2.0.0 Bye\r\n";
+         else
+            reply = "250 2.1.0 OK\r\n";
+
+         if (reply)
+         {
+            usleep(1000);
+            write(fd, reply, strlen(reply));
+         }
+
+         line = end + 2;
+      }
+
+      memmove(buffer, line, buffer + used - line);
+      used -= line - buffer;
+   }
+
+   close(fd);
+}
+
+const char *recipients[] = { "first@example.com", "+second@example.com", "-third@example.com", NULL };
+const char *body[] = { "Subject: Trace test", "", "A short message.", ".leading period", NULL };
+
+void send_message(RecipLink *chain, void *data)
+{
+   const STalker *talker = (const STalker*)data;
+   char buffer[1024];
+   char data_buffer[SMTP_DATA_CHUNK];
+   SMTPReply reply;
+   ListLineDropper lld;
+   LineDrop ld;
+   DataEncoder de;
+
+   if (smtp_send_envelope((STalker*)talker, "sender@example.com", chain) == 0)
+      return;
+
+   if (smtp_command(talker, &reply, buffer, sizeof(buffer), "DATA", NULL) != 354)
+      return;
+
+   list_init_dropper(&lld, body);
+   init_list_line_drop(&ld, &lld);
+   ld.break_check = NULL;
+
+   data_encoder_init(&de, talker, data_buffer, sizeof(data_buffer));
+   data_encoder_put_lines(&de, &ld);
+   data_encoder_finish(&de);
+
+   smtp_recv_reply(talker, &reply, buffer, sizeof(buffer));
+}
+
+/** The session to record and replay: greeting, EHLO, one message, QUIT. */
+int run_session(STalker *talker)
+{
+   char buffer[1024];
+   SMTPReply reply;
+   SMTPCaps caps;
+   ListLineDropper lld;
+   LineDrop ld;
+
+   if (smtp_recv_reply(talker, &reply, buffer, sizeof(buffer)) != 220)
+      return 0;
+
+   memset(&caps, 0, sizeof(caps));
+   if (smtp_command(talker, &reply, buffer, sizeof(buffer), "EHLO client.example.com", NULL) != 250)
+      return 0;
+   parse_ehlo_response(&caps, buffer, reply.reply_len);
+
+   list_init_dropper(&lld, recipients);
+   init_list_line_drop(&ld, &lld);
+   ld.break_check = NULL;
+   build_recip_chain(send_message, &ld, talker);
+
+   return smtp_command(talker, &reply, buffer, sizeof(buffer), "QUIT", NULL) == 221;
+}
+
+double elapsed_ms(const struct timespec *start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int main(int argc, const char **argv)
+{
+   const char *trace_path = argc > 1 ? argv[1] : "session.trace";
+   int pair[2], index, ok = 1;
+   pid_t child;
+   struct timespec start;
+
+   STalker sock_talker, talker;
+   STRecorder rec;
+   STReplayer rp;
+   STReplies replies;
+   char reply_buffer[STK_REPLY_BUFFER_SIZE];
+
+   // Record a session with the fake server:
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+      return 1;
+
+   if ((child = fork()) == 0)
+   {
+      close(pair[0]);
+      fake_server(pair[1]);
+      exit(0);
+   }
+   close(pair[1]);
+
+   init_sock_talker(&sock_talker, &pair[0]);
+   if (!init_recording_talker(&talker, &rec, &sock_talker, trace_path))
+      return 1;
+   stk_attach_replies(&talker, &replies, reply_buffer, sizeof(reply_buffer));
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   ok = run_session(&talker);
+   printf("Recorded session %s in %.2f ms.\n", ok ? "completed" : "[31;1mFAILED[m", elapsed_ms(&start));
+
+   recorder_close(&rec);
+   close(pair[0]);
+   waitpid(child, NULL, 0);
+
+   // Replay with the recorded timing, then as fast as possible:
+   if (!init_replay_talker(&talker, &rp, trace_path, 1.0))
+      return 1;
+   stk_attach_replies(&talker, &replies, reply_buffer, sizeof(reply_buffer));
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   ok &= run_session(&talker);
+   printf("Replayed with recorded timing in %.2f ms, %lu mismatches.\n", elapsed_ms(&start), rp.mismatches);
+
+   rp.time_scale = 0;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (index = 0; index < REPLAYS; ++index)
+   {
+      replay_rewind(&rp);
+      ok &= run_session(&talker);
+   }
+   printf("Replayed %d times without delays: [32;1m%.2f[m us per session, %lu mismatches.\n",
+          REPLAYS,
+          elapsed_ms(&start) * 1000 / REPLAYS,
+          rp.mismatches);
+
+   replay_close(&rp);
+   return !ok;
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include "socktalk.h"
+
+/**
+ * Session traces: a recording talker saves every read and write of
+ * a real conversation, and a replay talker plays the server's side of
+ * it back, so the SMTP code can be measured without a network.
+ *
+ * A trace file starts with TRACE_MAGIC, followed by records of
+ * TRACE_RECORD_HEADER bytes:
+ *   1 byte   'W' for bytes written, 'R' for bytes read
+ *   4 bytes  microseconds since the previous record (host order)
+ *   4 bytes  data length (host order)
+ * then the data.
+ */
+#define TRACE_MAGIC "MTKTRC1\n"
+#define TRACE_MAGIC_LEN 8
+#define TRACE_RECORD_HEADER 9
+
+/**
+ * @brief Wraps another talker, saving what passes through it.
+ */
+typedef struct _stalker_recorder
+{
+   const STalker      *inner;
+   FILE               *trace;
+   unsigned long long last_ns;
+} STRecorder;
+
+/**
+ * @brief Prepare *talker* to pass reads and writes to *inner*,
+ *        recording them in a new trace file at *trace_path*.
+ *
+ * Attach an STReplies buffer to *talker*, not *inner*, so replies are
+ * read through the recorder.
+ *
+ * @return 1 for success, 0 if the trace file could not be created.
+ */
+int init_recording_talker(STalker *talker, STRecorder *rec, const STalker *inner, const char *trace_path);
+void recorder_close(STRecorder *rec);
+
+int stk_recording_writer(const STalker *talker, const void *data, int data_len);
+int stk_recording_reader(const STalker *talker, void *buffer, int buff_len);
+
+/**
+ * @brief Plays back the server side of a trace.
+ *
+ * Reads return the recorded server data, waiting the recorded time
+ * multiplied by *time_scale* (0 for no waiting).  Writes are compared
+ * with the recorded client data and always succeed, with differences
+ * counted in *mismatches*.
+ */
+typedef struct _stalker_replayer
+{
+   char               *trace;
+   size_t             trace_len;
+   size_t             record;       // offset of the current record's header
+   size_t             consumed;     // bytes of the current record's data used
+   double             time_scale;
+   unsigned long long last_ns;
+   unsigned long      mismatches;
+} STReplayer;
+
+/**
+ * @brief Load the trace at *trace_path* and prepare *talker* to play it.
+ *
+ * @return 1 for success, 0 if the file could not be read or is not a trace.
+ */
+int init_replay_talker(STalker *talker, STReplayer *rp, const char *trace_path, double time_scale);
+
+/** Start the replay again from the first record. */
+void replay_rewind(STReplayer *rp);
+void replay_close(STReplayer *rp);
+
+int stk_replay_writer(const STalker *talker, const void *data, int data_len);
+int stk_replay_reader(const STalker *talker, void *buffer, int buff_len);
+
+#endif
@@ -0,0 +1,1139 @@
+// -*- compile-command: "base=uring; gcc -Wall -Werror -ggdb -DURING_MAIN -DMAILTK_URING -DDEBUG -D_GNU_SOURCE -o $base ${base}.c socktalk.c logging.c -lssl -lcrypto -luring" -*-
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "uring.h"
+#include "logging.h"
+
+static int init_slots(URing *ur, int max_conns)
+{
+   int index;
+
+   ur->max_conns = max_conns;
+   if (!(ur->free_slots = (int*)malloc(max_conns * sizeof(int))))
+      return 0;
+
+   // Stacked so the lowest slots are used first:
+   for (index = 0; index < max_conns; ++index)
+      ur->free_slots[index] = max_conns - 1 - index;
+   ur->free_count = max_conns;
+
+   return 1;
+}
+
+static int claim_slot(URing *ur)
+{
+   if (ur->free_count == 0)
+   {
+      log_error_message(1, "No free connection slot in the ring.", NULL);
+      return -1;
+   }
+
+   return ur->free_slots[--ur->free_count];
+}
+
+static void release_slot(URing *ur, int slot)
+{
+   ur->free_slots[ur->free_count++] = slot;
+}
+
+/*************************************************
+ * poll() connections, without liburing, or when
+ * the kernel refuses io_uring at run time
+ ************************************************/
+
+static int poll_init(URing *ur, int max_conns)
+{
+   int index;
+
+#ifdef MAILTK_URING
+   ur->poll_only = 1;
+#endif
+
+   ur->polls = (struct pollfd*)malloc(max_conns * sizeof(struct pollfd));
+   ur->conns = (URingConn**)malloc(max_conns * sizeof(URingConn*));
+
+   if (!ur->polls || !ur->conns || !init_slots(ur, max_conns))
+   {
+      log_error_message(1, "Out of memory for the connection table.", NULL);
+      free(ur->polls);
+      free(ur->conns);
+      free(ur->free_slots);
+      memset(ur, 0, sizeof(URing));
+      return 0;
+   }
+
+   for (index = 0; index < max_conns; ++index)
+      ur->polls[index].fd = -1;
+
+   return 1;
+}
+
+static void poll_close(URing *ur)
+{
+   free(ur->polls);
+   free(ur->conns);
+   free(ur->free_slots);
+
+   memset(ur, 0, sizeof(URing));
+}
+
+/** Record the result of a connect, 0 or an errno value, and stop watching for it. */
+static void finish_connect(URingConn *conn, int error)
+{
+   conn->connect_status = -error;
+   conn->ur->polls[conn->slot].events = POLLIN;
+
+   if (conn->restore_blocking)
+      fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL, NULL) & ~O_NONBLOCK);
+}
+
+/** The result of a connect that was in progress, once poll() reports it finished. */
+static int pending_connect_error(int fd)
+{
+   int error = 0;
+   socklen_t error_len = sizeof(error);
+
+   if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len))
+      error = errno;
+
+   return error;
+}
+
+static int poll_wait_timeout(URing *ur, int min_complete, int timeout_ms)
+{
+   int index, ready;
+
+   ready = poll(ur->polls, ur->max_conns, min_complete > 0 ? timeout_ms : 0);
+   ++ur->submits;
+
+   if (ready < 0)
+      return errno == EINTR ? 0 : -1;
+
+   for (index = 0; index < ur->max_conns; ++index)
+      if (ur->polls[index].fd >= 0
+          && ur->polls[index].revents
+          && ur->conns[index]->connect_status == URING_CONNECTING)
+         finish_connect(ur->conns[index], pending_connect_error(ur->polls[index].fd));
+
+   ur->completions += ready;
+   return ready;
+}
+
+static int poll_init_conn(URingConn *conn, URing *ur, int fd)
+{
+   memset(conn, 0, sizeof(URingConn));
+   conn->fd = fd;
+   conn->ur = ur;
+
+   if ((conn->slot = claim_slot(ur)) < 0)
+      return 0;
+
+   ur->polls[conn->slot].fd = fd;
+   ur->polls[conn->slot].events = POLLIN;
+   ur->conns[conn->slot] = conn;
+
+   return 1;
+}
+
+static void poll_conn_close(URingConn *conn)
+{
+   if (conn->slot < 0)
+      return;
+
+   conn->ur->polls[conn->slot].fd = -1;
+   release_slot(conn->ur, conn->slot);
+   conn->slot = -1;
+}
+
+static int poll_start_connect(URingConn *conn, const struct sockaddr *addr, socklen_t addr_len)
+{
+   int options = fcntl(conn->fd, F_GETFL, NULL);
+   int error;
+
+   conn->restore_blocking = !(options & O_NONBLOCK);
+   if (conn->restore_blocking && fcntl(conn->fd, F_SETFL, options | O_NONBLOCK) < 0)
+      return 0;
+
+   conn->connect_status = URING_CONNECTING;
+
+   if (connect(conn->fd, addr, addr_len) == 0)
+      finish_connect(conn, 0);
+   else if ((error = errno) == EINPROGRESS)
+      conn->ur->polls[conn->slot].events = POLLOUT;
+   else
+   {
+      // Failed at once, as for an unreachable network or a missing socket file:
+      finish_connect(conn, error);
+      errno = error;
+      return 0;
+   }
+
+   return 1;
+}
+
+static int poll_connect(URingConn *conn, const struct sockaddr *addr, socklen_t addr_len, int timeout_ms)
+{
+   struct pollfd pfd = { conn->fd, POLLOUT, 0 };
+
+   if (!poll_start_connect(conn, addr, addr_len))
+      return 0;
+
+   if (conn->connect_status == URING_CONNECTING)
+   {
+      if (poll(&pfd, 1, timeout_ms > 0 ? timeout_ms : -1) > 0)
+         finish_connect(conn, pending_connect_error(conn->fd));
+      else
+         finish_connect(conn, ETIMEDOUT);
+   }
+
+   if (conn->connect_status < 0)
+   {
+      errno = -conn->connect_status;
+      return 0;
+   }
+
+   return 1;
+}
+
+static void init_poll_talker(STalker *talker, URingConn *conn)
+{
+   init_sock_talker(talker, &conn->fd);
+}
+
+static void init_nb_poll_talker(STalker *talker, URingConn *conn)
+{
+   if (!init_nb_sock_talker(talker, &conn->fd))
+      log_error_message(1, "Failed to make the socket non-blocking: ", strerror(errno), NULL);
+}
+
+#ifdef MAILTK_URING
+
+// Operations, kept in the low bits of each submission's user data
+#define UOP_SEND    0
+#define UOP_RECV    1
+#define UOP_CONNECT 2
+#define UOP_TIMEOUT 3
+#define UOP_MASK    3
+
+static inline __u64 uring_tag(URingConn *conn, int op)
+{
+   return (__u64)(uintptr_t)conn | op;
+}
+
+static inline char *recv_buffer(const URing *ur, int bid)
+{
+   return ur->recv_buffers + (size_t)bid * URING_RECV_BUFFER_SIZE;
+}
+
+static inline char *send_buffer(const URing *ur, int slot)
+{
+   return ur->send_buffers + (size_t)slot * URING_SEND_SLOT;
+}
+
+static void return_recv_buffer(URing *ur, int bid)
+{
+   io_uring_buf_ring_add(ur->buf_ring,
+                         recv_buffer(ur, bid),
+                         URING_RECV_BUFFER_SIZE,
+                         bid,
+                         io_uring_buf_ring_mask(ur->recv_count),
+                         0);
+   io_uring_buf_ring_advance(ur->buf_ring, 1);
+}
+
+// Set once the kernel refuses io_uring, so later rings go straight to poll()
+static int uring_refused = 0;
+
+int uring_init(URing *ur, int max_conns)
+{
+   int result, bid;
+
+   memset(ur, 0, sizeof(URing));
+
+   if (uring_refused)
+      return poll_init(ur, max_conns);
+
+   // Without io_uring, as under a seccomp filter or the io_uring_disabled
+   // sysctl, the connections can still be served with poll():
+   if ((result = io_uring_queue_init(URING_ENTRIES, &ur->ring, 0)) < 0)
+   {
+      log_error_message(1, "Failed to set up io_uring, so using poll(): ", strerror(-result), NULL);
+      uring_refused = 1;
+      return poll_init(ur, max_conns);
+   }
+
+   for (ur->recv_count = 8; ur->recv_count < max_conns * 2 && ur->recv_count < URING_RECV_BUFFERS; )
+      ur->recv_count *= 2;
+
+   ur->buf_ring = io_uring_setup_buf_ring(&ur->ring, ur->recv_count, URING_BUFFER_GROUP, 0, &result);
+   if (!ur->buf_ring)
+   {
+      log_error_message(1, "Failed to register an io_uring buffer ring, so using poll(): ", strerror(-result), NULL);
+      io_uring_queue_exit(&ur->ring);
+      uring_refused = 1;
+      return poll_init(ur, max_conns);
+   }
+
+   ur->recv_buffers = (char*)malloc((size_t)ur->recv_count * URING_RECV_BUFFER_SIZE);
+   ur->chunk_next = (short*)malloc(ur->recv_count * sizeof(short));
+   ur->chunk_len = (int*)malloc(ur->recv_count * sizeof(int));
+   ur->send_buffers = (char*)malloc((size_t)max_conns * URING_SEND_SLOT);
+
+   if (!ur->recv_buffers || !ur->chunk_next || !ur->chunk_len || !ur->send_buffers
+       || !init_slots(ur, max_conns))
+   {
+      log_error_message(1, "Out of memory for io_uring buffers.", NULL);
+      uring_close(ur);
+      return 0;
+   }
+
+   for (bid = 0; bid < ur->recv_count; ++bid)
+      io_uring_buf_ring_add(ur->buf_ring,
+                            recv_buffer(ur, bid),
+                            URING_RECV_BUFFER_SIZE,
+                            bid,
+                            io_uring_buf_ring_mask(ur->recv_count),
+                            bid);
+   io_uring_buf_ring_advance(ur->buf_ring, ur->recv_count);
+
+   ur->multishot = 1;
+   return 1;
+}
+
+void uring_close(URing *ur)
+{
+   if (ur->poll_only)
+   {
+      poll_close(ur);
+      return;
+   }
+
+   if (ur->buf_ring)
+   {
+      io_uring_free_buf_ring(&ur->ring, ur->buf_ring, ur->recv_count, URING_BUFFER_GROUP);
+      io_uring_queue_exit(&ur->ring);
+   }
+
+   free(ur->recv_buffers);
+   free(ur->chunk_next);
+   free(ur->chunk_len);
+   free(ur->send_buffers);
+   free(ur->free_slots);
+
+   memset(ur, 0, sizeof(URing));
+}
+
+/** Get a submission entry, submitting the full queue if there are none left. */
+static struct io_uring_sqe *uring_sqe(URing *ur)
+{
+   struct io_uring_sqe *sqe = io_uring_get_sqe(&ur->ring);
+
+   if (!sqe)
+   {
+      io_uring_submit(&ur->ring);
+      ++ur->submits;
+      sqe = io_uring_get_sqe(&ur->ring);
+   }
+
+   return sqe;
+}
+
+/** Queue a send of the unsent part of the send buffer, if not already sending. */
+static void queue_send(URingConn *conn)
+{
+   URing *ur = conn->ur;
+   struct io_uring_sqe *sqe;
+
+   if (conn->sending || conn->send_start == conn->send_used || conn->error)
+      return;
+
+   if (!(sqe = uring_sqe(ur)))
+   {
+      conn->error = -EBUSY;
+      return;
+   }
+
+   io_uring_prep_send(sqe,
+                      conn->fd,
+                      send_buffer(ur, conn->slot) + conn->send_start,
+                      conn->send_used - conn->send_start,
+                      MSG_NOSIGNAL);
+   io_uring_sqe_set_data64(sqe, uring_tag(conn, UOP_SEND));
+
+   conn->sending = 1;
+   ++conn->inflight;
+}
+
+/** Queue a receive into a buffer from the ring, to repeat if the kernel can. */
+static void arm_recv(URingConn *conn)
+{
+   URing *ur = conn->ur;
+   struct io_uring_sqe *sqe;
+
+   if (!(sqe = uring_sqe(ur)))
+   {
+      conn->error = -EBUSY;
+      return;
+   }
+
+   if (ur->multishot)
+      io_uring_prep_recv_multishot(sqe, conn->fd, NULL, 0, 0);
+   else
+      io_uring_prep_recv(sqe, conn->fd, NULL, URING_RECV_BUFFER_SIZE, 0);
+
+   sqe->flags |= IOSQE_BUFFER_SELECT;
+   sqe->buf_group = URING_BUFFER_GROUP;
+   io_uring_sqe_set_data64(sqe, uring_tag(conn, UOP_RECV));
+
+   conn->recv_armed = 1;
+   ++conn->inflight;
+}
+
+static void handle_send(URingConn *conn, int result)
+{
+   char *buffer = send_buffer(conn->ur, conn->slot);
+
+   conn->sending = 0;
+   --conn->inflight;
+
+   if (result < 0)
+      conn->error = result;
+   else
+   {
+      conn->send_start += result;
+      if (conn->send_start == conn->send_used)
+         conn->send_start = conn->send_used = 0;
+      else
+      {
+         // Move what was short-sent, or written meanwhile, to the front:
+         memmove(buffer, buffer + conn->send_start, conn->send_used - conn->send_start);
+         conn->send_used -= conn->send_start;
+         conn->send_start = 0;
+         queue_send(conn);
+      }
+   }
+}
+
+static void handle_recv(URingConn *conn, int result, unsigned flags)
+{
+   URing *ur = conn->ur;
+   int bid;
+
+   if (!(flags & IORING_CQE_F_MORE))
+   {
+      conn->recv_armed = 0;
+      --conn->inflight;
+   }
+
+   if (result > 0)
+   {
+      bid = flags >> IORING_CQE_BUFFER_SHIFT;
+      ur->chunk_len[bid] = result;
+      ur->chunk_next[bid] = -1;
+
+      if (conn->recv_tail >= 0)
+         ur->chunk_next[conn->recv_tail] = bid;
+      else
+         conn->recv_head = bid;
+      conn->recv_tail = bid;
+   }
+   else if (result == 0)
+      conn->eof = 1;
+   else if (result == -EINVAL && ur->multishot)
+      // Before Linux 6.0: the next receive is armed as single-shot
+      ur->multishot = 0;
+   else if (result != -ENOBUFS && result != -ECANCELED)
+      conn->error = result;
+}
+
+static void handle_completion(URing *ur, const struct io_uring_cqe *cqe)
+{
+   __u64 data = io_uring_cqe_get_data64(cqe);
+   URingConn *conn = (URingConn*)(uintptr_t)(data & ~(__u64)UOP_MASK);
+
+   ++ur->completions;
+
+   // Cancels have no connection:
+   if (!conn)
+      return;
+
+   switch(data & UOP_MASK)
+   {
+      case UOP_SEND:
+         handle_send(conn, cqe->res);
+         break;
+
+      case UOP_RECV:
+         handle_recv(conn, cqe->res, cqe->flags);
+         break;
+
+      case UOP_CONNECT:
+         --conn->inflight;
+         conn->connect_status = cqe->res == -ECANCELED ? -ETIMEDOUT : cqe->res;
+         break;
+
+      case UOP_TIMEOUT:
+         --conn->inflight;
+         break;
+   }
+}
+
+int uring_wait_timeout(URing *ur, int min_complete, int timeout_ms)
+{
+   if (ur->poll_only)
+      return poll_wait_timeout(ur, min_complete, timeout_ms);
+
+   struct io_uring_cqe *cqe;
+   struct __kernel_timespec timeout;
+   unsigned head, count = 0;
+   int result;
+
+   if (timeout_ms >= 0 && min_complete > 0)
+   {
+      timeout.tv_sec = timeout_ms / 1000;
+      timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+      result = io_uring_submit_and_wait_timeout(&ur->ring, &cqe, min_complete, &timeout, NULL);
+   }
+   else
+      result = io_uring_submit_and_wait(&ur->ring, min_complete);
+   ++ur->submits;
+
+   if (result < 0 && result != -EINTR && result != -ETIME)
+   {
+      errno = -result;
+      return -1;
+   }
+
+   io_uring_for_each_cqe(&ur->ring, head, cqe)
+   {
+      handle_completion(ur, cqe);
+      ++count;
+   }
+   io_uring_cq_advance(&ur->ring, count);
+
+   return count;
+}
+
+int uring_wait(URing *ur, int min_complete)
+{
+   return uring_wait_timeout(ur, min_complete, -1);
+}
+
+int init_uring_conn(URingConn *conn, URing *ur, int fd)
+{
+   if (ur->poll_only)
+      return poll_init_conn(conn, ur, fd);
+
+   memset(conn, 0, sizeof(URingConn));
+   conn->fd = fd;
+   conn->ur = ur;
+   conn->recv_head = conn->recv_tail = -1;
+
+   return (conn->slot = claim_slot(ur)) >= 0;
+}
+
+int uring_conn_flush(URingConn *conn)
+{
+   while (conn->send_used > 0 && !conn->error)
+   {
+      queue_send(conn);
+      if (uring_wait(conn->ur, 1) < 0)
+         return 0;
+   }
+
+   return !conn->error;
+}
+
+void uring_conn_close(URingConn *conn)
+{
+   URing *ur = conn->ur;
+   struct io_uring_sqe *sqe;
+   int bid;
+
+   if (ur->poll_only)
+   {
+      poll_conn_close(conn);
+      return;
+   }
+
+   if (conn->slot < 0)
+      return;
+
+   uring_conn_flush(conn);
+
+   if (conn->recv_armed && (sqe = uring_sqe(ur)))
+   {
+      io_uring_prep_cancel64(sqe, uring_tag(conn, UOP_RECV), 0);
+      io_uring_sqe_set_data64(sqe, 0);
+   }
+
+   // A connect that lost a race, or is abandoned, need not run its course:
+   if (conn->connect_status == URING_CONNECTING && (sqe = uring_sqe(ur)))
+   {
+      io_uring_prep_cancel64(sqe, uring_tag(conn, UOP_CONNECT), 0);
+      io_uring_sqe_set_data64(sqe, 0);
+   }
+
+   // Completions still to come refer to *conn*:
+   while (conn->inflight > 0 && uring_wait(ur, 1) >= 0)
+      ;
+
+   while ((bid = conn->recv_head) >= 0)
+   {
+      conn->recv_head = ur->chunk_next[bid];
+      return_recv_buffer(ur, bid);
+   }
+
+   release_slot(ur, conn->slot);
+   conn->slot = -1;
+}
+
+int uring_start_connect(URingConn *conn, const struct sockaddr *addr, socklen_t addr_len, int timeout_ms)
+{
+   URing *ur = conn->ur;
+   struct io_uring_sqe *sqe;
+
+   if (ur->poll_only)
+      return poll_start_connect(conn, addr, addr_len);
+
+   // The connect and its timeout must be submitted together:
+   if (io_uring_sq_space_left(&ur->ring) < 2)
+   {
+      io_uring_submit(&ur->ring);
+      ++ur->submits;
+   }
+
+   if (!(sqe = io_uring_get_sqe(&ur->ring)))
+   {
+      errno = EBUSY;
+      return 0;
+   }
+
+   io_uring_prep_connect(sqe, conn->fd, addr, addr_len);
+   io_uring_sqe_set_data64(sqe, uring_tag(conn, UOP_CONNECT));
+   conn->connect_status = URING_CONNECTING;
+   ++conn->inflight;
+
+   if (timeout_ms > 0)
+   {
+      sqe->flags |= IOSQE_IO_LINK;
+
+      conn->connect_timeout.tv_sec = timeout_ms / 1000;
+      conn->connect_timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+      sqe = io_uring_get_sqe(&ur->ring);
+      io_uring_prep_link_timeout(sqe, &conn->connect_timeout, 0);
+      io_uring_sqe_set_data64(sqe, uring_tag(conn, UOP_TIMEOUT));
+      ++conn->inflight;
+   }
+
+   return 1;
+}
+
+int uring_connect(URingConn *conn, const struct sockaddr *addr, socklen_t addr_len, int timeout_ms)
+{
+   if (conn->ur->poll_only)
+      return poll_connect(conn, addr, addr_len, timeout_ms);
+
+   if (!uring_start_connect(conn, addr, addr_len, timeout_ms))
+      return 0;
+
+   while (conn->connect_status == URING_CONNECTING)
+      if (uring_wait(conn->ur, 1) < 0)
+         return 0;
+
+   if (conn->connect_status < 0)
+   {
+      errno = -conn->connect_status;
+      return 0;
+   }
+
+   return 1;
+}
+
+static int uring_write(const STalker *talker, const void *data, int data_len, int wait)
+{
+   URingConn *conn = (URingConn*)talker->conduit;
+   int room, bite;
+
+   while ((room = URING_SEND_SLOT - conn->send_used) == 0 && !conn->error)
+   {
+      queue_send(conn);
+      if (!wait)
+         return STK_WANT_WRITE;
+      if (uring_wait(conn->ur, 1) < 0)
+         return -1;
+   }
+
+   if (conn->error)
+   {
+      errno = -conn->error;
+      return -1;
+   }
+
+   bite = data_len < room ? data_len : room;
+   memcpy(send_buffer(conn->ur, conn->slot) + conn->send_used, data, bite);
+   conn->send_used += bite;
+
+   if (!(talker->flags & STK_MORE))
+      queue_send(conn);
+
+   return bite;
+}
+
+static int uring_read(const STalker *talker, void *buffer, int buff_len, int wait)
+{
+   URingConn *conn = (URingConn*)talker->conduit;
+   URing *ur = conn->ur;
+   char *ptr = (char*)buffer;
+   char *end = ptr + buff_len;
+   int bid, bite;
+
+   // The reply may depend on writes held by STK_MORE:
+   queue_send(conn);
+
+   while (conn->recv_head < 0)
+   {
+      if (conn->error)
+      {
+         errno = -conn->error;
+         return -1;
+      }
+      else if (conn->eof)
+         return 0;
+
+      if (!conn->recv_armed)
+         arm_recv(conn);
+
+      if (!wait)
+         return STK_WANT_READ;
+      if (uring_wait(ur, 1) < 0)
+         return -1;
+   }
+
+   while ((bid = conn->recv_head) >= 0 && ptr < end)
+   {
+      bite = ur->chunk_len[bid] - conn->recv_offset;
+      if (bite > end - ptr)
+         bite = end - ptr;
+
+      memcpy(ptr, recv_buffer(ur, bid) + conn->recv_offset, bite);
+      ptr += bite;
+      conn->recv_offset += bite;
+
+      if (conn->recv_offset == ur->chunk_len[bid])
+      {
+         conn->recv_head = ur->chunk_next[bid];
+         if (conn->recv_head < 0)
+            conn->recv_tail = -1;
+         conn->recv_offset = 0;
+         return_recv_buffer(ur, bid);
+      }
+   }
+
+   return ptr - (char*)buffer;
+}
+
+int stk_uring_writer(const STalker *talker, const void *data, int data_len)
+{
+   return uring_write(talker, data, data_len, 1);
+}
+
+int stk_uring_reader(const STalker *talker, void *buffer, int buff_len)
+{
+   return uring_read(talker, buffer, buff_len, 1);
+}
+
+int stk_nb_uring_writer(const STalker *talker, const void *data, int data_len)
+{
+   return uring_write(talker, data, data_len, 0);
+}
+
+int stk_nb_uring_reader(const STalker *talker, void *buffer, int buff_len)
+{
+   return uring_read(talker, buffer, buff_len, 0);
+}
+
+void init_uring_talker(STalker *talker, URingConn *conn)
+{
+   if (conn->ur->poll_only)
+   {
+      init_poll_talker(talker, conn);
+      return;
+   }
+
+   memset(talker, 0, sizeof(STalker));
+   talker->conduit = conn;
+   talker->writer = stk_uring_writer;
+   talker->reader = stk_uring_reader;
+}
+
+void init_nb_uring_talker(STalker *talker, URingConn *conn)
+{
+   if (conn->ur->poll_only)
+   {
+      init_nb_poll_talker(talker, conn);
+      return;
+   }
+
+   memset(talker, 0, sizeof(STalker));
+   talker->conduit = conn;
+   talker->writer = stk_nb_uring_writer;
+   talker->reader = stk_nb_uring_reader;
+}
+
+#else  // without liburing
+
+int uring_init(URing *ur, int max_conns)
+{
+   memset(ur, 0, sizeof(URing));
+   return poll_init(ur, max_conns);
+}
+
+void uring_close(URing *ur)
+{
+   poll_close(ur);
+}
+
+int uring_wait_timeout(URing *ur, int min_complete, int timeout_ms)
+{
+   return poll_wait_timeout(ur, min_complete, timeout_ms);
+}
+
+int uring_wait(URing *ur, int min_complete)
+{
+   return poll_wait_timeout(ur, min_complete, -1);
+}
+
+int init_uring_conn(URingConn *conn, URing *ur, int fd)
+{
+   return poll_init_conn(conn, ur, fd);
+}
+
+int uring_conn_flush(URingConn *conn)
+{
+   return 1;
+}
+
+void uring_conn_close(URingConn *conn)
+{
+   poll_conn_close(conn);
+}
+
+int uring_start_connect(URingConn *conn, const struct sockaddr *addr, socklen_t addr_len, int timeout_ms)
+{
+   return poll_start_connect(conn, addr, addr_len);
+}
+
+int uring_connect(URingConn *conn, const struct sockaddr *addr, socklen_t addr_len, int timeout_ms)
+{
+   return poll_connect(conn, addr, addr_len, timeout_ms);
+}
+
+void init_uring_talker(STalker *talker, URingConn *conn)
+{
+   init_poll_talker(talker, conn);
+}
+
+void init_nb_uring_talker(STalker *talker, URingConn *conn)
+{
+   init_nb_poll_talker(talker, conn);
+}
+
+#endif
+
+
+/************************************
+ * Conditionally-compiled test code.
+ ***********************************/
+
+#ifdef URING_MAIN
+
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define CONNECTIONS 200
+#define ROUNDS 50
+
+/** Answer NOOP with 250 and QUIT with 221 on every connection accepted. */
+void fake_server(int listener)
+{
+   struct pollfd polls[CONNECTIONS + 1];
+   char buffer[1024];
+   int count = 1, index, bytes_read, closed = 0;
+
+   polls[0].fd = listener;
+   polls[0].events = POLLIN;
+
+   while (closed < CONNECTIONS && poll(polls, count, -1) > 0)
+   {
+      if ((polls[0].revents & POLLIN) && count <= CONNECTIONS)
+      {
+         polls[count].fd = accept(listener, NULL, NULL);
+         polls[count++].events = POLLIN;
+      }
+
+      for (index = 1; index < count; ++index)
+      {
+         if (polls[index].fd >= 0 && (polls[index].revents & (POLLIN | POLLHUP)))
+         {
+            // Commands are small and answered before the next is sent:
+            if ((bytes_read = read(polls[index].fd, buffer, sizeof(buffer))) <= 0)
+            {
+               close(polls[index].fd);
+               polls[index].fd = -1;
+               ++closed;
+            }
+            else if (strncmp(buffer, "QUIT", 4) == 0)
+               write(polls[index].fd, "221 Bye\r\n", 9);
+            else
+               write(polls[index].fd, "250 OK\r\n", 8);
+         }
+      }
+   }
+}
+
+double elapsed_ms(const struct timespec *start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+typedef struct _client
+{
+   URingConn   conn;
+   STalker     talker;
+   STReplies   replies;
+   char        reply_buffer[256];
+   int         waiting;
+} Client;
+
+/**
+ * Send NOOP on every connection, then collect the replies as they
+ * arrive, ROUNDS times, with non-blocking uring talkers.
+ */
+int run_uring(URing *ur, Client *clients, const struct sockaddr_in *addr)
+{
+   char reply[256];
+   int index, pending, result;
+
+   for (index = 0; index < CONNECTIONS; ++index)
+   {
+      init_uring_conn(&clients[index].conn, ur, socket(AF_INET, SOCK_STREAM, 0));
+      uring_start_connect(&clients[index].conn, (const struct sockaddr*)addr, sizeof(*addr), 1000);
+   }
+
+   for (pending = CONNECTIONS; pending > 0; )
+   {
+      if (uring_wait(ur, 1) < 0)
+         return 0;
+      for (pending = index = 0; index < CONNECTIONS; ++index)
+         pending += clients[index].conn.connect_status == URING_CONNECTING;
+   }
+
+   for (index = 0; index < CONNECTIONS; ++index)
+   {
+      if (clients[index].conn.connect_status != 0)
+         return 0;
+
+      init_nb_uring_talker(&clients[index].talker, &clients[index].conn);
+      stk_attach_replies(&clients[index].talker,
+                         &clients[index].replies,
+                         clients[index].reply_buffer,
+                         sizeof(clients[index].reply_buffer));
+   }
+
+   ur->submits = ur->completions = 0;
+
+   for (int round = 0; round < ROUNDS; ++round)
+   {
+      for (index = 0; index < CONNECTIONS; ++index)
+      {
+         stk_send_line(&clients[index].talker, "NOOP", NULL);
+         clients[index].waiting = 1;
+      }
+
+      pending = CONNECTIONS;
+      while (pending > 0)
+      {
+         for (index = 0; index < CONNECTIONS; ++index)
+         {
+            if (clients[index].waiting)
+            {
+               result = stk_recv_reply(&clients[index].talker, reply, sizeof(reply));
+               if (result > 0)
+               {
+                  clients[index].waiting = 0;
+                  --pending;
+               }
+               else if (result != STK_WANT_READ)
+                  return 0;
+            }
+         }
+
+         if (pending > 0 && uring_wait(ur, 1) < 0)
+            return 0;
+      }
+   }
+
+   for (index = 0; index < CONNECTIONS; ++index)
+   {
+      uring_conn_close(&clients[index].conn);
+      close(clients[index].conn.fd);
+   }
+
+   return 1;
+}
+
+/** The same exchange with blocking socket talkers, two system calls per command. */
+int run_sockets(Client *clients, const struct sockaddr_in *addr)
+{
+   char reply[256];
+   int index, round;
+
+   for (index = 0; index < CONNECTIONS; ++index)
+   {
+      clients[index].conn.fd = socket(AF_INET, SOCK_STREAM, 0);
+      if (connect(clients[index].conn.fd, (const struct sockaddr*)addr, sizeof(*addr)))
+         return 0;
+      init_sock_talker(&clients[index].talker, &clients[index].conn.fd);
+   }
+
+   for (round = 0; round < ROUNDS; ++round)
+   {
+      for (index = 0; index < CONNECTIONS; ++index)
+         stk_send_line(&clients[index].talker, "NOOP", NULL);
+      for (index = 0; index < CONNECTIONS; ++index)
+         if (stk_recv_line(&clients[index].talker, reply, sizeof(reply)) <= 0)
+            return 0;
+   }
+
+   for (index = 0; index < CONNECTIONS; ++index)
+      close(clients[index].conn.fd);
+
+   return 1;
+}
+
+/**
+ * Connects that fail at once must be reported as failures, not as
+ * connected sockets.
+ */
+int test_immediate_failures(URing *ur)
+{
+   struct sockaddr_in unreachable;
+   struct sockaddr_un missing;
+   URingConn conn;
+   int fd, connected, error, ok = 1;
+
+   memset(&unreachable, 0, sizeof(unreachable));
+   unreachable.sin_family = AF_INET;
+   unreachable.sin_port = htons(25);
+   unreachable.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+
+   memset(&missing, 0, sizeof(missing));
+   missing.sun_family = AF_UNIX;
+   strcpy(missing.sun_path, "/nonexistent/uring.sock");
+
+   fd = socket(AF_INET, SOCK_STREAM, 0);
+   init_uring_conn(&conn, ur, fd);
+   connected = uring_connect(&conn, (const struct sockaddr*)&unreachable, sizeof(unreachable), 1000);
+   error = errno;
+   uring_conn_close(&conn);
+   close(fd);
+
+   printf("Connect to 255.255.255.255: %s\n", connected ? "[31;1mCONNECTED[m" : strerror(error));
+   ok &= !connected;
+
+   fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   init_uring_conn(&conn, ur, fd);
+   connected = uring_connect(&conn, (const struct sockaddr*)&missing, sizeof(missing), 1000);
+   error = errno;
+   uring_conn_close(&conn);
+   close(fd);
+
+   printf("Connect to a missing socket file: %s\n", connected ? "[31;1mCONNECTED[m" : strerror(error));
+   ok &= !connected && error == ENOENT;
+
+   return ok;
+}
+
+/** Fork a server listening on an ephemeral loopback port, setting *addr* to it. */
+pid_t start_server(struct sockaddr_in *addr)
+{
+   socklen_t addr_len = sizeof(*addr);
+   int listener = socket(AF_INET, SOCK_STREAM, 0);
+   pid_t child;
+
+   memset(addr, 0, sizeof(*addr));
+   addr->sin_family = AF_INET;
+   addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   if (bind(listener, (struct sockaddr*)addr, sizeof(*addr))
+       || listen(listener, CONNECTIONS)
+       || getsockname(listener, (struct sockaddr*)addr, &addr_len))
+      return -1;
+
+   fflush(stdout);
+   if ((child = fork()) == 0)
+   {
+      fake_server(listener);
+      exit(0);
+   }
+
+   close(listener);
+   return child;
+}
+
+int main(int argc, const char **argv)
+{
+   Client *clients = (Client*)calloc(CONNECTIONS, sizeof(Client));
+   struct sockaddr_in addr;
+   struct timespec start;
+   URing ur;
+   pid_t child;
+   int ok;
+
+   if (!uring_init(&ur, CONNECTIONS))
+      return 1;
+
+   if (!test_immediate_failures(&ur))
+      return 1;
+
+   printf("%d connections, %d rounds of NOOP:\n", CONNECTIONS, ROUNDS);
+
+   child = start_server(&addr);
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   ok = run_uring(&ur, clients, &addr);
+   printf("uring talkers:  %s in %7.2f ms, [32;1m%lu[m uring_wait() system calls for %lu completions\n",
+          ok ? "completed" : "[31;1mFAILED[m",
+          elapsed_ms(&start),
+          ur.submits,
+          ur.completions);
+   waitpid(child, NULL, 0);
+
+   child = start_server(&addr);
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   ok &= run_sockets(clients, &addr);
+   printf("socket talkers: %s in %7.2f ms, [32;1m%d[m system calls\n",
+          ok ? "completed" : "[31;1mFAILED[m",
+          elapsed_ms(&start),
+          2 * CONNECTIONS * ROUNDS);
+   waitpid(child, NULL, 0);
+
+   uring_close(&ur);
+   free(clients);
+
+   return !ok;
+}
+
+#endif
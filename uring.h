@@ -0,0 +1,173 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/socket.h>
+#include <poll.h>
+
+#ifdef MAILTK_URING
+#include <liburing.h>
+#endif
+
+#include "socktalk.h"
+
+/**
+ * io_uring talkers, for many connections on one thread.
+ *
+ * Connections sharing a URing have their reads, writes and connects
+ * submitted together, so one io_uring_enter() call can serve every
+ * connection that is ready.  Each connection sends from its own
+ * slice of a send buffer, and receives into buffers that the kernel
+ * picks from a registered buffer ring shared by the connections, with
+ * one multishot receive per connection where the kernel supports it.
+ *
+ * Build with "make URING=1" (MAILTK_URING) to use liburing.  Without
+ * it, or if the kernel refuses io_uring at run time, the same functions
+ * make ordinary socket talkers, uring_wait() waits with poll(), and
+ * only uring_connect() applies a timeout.
+ */
+
+#define URING_ENTRIES          256          // submission queue entries
+#define URING_RECV_BUFFERS     256          // most receive buffers shared by a ring's connections
+#define URING_RECV_BUFFER_SIZE 4096
+#define URING_SEND_SLOT        (16 * 1024)  // each connection's slice of the send buffer
+#define URING_BUFFER_GROUP     1
+
+typedef struct _uring
+{
+#ifdef MAILTK_URING
+   struct io_uring          ring;
+   struct io_uring_buf_ring *buf_ring;
+   char                     *recv_buffers;
+   int                      recv_count;       // a power of 2, two per connection up to URING_RECV_BUFFERS
+   short                    *chunk_next;      // receive queue links, indexed by buffer id
+   int                      *chunk_len;       // bytes received in each buffer
+   char                     *send_buffers;    // URING_SEND_SLOT per connection
+   int                      multishot;        // cleared if the kernel refuses multishot receives
+   int                      poll_only;        // set if the kernel refused io_uring, to use poll()
+#endif
+   struct pollfd            *polls;           // the connections' sockets, indexed by slot, for poll()
+   struct _uring_conn       **conns;
+   int                      max_conns;
+   int                      *free_slots;
+   int                      free_count;
+   unsigned long            submits;          // system calls made to submit or wait
+   unsigned long            completions;
+} URing;
+
+/**
+ * @brief One connection of a URing.
+ *
+ * The fd comes first so a fallback socket talker can use the
+ * connection as its conduit.
+ */
+typedef struct _uring_conn
+{
+   int   fd;
+   URing *ur;
+   int   slot;             // index of this connection's send buffer, or poll entry
+   int   connect_status;   // URING_CONNECTING, 0 once connected, or negative errno
+#ifdef MAILTK_URING
+   int   send_start;       // first byte not yet sent
+   int   send_used;        // bytes written into the send buffer
+   int   sending;          // set while a write is submitted
+   int   recv_head;        // receive buffers queued for reading, or -1
+   int   recv_tail;
+   int   recv_offset;      // bytes of the head buffer already read
+   int   recv_armed;       // set while a receive is submitted
+   int   inflight;         // operations whose completions are still to come
+   int   eof;
+   int   error;            // negative errno from a failed operation
+   struct __kernel_timespec connect_timeout;
+#endif
+   int   restore_blocking; // with poll(), clear O_NONBLOCK when the connect finishes
+} URingConn;
+
+#define URING_CONNECTING 1
+
+/**
+ * @brief Set up a ring for up to *max_conns* connections.
+ *
+ * If io_uring, or a feature it needs (buffer rings, Linux 5.19), is
+ * missing, the ring logs the reason and uses poll() instead.
+ *
+ * @return 1 for success, or 0 if out of memory.
+ */
+int uring_init(URing *ur, int max_conns);
+void uring_close(URing *ur);
+
+/**
+ * @brief Submit what the connections have queued, wait for at least
+ *        *min_complete* completions, and handle every completion
+ *        available.
+ *
+ * Use this to drive non-blocking uring talkers: after each talker
+ * call returns STK_WANT_READ or STK_WANT_WRITE, call uring_wait(),
+ * then try the calls again.
+ *
+ * @return The number of completions handled, or -1 for failure.
+ */
+int uring_wait(URing *ur, int min_complete);
+
+/**
+ * @brief Like uring_wait(), but stop waiting after *timeout_ms*
+ *        (no limit if negative), returning 0 if nothing completed.
+ */
+int uring_wait_timeout(URing *ur, int min_complete, int timeout_ms);
+
+/**
+ * @brief Add the connected (or yet to connect) socket *fd* to *ur*.
+ *
+ * @return 1 for success, 0 if the ring already has max_conns connections.
+ */
+int init_uring_conn(URingConn *conn, URing *ur, int fd);
+
+/**
+ * @brief Send what remains to be sent, stop receiving, and remove the
+ *        connection from its ring.  The caller closes the socket.
+ */
+void uring_conn_close(URingConn *conn);
+
+/**
+ * @brief Queue a connect of *conn*'s socket to *addr*, failing after
+ *        *timeout_ms* (no limit if 0).
+ *
+ * *addr* must remain valid until the next uring_wait().  The result is
+ * in conn->connect_status, which remains URING_CONNECTING until the
+ * connect succeeds (0) or fails (a negative errno).
+ *
+ * @return 1 if the connect is under way or done, or 0 with errno set
+ *         if it could not be queued, or, with poll(), failed at once.
+ */
+int uring_start_connect(URingConn *conn, const struct sockaddr *addr, socklen_t addr_len, int timeout_ms);
+
+/**
+ * @brief Connect *conn*'s socket to *addr*, waiting up to *timeout_ms*.
+ *
+ * @return 1 when connected, or 0 with errno set, ETIMEDOUT if the time ran out.
+ */
+int uring_connect(URingConn *conn, const struct sockaddr *addr, socklen_t addr_len, int timeout_ms);
+
+/** Send everything written to *conn*, waiting as needed.  Returns 0 for failure. */
+int uring_conn_flush(URingConn *conn);
+
+#ifdef MAILTK_URING
+int stk_uring_writer(const STalker *talker, const void *data, int data_len);
+int stk_uring_reader(const STalker *talker, void *buffer, int buff_len);
+int stk_nb_uring_writer(const STalker *talker, const void *data, int data_len);
+int stk_nb_uring_reader(const STalker *talker, void *buffer, int buff_len);
+#endif
+
+/**
+ * @brief Prepare *talker* to talk through *conn*.
+ *
+ * Writes are copied to the connection's send buffer and submitted
+ * with the ring's next uring_wait() (or at once by reads that need to
+ * wait), unless STK_MORE is set, which holds them until a later write
+ * or read.  The blocking talker waits in uring_wait(), handling the
+ * completions of other connections too; the non-blocking talker
+ * returns STK_WANT_READ or STK_WANT_WRITE instead.
+ */
+void init_uring_talker(STalker *talker, URingConn *conn);
+void init_nb_uring_talker(STalker *talker, URingConn *conn);
+
+#endif